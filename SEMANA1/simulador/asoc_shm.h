@@ -0,0 +1,204 @@
+// asoc_shm.h
+// Memoria compartida entre simulador y terminal: las dos colas de E/S y la página
+// de contadores de rendimiento. Los dos programas incluyen este fichero, así que
+// la disposición no puede divergir.
+#ifndef ASOC_SHM_H
+#define ASOC_SHM_H
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define SHM_NAME "/asoc_shm"
+#define ANILLO_TAM 4096 // Potencia de 2
+#define LINEA_CACHE 64
+
+//Cola de un productor y un consumidor. Los índices avanzan sin volver a cero (la
+//posición en buf es índice % ANILLO_TAM), así que caben ANILLO_TAM bytes sin dejar
+//un hueco libre. Cada índice está en su propia línea de caché junto a la copia
+//que su dueño guarda del índice del otro extremo: el productor solo lee la línea
+//del consumidor cuando su copia dice que no hay sitio, y el consumidor la del
+//productor cuando la suya dice que no hay datos.
+//El consumidor puede dormir hasta que haya datos en un futex sobre cabeza (el
+//timbre): antes de dormir pone dormido a 1 y el productor solo hace la llamada al
+//sistema para despertarlo si lo ve así, de modo que mientras el consumidor está
+//despierto encolar no cuesta ninguna llamada. dormido está en la línea del
+//productor porque él la lee en cada escritura y el consumidor solo la escribe al
+//irse a dormir.
+struct anillo {
+    _Alignas(LINEA_CACHE) atomic_uint cabeza; // Solo la escribe el productor
+    unsigned int cola_vista; // Copia de cola del productor
+    atomic_uint dormido; // El consumidor espera en el timbre
+    _Alignas(LINEA_CACHE) atomic_uint cola; // Solo la escribe el consumidor
+    unsigned int cabeza_vista; // Copia de cabeza del consumidor
+    _Alignas(LINEA_CACHE) char buf[ANILLO_TAM];
+};
+
+struct shared_io {
+    struct anillo vth; // vm -> host (salida de la GPU)
+    struct anillo htv; // host -> vm (entrada del teclado)
+};
+
+//Los tramos (hueco libre o datos pendientes) se dan como dos iovec porque pueden
+//dar la vuelta al final de buf; el segundo tiene longitud 0 si no la dan. Así
+//terminal puede pasarlos directamente a readv/writev sin copias intermedias.
+static inline void anillo_tramos(struct anillo * a, unsigned int desde, size_t n, struct iovec v[2]) {
+    size_t pos = desde % ANILLO_TAM;
+    size_t primero = n < ANILLO_TAM - pos ? n : ANILLO_TAM - pos;
+    v[0].iov_base = a->buf + pos;
+    v[0].iov_len = primero;
+    v[1].iov_base = a->buf;
+    v[1].iov_len = n - primero;
+}
+
+//Productor: hueco libre, al menos n bytes si los hay sin mirar la línea del consumidor
+static inline size_t anillo_libre(struct anillo * a, size_t n, struct iovec v[2]) {
+    unsigned int cabeza = atomic_load_explicit(&a->cabeza, memory_order_relaxed);
+    size_t libre = ANILLO_TAM - (cabeza - a->cola_vista);
+    if (libre < n) {
+        a->cola_vista = atomic_load_explicit(&a->cola, memory_order_acquire);
+        libre = ANILLO_TAM - (cabeza - a->cola_vista);
+    }
+    anillo_tramos(a, cabeza, libre, v);
+    return libre;
+}
+
+//Productor: publica los n primeros bytes del hueco devuelto por anillo_libre
+static inline void anillo_publicar(struct anillo * a, size_t n) {
+    if (n == 0) return;
+    unsigned int cabeza = atomic_load_explicit(&a->cabeza, memory_order_relaxed);
+    atomic_store_explicit(&a->cabeza, cabeza + (unsigned int)n, memory_order_release);
+    //Emparejada con la de anillo_esperar: o el consumidor ve la nueva cabeza o
+    //nosotros vemos dormido
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&a->dormido, memory_order_relaxed) &&
+        atomic_exchange_explicit(&a->dormido, 0, memory_order_relaxed)) {
+        syscall(SYS_futex, &a->cabeza, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+//Consumidor: datos pendientes, al menos n bytes si los hay sin mirar la línea del productor
+static inline size_t anillo_datos(struct anillo * a, size_t n, struct iovec v[2]) {
+    unsigned int cola = atomic_load_explicit(&a->cola, memory_order_relaxed);
+    size_t hay = a->cabeza_vista - cola;
+    if (hay < n) {
+        a->cabeza_vista = atomic_load_explicit(&a->cabeza, memory_order_acquire);
+        hay = a->cabeza_vista - cola;
+    }
+    anillo_tramos(a, cola, hay, v);
+    return hay;
+}
+
+//Consumidor: libera los n primeros bytes de los devueltos por anillo_datos
+static inline void anillo_consumir(struct anillo * a, size_t n) {
+    unsigned int cola = atomic_load_explicit(&a->cola, memory_order_relaxed);
+    atomic_store_explicit(&a->cola, cola + (unsigned int)n, memory_order_release);
+}
+
+//Productor: encola hasta n bytes y devuelve cuántos cupieron
+static inline size_t anillo_escribir(struct anillo * a, const char * datos, size_t n) {
+    struct iovec v[2];
+    size_t libre = anillo_libre(a, n, v);
+    if (n > libre) n = libre;
+    size_t primero = n < v[0].iov_len ? n : v[0].iov_len;
+    memcpy(v[0].iov_base, datos, primero);
+    memcpy(v[1].iov_base, datos + primero, n - primero);
+    anillo_publicar(a, n);
+    return n;
+}
+
+//Consumidor: bytes que se pueden leer
+static inline size_t anillo_pendientes(struct anillo * a) {
+    unsigned int cola = atomic_load_explicit(&a->cola, memory_order_relaxed);
+    if (a->cabeza_vista == cola) {
+        a->cabeza_vista = atomic_load_explicit(&a->cabeza, memory_order_acquire);
+    }
+    return a->cabeza_vista - cola;
+}
+
+//Consumidor: saca hasta n bytes y devuelve cuántos había
+static inline size_t anillo_leer(struct anillo * a, char * datos, size_t n) {
+    struct iovec v[2];
+    size_t hay = anillo_datos(a, n, v);
+    if (n > hay) n = hay;
+    size_t primero = n < v[0].iov_len ? n : v[0].iov_len;
+    memcpy(datos, v[0].iov_base, primero);
+    memcpy(datos + primero, v[1].iov_base, n - primero);
+    anillo_consumir(a, n);
+    return n;
+}
+
+//Consumidor: duerme hasta que cabeza deje de valer vista, llegue una señal o pase
+//plazo (NULL para no tener plazo). Puede volver antes sin datos nuevos, así que
+//hay que llamarla en un bucle que compruebe la condición.
+static inline void anillo_esperar(struct anillo * a, unsigned int vista, const struct timespec * plazo) {
+    atomic_store_explicit(&a->dormido, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&a->cabeza, memory_order_relaxed) != vista) {
+        atomic_store_explicit(&a->dormido, 0, memory_order_relaxed);
+        return;
+    }
+    syscall(SYS_futex, &a->cabeza, FUTEX_WAIT, vista, plazo, NULL, 0);
+}
+
+//Despierta a quien espere en el timbre aunque no haya datos nuevos: para cuando
+//los índices cambian por debajo (al iniciar el simulador o restaurar una instantánea)
+static inline void anillo_despertar(struct anillo * a) {
+    atomic_store_explicit(&a->dormido, 0, memory_order_relaxed);
+    syscall(SYS_futex, &a->cabeza, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+//Contadores de rendimiento publicados en la misma memoria compartida, en la
+//página siguiente a struct shared_io. Se rellenan cada ~100 ms (y al salir) con
+//un seqlock: secuencia es impar mientras se escriben. Los ciclos por etapa, las
+//transacciones y los flancos con el bus inhibido se calculan a partir de las
+//ejecuciones por (opcode, modo), porque el coste de cada par es fijo.
+#define ESTADISTICAS_MAGICO 0x54415453 // "STAT"
+#define ESTADISTICAS_VERSION 5
+#define NUM_OPERACIONES 26
+#define SHM_OFFSET_ESTADISTICAS ((sizeof(struct shared_io) + 4095) / 4096 * 4096)
+#define SHM_TAM (SHM_OFFSET_ESTADISTICAS + sizeof(struct estadisticas))
+
+enum dispositivo {
+    DISPOSITIVO_MEMORIA,
+    DISPOSITIVO_GPU,
+    DISPOSITIVO_TECLADO,
+    DISPOSITIVO_SISTEMA,
+    DISPOSITIVO_DMA, // Sus registros; las palabras que mueve cuentan como memoria y GPU
+    NUM_DISPOSITIVOS
+};
+
+struct estadisticas {
+    uint32_t magico;
+    uint32_t version;
+    uint32_t tam; // sizeof(struct estadisticas)
+    atomic_uint secuencia;
+    uint64_t tiempo_ns; // CLOCK_MONOTONIC de la publicación
+    uint64_t instrucciones;
+    uint64_t ciclos;
+    uint64_t ciclos_busqueda;
+    uint64_t ciclos_operando;
+    uint64_t ciclos_ejecucion;
+    uint64_t ciclos_bus_inhibido; // Flancos con INHIBIR_BUS en el bus de direcciones
+    uint64_t transacciones; // Flancos con una transacción en el bus
+    uint64_t lecturas_busqueda;
+    uint64_t lecturas[4]; // Lecturas del operando por modo de direccionamiento
+    uint64_t escrituras[4];
+    uint64_t accesos[NUM_DISPOSITIVOS][2]; // [dispositivo][0 lectura, 1 escritura]
+    uint64_t ejecuciones[NUM_OPERACIONES * 4]; // Por opcode * 4 + modo
+    uint64_t cache_instr_aciertos;
+    uint64_t cache_instr_fallos;
+    uint64_t interrupciones;
+    uint64_t ciclos_espera; // Flancos parados en WAIT
+    uint64_t dma_palabras;
+    uint64_t dma_transferencias;
+};
+
+#endif
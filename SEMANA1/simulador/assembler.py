@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 import argparse
+import os
 import re
 import struct
 import sys
@@ -10,6 +11,10 @@ from dataclasses import dataclass
 # [ opcode:8 | reg:4 | addr_mode:4 | operand:16 ]
 # Registers: 0=X, 1=ACC
 # Addressing modes: 0=Immediate, 1=Direct, 2=Indirect, 3=Indexed (with X)
+# Addresses are 32 bits wide, but an operand only holds 16: code and data above
+# 0xFFFF are reached through a pointer WORD (@PTR) or through X (LD X, [PTR]; 0(X)).
+
+ADDRESS_MAX = 0xFFFFFFFF
 
 OPCODES: Dict[str, int] = {
     'ST': 0,
@@ -32,6 +37,12 @@ OPCODES: Dict[str, int] = {
     'DEC': 17,
     'INC': 18,
     'HALT': 19,
+    'IVEC': 20,
+    'EI': 21,
+    'DI': 22,
+    'RETI': 23,
+    'WAIT': 24,
+    'XCHG': 25,
 }
 
 REGS: Dict[str, int] = {
@@ -63,6 +74,8 @@ class Item:
     addr: int
     text: str
     fields: Optional[Tuple] = None
+    line: int = 0      # 1-based source line
+    source: str = ''   # source line as written, for the listing
 
 
 def parse_number(token: str) -> int:
@@ -79,6 +92,14 @@ def parse_number(token: str) -> int:
     return val
 
 
+def address_field(val: int) -> int:
+    # Direct, indirect and indexed operands are 16-bit fields
+    if not (-32768 <= val <= 0xFFFF):
+        raise AsmError(f"Address 0x{val & ADDRESS_MAX:X} does not fit in a 16-bit operand; "
+                       "keep it in a WORD and use @WORD or load it into X")
+    return val & 0xFFFF
+
+
 def parse_operand(token: str, symbols: Dict[str, int]) -> Tuple[int, int, List[str]]:
     # returns (addr_mode, value, unresolved_symbols)
     token = token.strip()
@@ -113,7 +134,7 @@ def parse_operand(token: str, symbols: Dict[str, int]) -> Tuple[int, int, List[s
             else:
                 unresolved.append(inner)
                 val = 0
-        return (ADDR_MODES['IDX'], val & 0xFFFF, unresolved)
+        return (ADDR_MODES['IDX'], address_field(val), unresolved)
 
     # Indirect: @label or @123
     if token.startswith('@'):
@@ -126,17 +147,17 @@ def parse_operand(token: str, symbols: Dict[str, int]) -> Tuple[int, int, List[s
             else:
                 unresolved.append(inner)
                 val = 0
-        return (ADDR_MODES['IND'], val & 0xFFFF, unresolved)
+        return (ADDR_MODES['IND'], address_field(val), unresolved)
 
     # Direct: label or 123 or [label]
     if token.startswith('[') and token.endswith(']'):
         token = token[1:-1].strip()
     if number_re.match(token):
         val = parse_number(token)
-        return (ADDR_MODES['DIR'], val & 0xFFFF, unresolved)
+        return (ADDR_MODES['DIR'], address_field(val), unresolved)
     else:
         if token in symbols:
-            return (ADDR_MODES['DIR'], symbols[token] & 0xFFFF, unresolved)
+            return (ADDR_MODES['DIR'], address_field(symbols[token]), unresolved)
         unresolved.append(token)
         return (ADDR_MODES['DIR'], 0, unresolved)
 
@@ -145,7 +166,7 @@ def encode(op: int, reg: int, am: int, operand: int) -> int:
     return ((op & 0xFF) << 24) | ((reg & 0x0F) << 20) | ((am & 0x0F) << 16) | (operand & 0xFFFF)
 
 
-def assemble(lines: List[str]) -> Tuple[List[int], Dict[str, int]]:
+def assemble(lines: List[str], listing: Optional[List[Item]] = None) -> Tuple[Dict[int, int], Dict[str, int]]:
     # Pass 1: collect symbols and items
     loc = 0
     symbols: Dict[str, int] = {}
@@ -157,7 +178,7 @@ def assemble(lines: List[str]) -> Tuple[List[int], Dict[str, int]]:
 
     pending_lines: List[Tuple[int, str]] = []  # (address, raw line)
 
-    for raw in lines:
+    for lineno, raw in enumerate(lines, 1):
         line = clean(raw)
         if not line:
             continue
@@ -174,24 +195,27 @@ def assemble(lines: List[str]) -> Tuple[List[int], Dict[str, int]]:
         # Directives
         mo = org_re.match(line)
         if mo:
-            loc = parse_number(mo.group(1)) & 0xFFFF
+            loc = parse_number(mo.group(1))
+            if not (0 <= loc <= ADDRESS_MAX):
+                raise AsmError(f"ORG address out of range (32-bit): {mo.group(1)}")
             continue
         mw = word_re.match(line)
         if mw:
-            items.append(Item(kind='word', addr=loc, text=clean(mw.group(1))))
+            items.append(Item(kind='word', addr=loc, text=clean(mw.group(1)), line=lineno, source=raw.rstrip()))
             loc += 1
             continue
         # Instruction
-        items.append(Item(kind='instr', addr=loc, text=line))
+        items.append(Item(kind='instr', addr=loc, text=line, line=lineno, source=raw.rstrip()))
         loc += 1
 
-    # Pass 2: resolve and emit
-    # Determine ROM size
-    max_addr = 0
     for it in items:
-        if it.addr > max_addr:
-            max_addr = it.addr
-    rom: List[int] = [0] * (max_addr + 1 if items else 0)
+        if it.addr > ADDRESS_MAX:
+            raise AsmError(f"Line {it.line}: address past the end of the 32-bit space")
+
+    # Pass 2: resolve and emit
+    # The image is sparse (address -> word): a program may use a few words far
+    # apart in the 32-bit space
+    rom: Dict[int, int] = {}
 
     unresolved_refs: List[Tuple[int, str]] = []  # (index in rom, symbol)
 
@@ -255,7 +279,7 @@ def assemble(lines: List[str]) -> Tuple[List[int], Dict[str, int]]:
                 raise AsmError(f"Unknown register: {tok}")
             return REGS[t]
 
-        if mnemonic in ('ST', 'LD', 'ADD', 'SUB', 'MUL', 'DIV', 'MOD', 'AND', 'OR', 'XOR'):
+        if mnemonic in ('ST', 'LD', 'ADD', 'SUB', 'MUL', 'DIV', 'MOD', 'AND', 'OR', 'XOR', 'XCHG'):
             if len(ops) != 2:
                 raise AsmError(f"{mnemonic} expects: REG, operand")
             reg = parse_reg(ops[0])
@@ -276,14 +300,14 @@ def assemble(lines: List[str]) -> Tuple[List[int], Dict[str, int]]:
                 raise AsmError(f"{mnemonic} expects: REG")
             reg = parse_reg(ops[0])
             am, operand = ADDR_MODES['IMM'], 0
-        elif mnemonic in ('JMP', 'JZ', 'JN'):
+        elif mnemonic in ('JMP', 'JZ', 'JN', 'IVEC'):
             if len(ops) != 1:
                 raise AsmError(f"{mnemonic} expects: operand")
             reg = 0  # ignored
             am, operand, unresolved = parse_operand(ops[0], symbols)
             for sym in unresolved:
                 unresolved_refs.append((it.addr, sym))
-        elif mnemonic in ('NOP', 'HALT'):
+        elif mnemonic in ('NOP', 'HALT', 'EI', 'DI', 'RETI', 'WAIT'):
             if len(ops) != 0:
                 raise AsmError(f"{mnemonic} takes no operands")
             reg = 0
@@ -299,28 +323,128 @@ def assemble(lines: List[str]) -> Tuple[List[int], Dict[str, int]]:
         missing = sorted(set(sym for _, sym in unresolved_refs))
         raise AsmError("Unresolved symbols: " + ", ".join(missing))
 
+    if listing is not None:
+        listing.extend(items)
+
     return rom, symbols
 
 
-def write_rom(path: str, rom: List[int]) -> None:
-    # Write as native 32-bit little-endian values
-    with open(path, 'wb') as f:
-        for word in rom:
-            f.write(struct.pack('<I', word & 0xFFFFFFFF))
+# Sectioned ROM: header (magic, version, segment count), a table of
+# (address, words, file offset) entries and the segment data. Only non-zero
+# words are stored; the simulator zero-fills everything else.
+ROM_MAGIC = b'ASOCROM1'
+ROM_VERSION = 1
+SEGMENT_GAP = 3      # zero words worth bridging instead of starting a new segment (12-byte entry)
+PAGE_BYTES = 4096    # segments of at least one page are placed so the simulator can mmap them
+PAGE_WORDS = PAGE_BYTES // 4
+
+
+def segments(rom: Dict[int, int]) -> List[Tuple[int, List[int]]]:
+    segs: List[Tuple[int, List[int]]] = []
+    start = None
+    last = -1
+
+    def words(first: int, end: int) -> List[int]:
+        return [rom.get(a, 0) for a in range(first, end + 1)]
+
+    for addr in sorted(rom):
+        if rom[addr] & 0xFFFFFFFF == 0:
+            continue
+        if start is not None and addr - last - 1 > SEGMENT_GAP:
+            segs.append((start, words(start, last)))
+            start = None
+        if start is None:
+            start = addr
+        last = addr
+    if start is not None:
+        segs.append((start, words(start, last)))
+    return segs
+
+
+def encode_sectioned(rom: Dict[int, int]) -> bytes:
+    segs = segments(rom)
+    header = ROM_MAGIC + struct.pack('<II', ROM_VERSION, len(segs))
+    offset = len(header) + 12 * len(segs)
+    table = b''
+    data = b''
+    for addr, words in segs:
+        if len(words) >= PAGE_WORDS:
+            # Same offset modulo page size in the file and in memory
+            offset += (addr * 4 - offset) % PAGE_BYTES
+            data = data.ljust(offset - len(header) - 12 * len(segs), b'\0')
+        table += struct.pack('<III', addr, len(words), offset)
+        data += b''.join(struct.pack('<I', w & 0xFFFFFFFF) for w in words)
+        offset += 4 * len(words)
+    return header + table + data
+
+
+def write_rom(path: str, rom: Dict[int, int], flat: bool = False) -> int:
+    # Words are native 32-bit little-endian values. The file is replaced
+    # atomically: a running simulator may have the old one mapped.
+    if flat:
+        # A flat image only covers the first 0x10000 words
+        size = max(rom) + 1 if rom else 0
+        if size > 0x10000:
+            raise AsmError("--plano only covers addresses below 0x10000")
+        blob = b''.join(struct.pack('<I', rom.get(addr, 0) & 0xFFFFFFFF) for addr in range(size))
+    else:
+        blob = encode_sectioned(rom)
+    tmp = path + '.tmp'
+    with open(tmp, 'wb') as f:
+        f.write(blob)
+    os.replace(tmp, path)
+    return len(blob)
+
+
+def symbol_ranges(items: List[Item], symbols: Dict[str, int]) -> List[Tuple[str, int, int]]:
+    # A label covers the emitted words from its address up to the next label or
+    # the first gap; a label on an empty address gets an empty range (end < start)
+    emitted = set(it.addr for it in items)
+    starts = sorted(set(symbols.values()))
+    ranges = []
+    for name, addr in sorted(symbols.items(), key=lambda kv: (kv[1], kv[0])):
+        nxt = next((a for a in starts if a > addr), ADDRESS_MAX + 1)
+        end = addr - 1
+        while end + 1 < nxt and end + 1 in emitted:
+            end += 1
+        ranges.append((name, addr, end))
+    return ranges
+
+
+def write_listing(path: str, source: str, items: List[Item], symbols: Dict[str, int], rom: Dict[int, int]) -> None:
+    # Plain text, one record per line; the simulator reads it for --perfil reports.
+    # Sections start with '# symbols' (name, first and last address) and
+    # '# lines' (address, word, source line number, source text).
+    with open(path, 'w', encoding='utf-8') as f:
+        f.write(f"# ASOC-V listing: {source}\n")
+        f.write("# symbols\n")
+        for name, start, end in symbol_ranges(items, symbols):
+            last = f"0x{end:04X}" if end >= start else '-'
+            f.write(f"{name:<16} 0x{start:04X} {last}\n")
+        f.write("# lines\n")
+        for it in sorted(items, key=lambda it: it.addr):
+            f.write(f"0x{it.addr:04X} 0x{rom[it.addr] & 0xFFFFFFFF:08X} {it.line:5d}  {it.source.strip()}\n")
 
 
 def main(argv: List[str]) -> int:
     ap = argparse.ArgumentParser(description='ASOC-V assembler (.asoc -> rom.bin)')
     ap.add_argument('input', help='Input .asoc file')
     ap.add_argument('-o', '--output', default='rom.bin', help='Output ROM binary (default: rom.bin)')
+    ap.add_argument('--plano', action='store_true', help='Write a flat image (word i at address i) instead of a sectioned ROM')
+    ap.add_argument('-l', '--listado', help='Also write a symbol/listing file (default with -l: OUTPUT with .lst)', nargs='?', const='')
     args = ap.parse_args(argv)
 
     try:
         with open(args.input, 'r', encoding='utf-8') as fh:
             lines = fh.readlines()
-        rom, symbols = assemble(lines)
-        write_rom(args.output, rom)
-        print(f"Assembled {args.input} -> {args.output} ({len(rom)} words)")
+        items: List[Item] = []
+        rom, symbols = assemble(lines, items)
+        size = write_rom(args.output, rom, args.plano)
+        print(f"Assembled {args.input} -> {args.output} ({len(rom)} words, {size} bytes)")
+        if args.listado is not None:
+            listado = args.listado or os.path.splitext(args.output)[0] + '.lst'
+            write_listing(listado, args.input, items, symbols, rom)
+            print(f"Listing -> {listado}")
         # Optional: list symbols
         if symbols:
             print('Symbols:')
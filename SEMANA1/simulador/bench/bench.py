@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+"""ASOC-V benchmark harness.
+
+Assembles every workload in this directory with assembler.py, runs it through
+`simulador` in headless mode and reports guest instructions per host CPU
+second, cycles per instruction and host CPU time.
+
+Instruction and cycle counts are deterministic and the same for every core, so
+the expected counts live in git (conteos.json), keyed by the extra simulator
+arguments. MIPS depend on the host: they are compared against a local baseline
+(baseline.json, not tracked), keyed by the interpreter core the simulator was
+built with and the extra arguments, so that switch, hilado and --jit runs keep
+separate baselines.
+"""
+import argparse
+import json
+import os
+import resource
+import subprocess
+import sys
+import tempfile
+from typing import Dict, List, Optional
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# (name, canned keyboard input or None)
+WORKLOADS = [
+    ('aritmetica', None),
+    ('copia', None),
+    ('punteros', None),
+    ('muldiv', None),
+    ('eco', 'eco.in'),
+]
+
+# Safety net: no workload should get anywhere near this
+MAX_INSTR = 200_000_000
+
+
+def cpu_time_children() -> float:
+    ru = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return ru.ru_utime + ru.ru_stime
+
+
+def load_json(path: str) -> Dict:
+    if not os.path.exists(path):
+        return {}
+    with open(path) as fh:
+        return json.load(fh)
+
+
+def save_json(path: str, data: Dict) -> None:
+    with open(path, 'w') as fh:
+        json.dump(data, fh, indent=2, sort_keys=True)
+        fh.write('\n')
+
+
+def assemble(assembler: str, source: str, rom: str) -> None:
+    subprocess.run([sys.executable, assembler, source, '-o', rom],
+                   check=True, stdout=subprocess.DEVNULL)
+
+
+def run_once(simulador: str, rom: str, entrada: Optional[str], extra: List[str], status_path: str) -> Dict:
+    cmd = [simulador, '--sin-terminal', '--salida', os.devnull, '--estado', status_path,
+           '--max-instr', str(MAX_INSTR)] + extra
+    if entrada:
+        cmd += ['--entrada', entrada]
+    cmd.append(rom)
+    before = cpu_time_children()
+    proc = subprocess.run(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    cpu = cpu_time_children() - before
+    with open(status_path) as fh:
+        status = json.load(fh)
+    if status['motivo'] != 'halt':
+        raise RuntimeError(f"{os.path.basename(rom)} stopped with {status['motivo']}: {status['mensaje']}\n{proc.stderr}")
+    status['cpu_s'] = cpu
+    return status
+
+
+def main(argv: List[str]) -> int:
+    ap = argparse.ArgumentParser(description='ASOC-V benchmark suite')
+    ap.add_argument('--simulador', default=os.path.join(HERE, '..', 'simulador'), help='Simulator binary')
+    ap.add_argument('--ensamblador', default=os.path.join(HERE, '..', 'assembler.py'), help='Assembler script')
+    ap.add_argument('--conteos', default=os.path.join(HERE, 'conteos.json'), help='Expected counts file (tracked)')
+    ap.add_argument('--guardar-conteos', action='store_true', help='Store these counts as the expected ones')
+    ap.add_argument('--baseline', default=os.path.join(HERE, 'baseline.json'), help='Local MIPS baseline file (not tracked)')
+    ap.add_argument('--guardar-baseline', action='store_true', help='Store these results as the new local baseline')
+    ap.add_argument('--interprete', default='switch', help='Core the simulator was built with (make INTERPRETE=...)')
+    ap.add_argument('--repeticiones', type=int, default=3, help='Runs per workload; the fastest one counts (default: 3)')
+    ap.add_argument('--umbral', type=float, default=10.0, help='Slowdown in %% reported as a regression (default: 10)')
+    ap.add_argument('--estricto', action='store_true', help='Exit with status 1 on any regression')
+    ap.add_argument('args', nargs='*', help='Extra simulator arguments (e.g. -- --jit)')
+    args = ap.parse_args(argv)
+
+    modo = ' '.join([args.interprete] + args.args)
+    clave_conteos = ' '.join(args.args)
+    conteos = load_json(args.conteos)
+    esperados = conteos.get(clave_conteos, {})
+    baseline = load_json(args.baseline)
+    base = baseline.get(modo, {})
+
+    results: Dict[str, Dict] = {}
+    regressions = 0
+    print(f"Mode: {modo}")
+    print(f"{'workload':<12} {'instructions':>13} {'cycles':>13} {'CPI':>6} {'CPU s':>8} {'MIPS':>9} {'vs baseline':>12}")
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, entrada in WORKLOADS:
+            rom = os.path.join(tmp, name + '.bin')
+            assemble(args.ensamblador, os.path.join(HERE, name + '.asoc'), rom)
+            entrada_path = os.path.join(HERE, entrada) if entrada else None
+            runs = [run_once(args.simulador, rom, entrada_path, args.args, os.path.join(tmp, name + '.json'))
+                    for _ in range(max(1, args.repeticiones))]
+            best = min(runs, key=lambda r: r['cpu_s'])
+            cpu = max(best['cpu_s'], 1e-6)
+            mips = best['instrucciones'] / cpu / 1e6
+            cpi = best['ciclos'] / max(best['instrucciones'], 1)
+            results[name] = {
+                'instrucciones': best['instrucciones'],
+                'ciclos': best['ciclos'],
+                'cpu_s': round(best['cpu_s'], 4),
+                'mips': round(mips, 2),
+            }
+            comparison = '-'
+            esperado = esperados.get(name)
+            ref = base.get(name)
+            if esperado and (esperado['instrucciones'] != best['instrucciones'] or esperado['ciclos'] != best['ciclos']):
+                comparison = 'COUNTS DIFFER'
+                regressions += 1
+            elif ref:
+                if ref['instrucciones'] != best['instrucciones'] or ref['ciclos'] != best['ciclos']:
+                    comparison = 'COUNTS DIFFER'
+                    regressions += 1
+                else:
+                    change = (mips / ref['mips'] - 1.0) * 100.0
+                    comparison = f"{change:+.1f}%"
+                    if change < -args.umbral:
+                        comparison += ' SLOWER'
+                        regressions += 1
+            print(f"{name:<12} {best['instrucciones']:>13} {best['ciclos']:>13} {cpi:>6.2f} {best['cpu_s']:>8.3f} {mips:>9.2f} {comparison:>12}")
+
+    if args.guardar_conteos:
+        conteos[clave_conteos] = {name: {'instrucciones': r['instrucciones'], 'ciclos': r['ciclos']}
+                                  for name, r in results.items()}
+        save_json(args.conteos, conteos)
+        print(f"Counts for '{clave_conteos}' stored in {args.conteos}")
+    elif not esperados:
+        print(f"No expected counts for '{clave_conteos}'; run bench.py --guardar-conteos to store them")
+    if args.guardar_baseline:
+        baseline[modo] = results
+        save_json(args.baseline, baseline)
+        print(f"Baseline for '{modo}' stored in {args.baseline}")
+    elif not base:
+        print(f"No local baseline for '{modo}'; run 'make bench-baseline' to store one")
+    if regressions:
+        print(f"{regressions} workload(s) regressed or changed counts")
+        if args.estricto:
+            return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
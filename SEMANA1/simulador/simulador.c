@@ -8,6 +8,19 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sched.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <signal.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "asoc_shm.h"
 
 //0x0 -> leer del dispositivo
 //0x1 -> escribir al dispositivo
@@ -18,6 +31,18 @@
 #define GPU_STATUS_ADDR 0xFFF1
 #define TECLADO_DATA_ADDR 0xFFF2
 #define TECLADO_STATUS_ADDR 0xFFF3
+#define SISTEMA_CONTROL_ADDR 0xFFF4 // Escribir SISTEMA_SNAPSHOT guarda una instantánea
+#define SISTEMA_SNAPSHOT 0x1
+#define DMA_ORIGEN_ADDR 0xFFF5
+#define DMA_DESTINO_ADDR 0xFFF6 // Dirección de memoria o GPU_DATA_ADDR
+#define DMA_LONGITUD_ADDR 0xFFF7
+#define DMA_CONTROL_ADDR 0xFFF8 // Escribir DMA_INICIAR arranca la transferencia; leer da el estado
+#define DMA_INICIAR 0x1
+#define DMA_OCUPADO 0x1
+#define DMA_TERMINADO 0x2
+#define DMA_ERROR 0x4
+#define NUCLEO_ID_ADDR 0xFFF9 // Solo lectura: número del núcleo que lee
+#define NUCLEO_CUENTA_ADDR 0xFFFA // Solo lectura: número de núcleos de la máquina
 
 #define ROM_FILE "rom.bin"
 
@@ -38,181 +63,342 @@ struct io_channel {
     bus control;
 };
 
-//Por comodidad, el reloj es memoria global
-static atomic_int reloj_val = ATOMIC_VAR_INIT(0);
-bus reloj = &reloj_val;
+//Modo turbo: sin hilo de reloj ni hilos de dispositivo. La CPU cuenta los ciclos
+//virtualmente y hace avanzar a los dispositivos en cada flanco, así que el
+//resultado y el número de ciclos coinciden con el modelo con reloj real.
+static int modo_turbo = 0;
 
-#define CLOCK_SYNC() \
-    do { \
-        int flanco = LEER_BUS(reloj); \
-        while (LEER_BUS(reloj) == flanco){} \
-    } while (0)
-   
-void error(const char * mensaje) {
-    printf("Error: %s\n", mensaje);
-    exit(1);
+//Reloj de una máquina. Cada flanco incrementa la generación del reloj. Los hilos
+//que esperan un flanco giran como mucho reloj_giros iteraciones y después duermen
+//sobre la generación (futex en Linux, variable de condición en el resto) hasta que
+//clk() los despierta.
+struct reloj {
+    atomic_int val;
+    atomic_uint generacion;
+    atomic_int durmientes;
+};
+
+static int reloj_giros = 0;
+
+#ifdef __linux__
+static void reloj_dormir(struct reloj * r, unsigned int generacion) {
+    syscall(SYS_futex, (unsigned int *)&r->generacion, FUTEX_WAIT_PRIVATE, generacion, NULL, NULL, 0);
 }
 
-void * clk(void * arg) {
-    (void)arg;
-    while (1) {
-        usleep(VELOCIDAD_RELOJ_US); //Un ciclo de reloj cada segundo
-    ESCRIBIR_BUS(reloj, !LEER_BUS(reloj));
+static void reloj_despertar(struct reloj * r) {
+    syscall(SYS_futex, (unsigned int *)&r->generacion, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#else
+static pthread_mutex_t reloj_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reloj_cond = PTHREAD_COND_INITIALIZER;
+
+static void reloj_dormir(struct reloj * r, unsigned int generacion) {
+    pthread_mutex_lock(&reloj_mutex);
+    while (atomic_load(&r->generacion) == generacion) {
+        pthread_cond_wait(&reloj_cond, &reloj_mutex);
     }
+    pthread_mutex_unlock(&reloj_mutex);
+}
 
-    return NULL;
+static void reloj_despertar(struct reloj * r) {
+    (void)r;
+    pthread_mutex_lock(&reloj_mutex);
+    pthread_cond_broadcast(&reloj_cond);
+    pthread_mutex_unlock(&reloj_mutex);
 }
+#endif
+
+static void reloj_esperar_flanco(struct reloj * r) {
+    unsigned int generacion = atomic_load_explicit(&r->generacion, memory_order_acquire);
+    for (int i = 0; i < reloj_giros; i++) {
+        if (atomic_load_explicit(&r->generacion, memory_order_acquire) != generacion) return;
+    }
+    //El contador de durmientes se incrementa antes de volver a comprobar la generación,
+    //así clk() no puede saltarse el despertar entre la comprobación y la espera
+    atomic_fetch_add(&r->durmientes, 1);
+    while (atomic_load(&r->generacion) == generacion) {
+        reloj_dormir(r, generacion);
+    }
+    atomic_fetch_sub(&r->durmientes, 1);
+}
+
+#define CLOCK_SYNC(comp) reloj_esperar_flanco(&(comp)->reloj)
+
+
+//Trazas
+//Cada punto de traza tiene un nivel y una categoría. Los niveles por encima de
+//TRAZA_NIVEL_MAX desaparecen al compilar; el resto cuesta una comprobación de
+//máscara mientras estén desactivados en tiempo de ejecución. Una traza activa
+//escribe un registro binario de tamaño fijo en el anillo del hilo que la emite
+//(un productor, un consumidor, sin cerrojos) y el hilo trazador les da formato
+//fuera del camino crítico, o los vuelca en binario para decodificarlos después.
+#define TRAZA_NIVEL_NADA 0
+#define TRAZA_NIVEL_INSTR 1   // Estado de la CPU y una línea por instrucción
+#define TRAZA_NIVEL_DETALLE 2 // Transacciones de bus, ALU y etapas
+#define TRAZA_NIVEL_TODO 3    // Todo lo anterior más el estado interno de los dispositivos
+#ifndef TRAZA_NIVEL_MAX
+#define TRAZA_NIVEL_MAX TRAZA_NIVEL_TODO
+#endif
+
+#define TRAZA_CPU 0x01
+#define TRAZA_ALU 0x02
+#define TRAZA_MEM 0x04
+#define TRAZA_GPU 0x08
+#define TRAZA_KBD 0x10
+#define TRAZA_DMA 0x20
+#define TRAZA_TODAS 0x3F
 
-// Shared memory ring buffers for terminal I/O
-#define SHM_NAME "/asoc_shm"
-#define IO_BUF_SIZE 4096
-struct shared_io {
-    volatile unsigned int vth_head, vth_tail; // vm -> host (GPU output)
-    volatile unsigned int htv_head, htv_tail; // host -> vm (keyboard input)
-    char vth_buf[IO_BUF_SIZE];
-    char htv_buf[IO_BUF_SIZE];
+enum traza_evento {
+    EV_CPU_ESTADO, EV_IF, EV_ID, EV_EX, EV_EX_ST, EV_EX_LD, EV_EX_LDI,
+    EV_ALU_SIGNO, EV_ALU_ARITMETICA, EV_ALU_LOGICA,
+    EV_ALU_ADD, EV_ALU_SUB, EV_ALU_MUL, EV_ALU_DIV, EV_ALU_AND, EV_ALU_OR, EV_ALU_XOR, EV_ALU_NOT,
+    EV_GPU_LEE_ESTADO, EV_GPU_ESCRIBE_ESTADO, EV_GPU_LEE_DATOS, EV_GPU_ESCRIBE_DATOS,
+    EV_KBD_ESCRIBE_DATOS, EV_KBD_LEE_DATOS, EV_KBD_CARACTER, EV_KBD_SIN_DATOS,
+    EV_KBD_ESCRIBE_ESTADO, EV_KBD_LEE_ESTADO, EV_KBD_DISPONIBLES,
+    EV_MEM_LEE, EV_MEM_ESCRIBE,
+    EV_CPU_INTERRUPCION, EV_CPU_ESPERA,
+    EV_DMA_INICIO, EV_DMA_FIN, EV_DMA_ERROR,
+    EV_NUM_EVENTOS
 };
 
-static struct shared_io *g_shm = NULL;
+//Formatos con argumentos enteros, los eventos con nombres se formatean aparte
+static const char * const traza_formatos[EV_NUM_EVENTOS] = {
+    [EV_IF] = "[IF] Instrucción leída: 0x%08X",
+    [EV_ALU_SIGNO] = "[ALU] Operación con números con signo",
+    [EV_ALU_ARITMETICA] = "[ALU] Operación aritmética",
+    [EV_ALU_LOGICA] = "[ALU] Operación lógica",
+    [EV_ALU_ADD] = "[ALU] Sumar %d + %d",
+    [EV_ALU_SUB] = "[ALU] Restar %d - %d",
+    [EV_ALU_MUL] = "[ALU] Multiplicar %d * %d",
+    [EV_ALU_DIV] = "[ALU] Dividir %d / %d",
+    [EV_ALU_AND] = "[ALU] Y %d & %d",
+    [EV_ALU_OR] = "[ALU] O %d | %d",
+    [EV_ALU_XOR] = "[ALU] XOR %d ^ %d",
+    [EV_ALU_NOT] = "[ALU] NOT ~%d",
+    [EV_GPU_LEE_ESTADO] = "[DEV][GPU] Leyendo del registro de estado de la GPU",
+    [EV_GPU_ESCRIBE_ESTADO] = "[DEV][GPU] Escritura ignorada en el registro de estado de la GPU",
+    [EV_GPU_LEE_DATOS] = "[DEV][GPU] Leyendo del registro de datos de la GPU",
+    [EV_GPU_ESCRIBE_DATOS] = "[DEV][GPU] Escritura en el registro de datos de la GPU: 0x%04X",
+    [EV_KBD_ESCRIBE_DATOS] = "[DEV][KBD] Escritura ignorada en el registro de datos del teclado",
+    [EV_KBD_LEE_DATOS] = "[DEV][KBD] Leyendo del registro de datos del teclado",
+    [EV_KBD_CARACTER] = "[DEV][KBD] Carácter leído del teclado: '%c'",
+    [EV_KBD_SIN_DATOS] = "[DEV][KBD] No hay datos disponibles en el teclado",
+    [EV_KBD_ESCRIBE_ESTADO] = "[DEV][KBD] Escritura ignorada en el registro de estado del teclado",
+    [EV_KBD_LEE_ESTADO] = "[DEV][KBD] Leyendo del registro de estado del teclado",
+    [EV_KBD_DISPONIBLES] = "[DEV][KBD] Bytes disponibles en el teclado: %d",
+    [EV_MEM_LEE] = "[DEV][MEM] Leyendo de dirección 0x%04X: 0x%04X",
+    [EV_MEM_ESCRIBE] = "[DEV][MEM] Escribiendo en dirección 0x%04X: 0x%04X",
+    [EV_CPU_INTERRUPCION] = "[INT] Interrupción del teclado en PC 0x%04X, salto al vector 0x%04X",
+    [EV_CPU_ESPERA] = "[INT] WAIT: %u flancos esperando una interrupción",
+    [EV_DMA_INICIO] = "[DEV][DMA] Transferencia de 0x%04X a 0x%04X, %u palabras",
+    [EV_DMA_FIN] = "[DEV][DMA] Transferencia terminada",
+    [EV_DMA_ERROR] = "[DEV][DMA] Transferencia rechazada: 0x%04X a 0x%04X, %u palabras",
+};
 
-void memory_protection_emulation(int addr) {
-    if (addr < MEMORY_DATA_BARRIER) {
-        error("Escritura sobre memoria protegida de solo lectura");
+struct traza_registro {
+    uint64_t ciclo;     // Flanco de reloj en el que se emitió
+    uint16_t evento;
+    uint16_t hilo;
+    uint32_t args[4];
+    uint32_t reservado;
+};
+
+#define TRAZA_MAGICO "ASOCTRZ1"
+#define TRAZA_ANILLO_REGISTROS 4096 // Potencia de 2
+
+struct traza_anillo {
+    _Atomic uint32_t cabeza; // Solo la escribe el hilo productor
+    _Atomic uint32_t cola;   // Solo la escribe el consumidor
+    uint16_t hilo;
+    struct traza_anillo * siguiente;
+    struct traza_registro registros[TRAZA_ANILLO_REGISTROS];
+};
+
+//traza_activa[nivel] es la máscara de categorías activas en ese nivel
+static uint32_t traza_activa[TRAZA_NIVEL_TODO + 1] = {0};
+static struct traza_anillo * _Atomic traza_anillos = NULL;
+static _Thread_local struct traza_anillo * traza_local = NULL;
+static _Thread_local atomic_uint * traza_reloj = NULL; // Generación del reloj de la máquina del hilo
+static atomic_int traza_hilos = ATOMIC_VAR_INIT(0);
+static pthread_mutex_t traza_consumidor = PTHREAD_MUTEX_INITIALIZER;
+static FILE * traza_binaria = NULL;
+
+#define TRAZA(nivel, categoria, evento, a, b, c, d) \
+    do { \
+        if ((nivel) <= TRAZA_NIVEL_MAX && (traza_activa[(nivel)] & (categoria))) { \
+            traza_emitir((evento), (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), (uint32_t)(d)); \
+        } \
+    } while (0)
+
+void traza_configurar(int nivel, uint32_t categorias) {
+    for (int i = TRAZA_NIVEL_INSTR; i <= TRAZA_NIVEL_TODO; i++) {
+        traza_activa[i] = (i <= nivel) ? categorias : 0;
     }
 }
 
-void * gpu(void * arg) {
-    struct io_channel * io = (struct io_channel *) arg;
-    (void)io;
+static struct traza_anillo * traza_registrar_hilo(void) {
+    struct traza_anillo * anillo = calloc(1, sizeof(*anillo));
+    if (anillo == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    anillo->hilo = (uint16_t)atomic_fetch_add(&traza_hilos, 1);
+    anillo->siguiente = atomic_load(&traza_anillos);
+    while (!atomic_compare_exchange_weak(&traza_anillos, &anillo->siguiente, anillo)) {}
+    traza_local = anillo;
+    return anillo;
+}
 
-    while (1) {
-        CLOCK_SYNC();
-
-        if (LEER_BUS(io->direcciones) == GPU_STATUS_ADDR && LEER_BUS(io->control) == IO_OP_READ) {
-            printf("[DEV][GPU] Leyendo del registro de estado de la GPU\n");
-            ESCRIBIR_BUS(io->datos, (int)0x1); //We can always print to the GPU
-            ESCRIBIR_BUS(io->direcciones, INHIBIR_BUS); //Inhibir bus after operation
-        } else if (LEER_BUS(io->direcciones) == GPU_STATUS_ADDR && LEER_BUS(io->control) == IO_OP_WRITE) {
-            printf("[DEV][GPU] Escritura ignorada en el registro de estado de la GPU\n");
-            ESCRIBIR_BUS(io->direcciones, INHIBIR_BUS); //Inhibir bus after operation
-        } else if (LEER_BUS(io->direcciones) == GPU_DATA_ADDR && LEER_BUS(io->control) == IO_OP_READ) {
-            printf("[DEV][GPU] Leyendo del registro de datos de la GPU\n");
-            ESCRIBIR_BUS(io->datos, (int)0x0); //No data available
-            ESCRIBIR_BUS(io->direcciones, INHIBIR_BUS); //Inhibir bus after operation
-        } else if (LEER_BUS(io->direcciones) == GPU_DATA_ADDR && LEER_BUS(io->control) == IO_OP_WRITE) {
-            printf("[DEV][GPU] Escritura en el registro de datos de la GPU: 0x%04X\n", LEER_BUS(io->datos));
-            // Escribir en buffer compartido VM->Host
-            if (g_shm) {
-                char c = (char)LEER_BUS(io->datos);
-                unsigned int head = g_shm->vth_head;
-                unsigned int next = (head + 1) % IO_BUF_SIZE;
-                if (next != g_shm->vth_tail) {
-                    g_shm->vth_buf[head] = c;
-                    g_shm->vth_head = next;
-                } else {
-                    // buffer lleno: descartar carácter
-                }
-            }
-            ESCRIBIR_BUS(io->direcciones, INHIBIR_BUS); //Inhibir bus after operation
-        }
+void traza_emitir(uint16_t evento, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    struct traza_anillo * anillo = traza_local ? traza_local : traza_registrar_hilo();
+    uint32_t cabeza = atomic_load_explicit(&anillo->cabeza, memory_order_relaxed);
+    //Anillo lleno: esperamos al consumidor en lugar de perder trazas
+    while (cabeza - atomic_load_explicit(&anillo->cola, memory_order_acquire) == TRAZA_ANILLO_REGISTROS) {
+        sched_yield();
     }
-    
-    return NULL;
+    struct traza_registro * r = &anillo->registros[cabeza & (TRAZA_ANILLO_REGISTROS - 1)];
+    r->ciclo = traza_reloj ? atomic_load_explicit(traza_reloj, memory_order_relaxed) : 0;
+    r->evento = evento;
+    r->hilo = anillo->hilo;
+    r->args[0] = a;
+    r->args[1] = b;
+    r->args[2] = c;
+    r->args[3] = d;
+    r->reservado = 0;
+    atomic_store_explicit(&anillo->cabeza, cabeza + 1, memory_order_release);
 }
 
+extern const char *operaciones[];
+extern const char *registros[];
+extern const char *modos_direccionamiento[];
 
-void * teclado(void * arg) {
-    struct io_channel * io = (struct io_channel *) arg;
+static const char * traza_nombre(const char ** tabla, uint32_t n, uint32_t i) {
+    return i < n ? tabla[i] : "?";
+}
 
-    char c;
-    while (1) {
-        CLOCK_SYNC();
-        if (LEER_BUS(io->direcciones) == TECLADO_DATA_ADDR && LEER_BUS(io->control) == IO_OP_WRITE) {
-            printf("[DEV][KBD] Escritura ignorada en el registro de datos del teclado\n");
-            ESCRIBIR_BUS(io->direcciones, INHIBIR_BUS); //Inhibir bus after operation
-        } else if (LEER_BUS(io->direcciones) == TECLADO_DATA_ADDR && LEER_BUS(io->control) == IO_OP_READ) {
-            printf("[DEV][KBD] Leyendo del registro de datos del teclado\n");
-            // Leer de buffer compartido Host->VM
-            if (g_shm && g_shm->htv_head != g_shm->htv_tail) {
-                unsigned int tail = g_shm->htv_tail;
-                c = g_shm->htv_buf[tail];
-                g_shm->htv_tail = (tail + 1) % IO_BUF_SIZE;
-                printf("[DEV][KBD] Carácter leído del teclado: '%c'\n", c);
-                ESCRIBIR_BUS(io->datos, (int)c);
+void traza_formatear(FILE * f, const struct traza_registro * r) {
+    const uint32_t * a = r->args;
+    switch (r->evento) {
+        case EV_CPU_ESTADO:
+            fprintf(f, "PC: 0x%08X X:%08X ACC: %08X Z=%x N=%x C=%x V=%x I=%x", a[0], a[1], a[2], a[3] & 1, (a[3] >> 1) & 1, (a[3] >> 2) & 1, (a[3] >> 3) & 1, (a[3] >> 4) & 1);
+            break;
+        case EV_ID:
+            fprintf(f, "[ID] Instrucción: %s %s, %s 0x%04X => DE: 0x%04X VE: 0x%04X",
+                traza_nombre(operaciones, NUM_OPERACIONES, (a[0] >> 24) & 0xFF),
+                traza_nombre(registros, 2, (a[0] >> 20) & 0x0F),
+                traza_nombre(modos_direccionamiento, 4, (a[0] >> 16) & 0x0F),
+                a[0] & 0xFFFF, a[1], a[2]);
+            break;
+        case EV_EX:
+            fprintf(f, "[EX] Ejecutando %s", traza_nombre(operaciones, NUM_OPERACIONES, a[0]));
+            break;
+        case EV_EX_ST:
+            fprintf(f, "[EX] Registro %s almacenado en memoria en dirección 0x%04X con valor 0x%04X", traza_nombre(registros, 2, a[0]), a[1], a[2]);
+            break;
+        case EV_EX_LD:
+            fprintf(f, "[EX] Registro %s cargado con valor 0x%04X", traza_nombre(registros, 2, a[0]), a[1]);
+            break;
+        case EV_EX_LDI:
+            fprintf(f, "[EX] Registro %s cargado con valor inmediato 0x%04X", traza_nombre(registros, 2, a[0]), a[1]);
+            break;
+        default:
+            if (r->evento < EV_NUM_EVENTOS && traza_formatos[r->evento] != NULL) {
+                fprintf(f, traza_formatos[r->evento], a[0], a[1], a[2], a[3]);
             } else {
-                printf("[DEV][KBD] No hay datos disponibles en el teclado\n");
-                ESCRIBIR_BUS(io->datos, (int)0); //No data available
-            }
-            ESCRIBIR_BUS(io->direcciones, INHIBIR_BUS); //Inhibir bus after operation
-        } else if (LEER_BUS(io->direcciones) == TECLADO_STATUS_ADDR && LEER_BUS(io->control) == IO_OP_WRITE) {
-            printf("[DEV][KBD] Escritura ignorada en el registro de estado del teclado\n");
-            ESCRIBIR_BUS(io->direcciones, INHIBIR_BUS); //Inhibir bus after operation
-        } else if (LEER_BUS(io->direcciones) == TECLADO_STATUS_ADDR && LEER_BUS(io->control) == IO_OP_READ) {
-            printf("[DEV][KBD] Leyendo del registro de estado del teclado\n");
-            int bytes_available = 0;
-            if (g_shm) {
-                unsigned int head = g_shm->htv_head;
-                unsigned int tail = g_shm->htv_tail;
-                bytes_available = (int)((head + IO_BUF_SIZE - tail) % IO_BUF_SIZE);
+                fprintf(f, "[TRAZA] Evento desconocido %u", r->evento);
             }
-            printf("[DEV][KBD] Bytes disponibles en el teclado: %d\n", bytes_available);
-            ESCRIBIR_BUS(io->datos, (int)(bytes_available > 0 ? 0x1 : 0x0));
-            ESCRIBIR_BUS(io->direcciones, INHIBIR_BUS); //Inhibir bus after operation
-        }
-
+            break;
     }
-
-    return NULL;
+    fputc('\n', f);
 }
 
-static atomic_int guard = ATOMIC_VAR_INIT(0);
-void * memoria(void * arg) {
-    struct io_channel * io = (struct io_channel *) arg;
-    static int memoria[0x10000] = {0}; // 64KB de memoria
-
-    //Load rom
-    FILE * rom_file = fopen(ROM_FILE, "rb");
-    if (rom_file != NULL) {
-        if (fread(memoria, sizeof(int), 0x10000, rom_file) != 0x10000) {
-            printf("Advertencia: No se pudo leer toda la ROM. La memoria se inicializa parcialmente.\n");
+//Vacía todos los anillos mezclándolos por ciclo. Puede llamarse desde cualquier hilo.
+void traza_volcar(void) {
+    pthread_mutex_lock(&traza_consumidor);
+    while (1) {
+        struct traza_anillo * elegido = NULL;
+        uint64_t ciclo_min = UINT64_MAX;
+        for (struct traza_anillo * an = atomic_load(&traza_anillos); an != NULL; an = an->siguiente) {
+            uint32_t cola = atomic_load_explicit(&an->cola, memory_order_relaxed);
+            if (cola == atomic_load_explicit(&an->cabeza, memory_order_acquire)) continue;
+            uint64_t ciclo = an->registros[cola & (TRAZA_ANILLO_REGISTROS - 1)].ciclo;
+            if (ciclo < ciclo_min) {
+                ciclo_min = ciclo;
+                elegido = an;
+            }
         }
-        fclose(rom_file);
-    } else {
-        printf("Advertencia: No se pudo abrir el archivo ROM. La memoria se inicializa en cero.\n");
+        if (elegido == NULL) break;
+        uint32_t cola = atomic_load_explicit(&elegido->cola, memory_order_relaxed);
+        struct traza_registro * r = &elegido->registros[cola & (TRAZA_ANILLO_REGISTROS - 1)];
+        if (traza_binaria) {
+            fwrite(r, sizeof(*r), 1, traza_binaria);
+        } else {
+            traza_formatear(stdout, r);
+        }
+        atomic_store_explicit(&elegido->cola, cola + 1, memory_order_release);
     }
+    fflush(traza_binaria ? traza_binaria : stdout);
+    pthread_mutex_unlock(&traza_consumidor);
+}
 
+void * trazador(void * arg) {
+    (void)arg;
     while (1) {
-        CLOCK_SYNC();
-
-        int direccion = LEER_BUS(io->direcciones);
-        //Address in modulus of memory size
-        direccion = direccion % 0x10000;
-
-        //Ignoramos las direcciones de IO (esto se hace físicamente con puertas lógicas)
-        if (direccion != GPU_DATA_ADDR && direccion != GPU_STATUS_ADDR && direccion != TECLADO_DATA_ADDR && direccion != TECLADO_STATUS_ADDR && direccion != INHIBIR_BUS) {
-            //printf(" [DEV] Responde la memoria: ADDR 0x%04X, CTRL 0x%01X, DAT 0x%04X\n",
-            //    direccion,
-            //    LEER_BUS(io->control),
-            //    LEER_BUS(io->datos));
-            
-            // Simular lectura/escritura
-            if (LEER_BUS(io->control) == 0) { // Lectura
-                printf("[DEV][MEM] Leyendo de dirección 0x%04X: 0x%04X\n", direccion, memoria[direccion]);
-                ESCRIBIR_BUS(io->datos, memoria[direccion]);
-                atomic_store_explicit(&guard, memoria[direccion], memory_order_release);
-                ESCRIBIR_BUS(io->direcciones, INHIBIR_BUS); //Inhibir bus after operation
-            } else { // Escritura
-                printf("[DEV][MEM] Escribiendo en dirección 0x%04X: 0x%04X\n", direccion, memoria[direccion]);
-                memory_protection_emulation(direccion);
-                memoria[direccion] = LEER_BUS(io->datos);
-                ESCRIBIR_BUS(io->direcciones, INHIBIR_BUS); //Inhibir bus after operation
-            }
+        usleep(1000);
+        traza_volcar();
+    }
+    return NULL;
+}
 
-        }
+int traza_abrir_binaria(const char * ruta) {
+    traza_binaria = fopen(ruta, "wb");
+    if (traza_binaria == NULL) {
+        perror(ruta);
+        return -1;
+    }
+    fwrite(TRAZA_MAGICO, 1, 8, traza_binaria);
+    return 0;
+}
 
+int traza_decodificar(const char * ruta) {
+    FILE * f = fopen(ruta, "rb");
+    if (f == NULL) {
+        perror(ruta);
+        return 1;
+    }
+    char magico[8];
+    if (fread(magico, 1, 8, f) != 8 || memcmp(magico, TRAZA_MAGICO, 8) != 0) {
+        fprintf(stderr, "%s: no es un fichero de trazas\n", ruta);
+        fclose(f);
+        return 1;
+    }
+    struct traza_registro r;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        printf("%10llu ", (unsigned long long)r.ciclo);
+        traza_formatear(stdout, &r);
     }
+    fclose(f);
+    return 0;
+}
 
-    return NULL;
+//Lee "cpu,mem,..." en *mascara. Devuelve -1 si algún nombre no es una categoría.
+int traza_parsear_categorias(const char * lista, uint32_t * mascara) {
+    static const struct { const char * nombre; uint32_t bits; } categorias[] = {
+        {"cpu", TRAZA_CPU}, {"alu", TRAZA_ALU}, {"mem", TRAZA_MEM}, {"gpu", TRAZA_GPU},
+        {"kbd", TRAZA_KBD}, {"dma", TRAZA_DMA}, {"todas", TRAZA_TODAS},
+    };
+    char copia[256];
+    snprintf(copia, sizeof(copia), "%s", lista);
+    char * resto = copia;
+    char * nombre;
+    *mascara = 0;
+    while ((nombre = strtok_r(resto, ",", &resto)) != NULL) {
+        size_t i = 0;
+        while (i < sizeof(categorias) / sizeof(categorias[0]) && strcmp(nombre, categorias[i].nombre) != 0) i++;
+        if (i == sizeof(categorias) / sizeof(categorias[0])) return -1;
+        *mascara |= categorias[i].bits;
+    }
+    return *mascara != 0 ? 0 : -1;
 }
 
 struct estado {
@@ -220,195 +406,2386 @@ struct estado {
     int n : 1; // Negative flag
     int c : 1; // Carry flag
     int v : 1; // Overflow flag
+    int ie : 1; // Interrupciones habilitadas (EI/DI)
 };
 
 struct cpu {
     volatile int pc; // Program counter
     volatile struct estado flags;
     volatile int registros[2]; // Registros generales
+    //Interrupciones: dirección del manejador (IVEC) y el PC y las flags que
+    //guarda la entrada al manejador y restaura RETI. Solo hay un nivel.
+    int vector;
+    int pc_retorno;
+    struct estado flags_retorno;
 };
 
-struct computador {
-    struct cpu * procesador;
-    struct io_channel * io;
+//Caché de instrucciones predecodificadas, indexada por PC. El código por debajo de
+//MEMORY_DATA_BARRIER no puede cambiar (memory_protection_emulation), así que sus
+//entradas no caducan nunca; el resto se invalida cuando se escribe su dirección.
+struct instr_decodificada {
+    int instr;
+    int operando;
+    unsigned char opcode;
+    unsigned char reg;
+    unsigned char addr_mode;
+    unsigned char manejador; // Índice del manejador en el intérprete hilado
 };
 
-const char *operaciones[] = {
-    "ST", // Cargar de memoria a registro
-    "LD", // Almacenar de registro a memoria
-    "LDI", // Cargar inmediato a registro
-    "ADD", // Sumar
-    "SUB", // Restar
-    "MUL", // Multiplicar
-    "DIV", // Dividir
-    "MOD",  // Módulo
-    "AND", // AND bit a bit
-    "OR",  // OR bit a bit
-    "XOR", // XOR bit a bit
-    "NOT", // NOT bit a bit
-    "JMP", // Salto incondicional
-    "JZ",  // Salto si cero
-    "JN",  // Salto si negativo
-    "CLR", // Limpiar registro
-    "NOP", // No operación
-    "DEC", // Decrementar
-    "INC", // Incrementar
-    "HALT" // Detener ejecución
+enum motivo_parada {
+    PARADA_NINGUNA,
+    PARADA_HALT,
+    PARADA_ERROR,
+    PARADA_INSTR_NULA,
+    PARADA_LIMITE_INSTRUCCIONES,
+    PARADA_LIMITE_CICLOS,
+    PARADA_ESPERA
 };
 
-const char *registros[] = {
-    "X",
-    "ACC"
+static const char * const nombres_parada[] = {
+    [PARADA_NINGUNA] = "ninguna",
+    [PARADA_HALT] = "halt",
+    [PARADA_ERROR] = "error",
+    [PARADA_INSTR_NULA] = "instr_nula",
+    [PARADA_LIMITE_INSTRUCCIONES] = "limite_instrucciones",
+    [PARADA_LIMITE_CICLOS] = "limite_ciclos",
+    [PARADA_ESPERA] = "espera",
 };
 
-const char *modos_direccionamiento[] = {
-    "Inmediato",
-    "Directo",
-    "Indirecto",
-    "Indexado"
+//Código de salida del proceso para cada motivo (2 queda para errores de uso)
+static const int codigos_salida[] = {
+    [PARADA_NINGUNA] = 1,
+    [PARADA_HALT] = 0,
+    [PARADA_ERROR] = 1,
+    [PARADA_INSTR_NULA] = 3,
+    [PARADA_LIMITE_INSTRUCCIONES] = 4,
+    [PARADA_LIMITE_CICLOS] = 5,
+    [PARADA_ESPERA] = 6,
 };
 
-#define ALU_MODE_ARITHMETHIC 0
-#define ALU_OP_ADD 0
-#define ALU_OP_SUB 1
-#define ALU_OP_MUL 2
-#define ALU_OP_DIV 3
-#define ALU_OP_MOD 4
-#define ALU_MODE_LOGIC 1
-#define ALU_OP_AND 0
-#define ALU_OP_OR 1
-#define ALU_OP_XOR 2
-#define ALU_OP_NOT 3
-int alu_operation(struct cpu * cpu_inst, int mode, int opcode, int operand_1, int operand_2) {
-    //Check if the number is signed 16-bit
-    if (operand_1 > 32767 || operand_1 < -32768 || operand_2 > 32767 || operand_2 < -32768) {
-        printf("Operadores: %d, %d\n", operand_1, operand_2);
-        error("Operando fuera de rango de 16 bits con signo");
-    }
-    int has_signed = (operand_1 < 0 || operand_2 < 0);
-    if (has_signed) printf("[ALU] Operación con números con signo\n");
-    //Make the operation and update the cpu flags accordingly
-    if (mode == ALU_MODE_ARITHMETHIC) {
-        printf("[ALU] Operación aritmética\n");
-        switch (opcode) {
-            case ALU_OP_ADD:
-                {
-                    printf("[ALU] Sumar %d + %d\n", operand_1, operand_2);
-                    int result = operand_1 + operand_2;
-                    cpu_inst->flags.c = (result > 32767 || result < -32768);
-                    cpu_inst->flags.v = ((operand_1 > 0 && operand_2 > 0 && result < 0) || (operand_1 < 0 && operand_2 < 0 && result > 0));
-                    cpu_inst->flags.z = (result == 0);
-                    cpu_inst->flags.n = (result < 0);
-                    return result & 0xFFFF; //Return as 16-bit value
-                }
-            case ALU_OP_SUB:
-                {
-                    printf("[ALU] Restar %d - %d\n", operand_1, operand_2);
-                    int result = operand_1 - operand_2;
-                    cpu_inst->flags.c = (result > 32767 || result < -32768);
-                    cpu_inst->flags.v = ((operand_1 > 0 && operand_2 < 0 && result < 0) || (operand_1 < 0 && operand_2 > 0 && result > 0));
-                    cpu_inst->flags.z = (result == 0);
-                    cpu_inst->flags.n = (result < 0);
-                    return result & 0xFFFF; //Return as 16-bit value
-                }
-            case ALU_OP_MUL:
-                {
-                    printf("[ALU] Multiplicar %d * %d\n", operand_1, operand_2);
-                    int result = operand_1 * operand_2;
-                    cpu_inst->flags.c = (result > 32767 || result < -32768);
-                    cpu_inst->flags.v = cpu_inst->flags.c; //Overflow if carry
-                    cpu_inst->flags.z = (result == 0);
-                    cpu_inst->flags.n = (result < 0);
-                    return result & 0xFFFF; //Return as 16-bit value
-                }
-            case ALU_OP_DIV:
-                {
-                    printf("[ALU] Dividir %d / %d\n", operand_1, operand_2);
-                    if (operand_2 == 0) {
-                        error("División por cero");
-                    }
-                    int result = operand_1 / operand_2;
-                    cpu_inst->flags.c = 0; //No carry in division
-                    cpu_inst->flags.v = 0; //No overflow in division
-                    cpu_inst->flags.z = (result == 0);
-                    cpu_inst->flags.n = (result < 0);
-                    return result & 0xFFFF; //Return as 16-bit value
-                }
-        }
-    } else if (mode == ALU_MODE_LOGIC) {
-        printf("[ALU] Operación lógica\n");
-        switch (opcode) {
-            case ALU_OP_AND:
-                {
-                    printf("[ALU] Y %d & %d\n", operand_1, operand_2);
-                    int result = operand_1 & operand_2;
-                    cpu_inst->flags.z = (result == 0);
-                    cpu_inst->flags.n = (result < 0);
-                    return result & 0xFFFF; //Return as 16-bit value
-                }
-            case ALU_OP_OR:
-                {
-                    printf("[ALU] O %d | %d\n", operand_1, operand_2);
-                    int result = operand_1 | operand_2;
-                    cpu_inst->flags.z = (result == 0);
-                    cpu_inst->flags.n = (result < 0);
-                    return result & 0xFFFF; //Return as 16-bit value
-                }
-            case ALU_OP_XOR:
-                {
-                    printf("[ALU] XOR %d ^ %d\n", operand_1, operand_2);
-                    int result = operand_1 ^ operand_2;
-                    cpu_inst->flags.z = (result == 0);
-                    cpu_inst->flags.n = (result < 0);
-                    return result & 0xFFFF; //Return as 16-bit value
-                }
-            case ALU_OP_NOT:
-                {
-                    printf("[ALU] NOT ~%d\n", operand_1);
-                    int result = ~operand_1;
-                    cpu_inst->flags.z = (result == 0);
-                    cpu_inst->flags.n = (result < 0);
-                    return result & 0xFFFF; //Return as 16-bit value
-                }
-        }
-    } else {
-        error("Modo de ALU inválido");
-    }
+//Controlador DMA: mueve bloques de memoria a memoria o de memoria a la GPU
+//mientras la CPU sigue ejecutando. Los registros avanzan con la transferencia.
+struct dma {
+    int origen;
+    int destino;
+    int longitud; // Palabras que faltan
+    int estado; // DMA_OCUPADO, DMA_TERMINADO, DMA_ERROR
+    unsigned int flancos; // Flancos libres acumulados que aún no llegan a una palabra
+    unsigned long long palabras;
+    unsigned long long palabras_gpu;
+    unsigned long long transferencias;
+};
 
-    return 0;
+struct jit;
+struct perfil;
+struct cache;
+struct segmentado;
+struct precarga;
+struct mmu;
+struct computador;
 
-}
+//Bus con decodificación de direcciones. Cada dispositivo registra los rangos que
+//atiende con un manejador de lectura y otro de escritura, y la tabla de
+//decodificación guarda para cada una de las 0x10000 direcciones el índice del
+//rango que la atiende. Un solo despachador (bus_ciclo) lleva cada transacción a
+//ese manejador: encontrarlo cuesta una lectura de la tabla, y los dispositivos no
+//tienen hilo propio ni miran el bus en cada flanco.
+#define BUS_MAX_RANGOS 16
+#define BUS_NADIE 0xFF // Dirección que no decodifica ningún dispositivo
 
-void unidad_de_control(struct computador * comp) {
-    //Print CPU state
-    printf("PC: 0x%04X X:%04X ACC: %04X Z=%x N=%x C=%x V=%x\n", comp->procesador->pc, comp->procesador->registros[0], comp->procesador->registros[1], comp->procesador->flags.z, comp->procesador->flags.n, comp->procesador->flags.c, comp->procesador->flags.v);
-    ESCRIBIR_BUS(comp->io->direcciones, INHIBIR_BUS); //Inhibir bus at the start of the cycle
-    CLOCK_SYNC();
-    int direccion_instr = comp->procesador->pc;
-    ESCRIBIR_BUS(comp->io->control, IO_OP_READ);
-    ESCRIBIR_BUS(comp->io->direcciones, direccion_instr);
-    comp->procesador->pc += 1;
-    CLOCK_SYNC();
-    CLOCK_SYNC();
-    int instr = LEER_BUS(comp->io->datos);
-    if (instr != atomic_load_explicit(&guard, memory_order_acquire)) {
-        printf("[DEBUG] Valor guardado en memoria: 0x%04X\n", guard);
-        printf("Difierente de instrucción leída: 0x%04X\n", instr);
-        exit(1);
+typedef int (*bus_leer_fn)(struct computador * comp, int direccion);
+typedef void (*bus_escribir_fn)(struct computador * comp, int direccion, int dato);
+
+struct bus_rango {
+    const char * nombre;
+    int desde;
+    int hasta; // Incluida
+    bus_leer_fn leer;
+    bus_escribir_fn escribir;
+};
+
+struct bus_es {
+    struct bus_rango rangos[BUS_MAX_RANGOS];
+    int num_rangos;
+    unsigned char decodificacion[0x10000];
+    unsigned char alta; // Rango que atiende las direcciones por encima de 0xFFFF
+};
+
+//Memoria física de 32 bits. Los primeros 0x10000 están en comp->memoria, un mmap
+//anónimo en el que el sistema solo reserva las páginas que se tocan y sobre el que
+//se proyectan la ROM y las instantáneas. El resto está en una tabla de páginas de
+//dos niveles: la tabla y la página se reservan al escribir por primera vez en
+//ellas, y leer una página que no existe da 0 sin reservar nada. Los punteros se
+//instalan con compare-and-swap porque con varios núcleos la tabla es de todos.
+#define MEMORIA_BAJA 0x10000
+#define MEMORIA_PAGINA_BITS 10
+#define MEMORIA_PAGINA (1u << MEMORIA_PAGINA_BITS) // Palabras: 4 KB
+#define MEMORIA_TABLA_BITS 11
+#define MEMORIA_DIRECTORIO_BITS (32 - MEMORIA_TABLA_BITS - MEMORIA_PAGINA_BITS)
+
+struct memoria_tabla {
+    _Atomic(int *) paginas[1u << MEMORIA_TABLA_BITS];
+};
+
+struct memoria_alta {
+    _Atomic(struct memoria_tabla *) tablas[1u << MEMORIA_DIRECTORIO_BITS];
+    atomic_uint paginas; // Reservadas
+};
+
+//Varios núcleos (--nucleos N, solo en modo turbo): cada uno es una struct
+//computador con su CPU, su hilo y sus contadores, y todos comparten la memoria
+//del núcleo 0. El bus compartido se arbitra con un cerrojo: lo toman los accesos
+//a la E/S compartida y el ciclo de lectura-escritura de XCHG. Las lecturas y
+//escrituras normales de memoria no lo toman (cada palabra se lee o escribe entera),
+//así que los núcleos avanzan en paralelo en el host.
+#define NUCLEOS_MAX 8
+
+struct nucleos {
+    int num;
+    struct computador * maquina[NUCLEOS_MAX]; // maquina[0] tiene los dispositivos
+    struct bus_es es; // GPU y sistema, atendidos siempre sobre maquina[0]
+    pthread_mutex_t bus;
+    pthread_t hilos[NUCLEOS_MAX];
+    atomic_ullong arbitrajes; // Veces que un núcleo ha tomado el bus
+    atomic_ullong esperas; // Veces que lo ha encontrado ocupado
+    //Los núcleos se paran al empezar la siguiente instrucción. Si lo pide un
+    //núcleo secundario que ha fallado, el núcleo 0 se detiene con su motivo.
+    atomic_int parar;
+    atomic_int fallo; // Lo reclama el primer núcleo que falla
+    enum motivo_parada motivo;
+    char mensaje[128];
+};
+
+//Una máquina completa: CPU, buses, reloj, memoria y consola. Todo el estado de
+//una ejecución vive aquí, así que un proceso puede ejecutar varias a la vez.
+struct computador {
+    struct cpu * procesador;
+    struct io_channel * io;
+    unsigned long long ciclos; // Flancos de reloj que ha esperado la CPU
+    unsigned long long instrucciones; // Instrucciones completadas
+    unsigned long long interrupciones; // Entradas al manejador de interrupción
+    unsigned long long ciclos_espera; // Flancos parados en WAIT (solo modo con reloj)
+    //La máquina se detiene al empezar una instrucción con alguno de los dos
+    //contadores en su límite (ULLONG_MAX: sin límite)
+    unsigned long long limite_instrucciones;
+    unsigned long long limite_ciclos;
+    //comprobar_eventos() solo mira si el reloj ha llegado a evento_ciclos, que no pasa
+    //de ningún plazo de los de arriba ni de la publicación, o si otro hilo ha dejado
+    //un aviso. Quien cambie algo que haya que atender antes lo pone a 0.
+    unsigned long long evento_ciclos;
+    atomic_uint avisos;
+
+    struct cpu cpu;
+    struct io_channel canal;
+    atomic_int bus_direcciones;
+    atomic_int bus_datos;
+    atomic_int bus_control;
+    struct reloj reloj;
+    int * memoria; // Los primeros 0x10000 palabras, mmap anónimo alineado a página
+    struct memoria_alta * alta; // El resto del espacio de 32 bits
+    atomic_int guard;
+    struct dma dma;
+    struct bus_es bus;
+    int nucleo; // 0 con un solo núcleo
+    struct nucleos * nucleos; // NULL con un solo núcleo
+
+    //Consola: las colas compartidas con terminal o, sin terminal, un buffer de
+    //entrada para el teclado y un fichero para la salida de la GPU
+    struct shared_io * shm;
+    const char * entrada;
+    size_t entrada_tam;
+    size_t entrada_pos;
+    FILE * salida;
+    unsigned long long bytes_salida;
+
+    struct instr_decodificada cache_instr[0x10000];
+    uint64_t cache_instr_validas[0x10000 / 64];
+    unsigned long long cache_instr_aciertos;
+    unsigned long long cache_instr_fallos;
+
+    struct jit * jit; // NULL si la máquina no usa el JIT
+    struct cache * cache; // Modelo de caché de memoria, NULL sin --cache
+    struct segmentado * segmentado; // Modelo de cauce, NULL sin --segmentado
+    struct precarga * precarga; // Modelo de cola de precarga, NULL sin --precarga
+    struct mmu * mmu; // MMU con paginación, NULL sin --mmu
+
+    //Contadores de rendimiento. Los accesos los escriben los dispositivos desde el
+    //hilo del bus (el del reloj en modo con reloj), así que son atómicos con un solo escritor.
+    unsigned long long ejecuciones[NUM_OPERACIONES * 4];
+    atomic_ullong accesos[NUM_DISPOSITIVOS][2];
+    struct estadisticas * estadisticas; // Página publicada (NULL sin terminal)
+    struct perfil * perfil; // NULL sin --perfil
+    unsigned long long proxima_publicacion; // Instrucción de la siguiente publicación
+    unsigned long long paso_publicacion;
+    struct timespec ultima_publicacion;
+
+    //Instantáneas: fichero en el que se guardan (NULL: desactivadas) y petición
+    //pendiente del registro de control, que se atiende al acabar la instrucción
+    const char * ruta_snapshot;
+    int snapshot_pendiente;
+
+    //Parada: con salto_activo, detener() vuelve al setjmp del que lanzó la ejecución
+    enum motivo_parada motivo;
+    char mensaje[128];
+    jmp_buf salto;
+    int salto_activo;
+};
+
+//Máquina que ejecuta el hilo actual, para que error() sepa a quién detener
+static _Thread_local struct computador * maquina_actual = NULL;
+
+//Detiene la máquina. Una ejecución que ha armado el salto (lotes) vuelve a su
+//punto de entrada; si no, se imprime el motivo y termina el proceso como siempre.
+_Noreturn void detener(struct computador * comp, enum motivo_parada motivo, const char * mensaje) {
+    if (comp != NULL && comp->salto_activo) {
+        comp->motivo = motivo;
+        snprintf(comp->mensaje, sizeof(comp->mensaje), "%s", mensaje);
+        longjmp(comp->salto, 1);
     }
-    if (comp->procesador->pc - 1 == 0x0 && instr == 0x0) {
-        printf("Ejecución detenida por instrucción nula en dirección 0x0000.\n");
-        exit(1);
+    traza_volcar();
+    switch (motivo) {
+        case PARADA_HALT:
+            printf("Ejecución detenida por instrucción HALT.\n");
+            break;
+        case PARADA_INSTR_NULA:
+            printf("Ejecución detenida por instrucción nula en dirección 0x0000.\n");
+            break;
+        case PARADA_LIMITE_INSTRUCCIONES:
+        case PARADA_LIMITE_CICLOS:
+        case PARADA_ESPERA:
+            printf("Ejecución detenida: %s.\n", mensaje);
+            break;
+        default:
+            printf("Error: %s\n", mensaje);
+            break;
     }
-    printf("[IF] Instrucción leída: 0x%08X\n", instr);
+    exit(codigos_salida[motivo]);
+}
 
-    //Decodificación de la instrucción
-    //Formato de instrucción (32 bits):
-    // opcode (8 bits) | registro (4 bits) | direccionamiento (4 bits) | operando (16 bits)
-    int opcode = (instr >> 24) & 0xFF;
-    int reg = (instr >> 20) & 0x0F;
-    int addr_mode = (instr >> 16) & 0x0F;
-    int operando = instr & 0xFFFF;
+void error(const char * mensaje) {
+    detener(maquina_actual, PARADA_ERROR, mensaje);
+}
+
+static inline void bus_ciclo(struct computador * comp);
+
+//Hilo del reloj. En cada flanco el bus atiende la transacción pendiente antes de
+//que el flanco se publique, así que la CPU siempre encuentra la respuesta al
+//despertar, igual que en modo turbo. Las trazas de los dispositivos llevan el
+//flanco que se está dando.
+void * clk(void * arg) {
+    struct computador * comp = (struct computador *) arg;
+    atomic_uint flanco;
+    traza_reloj = &flanco;
+    while (1) {
+        usleep(VELOCIDAD_RELOJ_US); //Un ciclo de reloj cada segundo
+        ESCRIBIR_BUS(&comp->reloj.val, !LEER_BUS(&comp->reloj.val));
+        atomic_store_explicit(&flanco, atomic_load(&comp->reloj.generacion) + 1, memory_order_relaxed);
+        bus_ciclo(comp);
+        atomic_fetch_add(&comp->reloj.generacion, 1);
+        if (atomic_load(&comp->reloj.durmientes) > 0) {
+            reloj_despertar(&comp->reloj);
+        }
+    }
+
+    return NULL;
+}
+
+void memory_protection_emulation(int addr) {
+    if ((unsigned int)addr < MEMORY_DATA_BARRIER) {
+        error("Escritura sobre memoria protegida de solo lectura");
+    }
+}
+
+//Cada contador de accesos tiene un único escritor: el hilo que mueve el bus
+static inline void contar_acceso(struct computador * comp, enum dispositivo d, int control) {
+    atomic_ullong * c = &comp->accesos[d][control != IO_OP_READ];
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+//GPU
+//Caracteres para la consola, escritos por la CPU (de uno en uno) o por el DMA
+static void gpu_emitir(struct computador * comp, const char * datos, size_t n) {
+    comp->bytes_salida += n;
+    // Escribir en la cola compartida VM->Host; si está llena, lo que no cabe se descarta
+    if (comp->shm) {
+        anillo_escribir(&comp->shm->vth, datos, n);
+    } else if (comp->salida) {
+        fwrite(datos, 1, n, comp->salida);
+    }
+}
+
+static int gpu_leer(struct computador * comp, int direccion) {
+    contar_acceso(comp, DISPOSITIVO_GPU, IO_OP_READ);
+    if (direccion == GPU_STATUS_ADDR) {
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_GPU, EV_GPU_LEE_ESTADO, 0, 0, 0, 0);
+        return 0x1; //We can always print to the GPU
+    }
+    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_GPU, EV_GPU_LEE_DATOS, 0, 0, 0, 0);
+    return 0x0; //No data available
+}
+
+static void gpu_escribir(struct computador * comp, int direccion, int dato) {
+    contar_acceso(comp, DISPOSITIVO_GPU, IO_OP_WRITE);
+    if (direccion == GPU_STATUS_ADDR) {
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_GPU, EV_GPU_ESCRIBE_ESTADO, 0, 0, 0, 0);
+        return;
+    }
+    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_GPU, EV_GPU_ESCRIBE_DATOS, dato, 0, 0, 0);
+    char c = (char)dato;
+    gpu_emitir(comp, &c, 1);
+}
+
+//Bytes pendientes para el teclado
+static int teclado_disponibles(struct computador * comp) {
+    if (comp->shm) {
+        return (int)anillo_pendientes(&comp->shm->htv);
+    }
+    return (int)(comp->entrada_tam - comp->entrada_pos);
+}
+
+//Línea de interrupción del teclado, activa por nivel mientras haya bytes pendientes:
+//el manejador la baja leyendo KBD_DATA hasta vaciar la cola
+static inline int teclado_irq(struct computador * comp) {
+    return teclado_disponibles(comp) > 0;
+}
+
+//Registros del teclado
+static int teclado_leer(struct computador * comp, int direccion) {
+    contar_acceso(comp, DISPOSITIVO_TECLADO, IO_OP_READ);
+    if (direccion == TECLADO_STATUS_ADDR) {
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_KBD, EV_KBD_LEE_ESTADO, 0, 0, 0, 0);
+        int bytes_available = teclado_disponibles(comp);
+        TRAZA(TRAZA_NIVEL_TODO, TRAZA_KBD, EV_KBD_DISPONIBLES, bytes_available, 0, 0, 0);
+        return bytes_available > 0 ? 0x1 : 0x0;
+    }
+    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_KBD, EV_KBD_LEE_DATOS, 0, 0, 0, 0);
+    // Leer de buffer compartido Host->VM
+    if (teclado_disponibles(comp) > 0) {
+        char c;
+        if (comp->shm) {
+            anillo_leer(&comp->shm->htv, &c, 1);
+        } else {
+            c = comp->entrada[comp->entrada_pos++];
+        }
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_KBD, EV_KBD_CARACTER, c, 0, 0, 0);
+        return (int)c;
+    }
+    TRAZA(TRAZA_NIVEL_TODO, TRAZA_KBD, EV_KBD_SIN_DATOS, 0, 0, 0, 0);
+    return 0; //No data available
+}
+
+static void teclado_escribir(struct computador * comp, int direccion, int dato) {
+    (void)dato;
+    contar_acceso(comp, DISPOSITIVO_TECLADO, IO_OP_WRITE);
+    if (direccion == TECLADO_STATUS_ADDR) {
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_KBD, EV_KBD_ESCRIBE_ESTADO, 0, 0, 0, 0);
+    } else {
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_KBD, EV_KBD_ESCRIBE_DATOS, 0, 0, 0, 0);
+    }
+}
+
+//Registro de control del sistema
+static int sistema_leer(struct computador * comp, int direccion) {
+    (void)direccion;
+    contar_acceso(comp, DISPOSITIVO_SISTEMA, IO_OP_READ);
+    return 0;
+}
+
+static void sistema_escribir(struct computador * comp, int direccion, int dato) {
+    (void)direccion;
+    contar_acceso(comp, DISPOSITIVO_SISTEMA, IO_OP_WRITE);
+    if (dato == SISTEMA_SNAPSHOT && comp->ruta_snapshot != NULL) {
+        comp->snapshot_pendiente = 1;
+        comp->evento_ciclos = 0;
+    }
+}
+
+static inline int cache_instr_valida(struct computador * comp, int direccion) {
+    return (comp->cache_instr_validas[direccion >> 6] >> (direccion & 63)) & 1;
+}
+
+static inline void jit_notificar_escritura(struct computador * comp, int direccion);
+
+static inline void cache_instr_invalidar(struct computador * comp, int direccion) {
+    comp->cache_instr_validas[direccion >> 6] &= ~(1ULL << (direccion & 63));
+}
+
+//Índice del manejador en el intérprete hilado: opcode * 4 + modo, o uno de estos dos
+#define MANEJADOR_OPCODE_INVALIDO (NUM_OPERACIONES * 4)
+#define MANEJADOR_MODO_INVALIDO (NUM_OPERACIONES * 4 + 1)
+
+static inline void cache_instr_guardar(struct computador * comp, int direccion, int instr) {
+    struct instr_decodificada * d = &comp->cache_instr[direccion];
+    d->instr = instr;
+    d->opcode = (instr >> 24) & 0xFF;
+    d->reg = (instr >> 20) & 0x0F;
+    d->addr_mode = (instr >> 16) & 0x0F;
+    d->operando = instr & 0xFFFF;
+    if (d->addr_mode > 3) {
+        d->manejador = MANEJADOR_MODO_INVALIDO;
+    } else if (d->opcode >= NUM_OPERACIONES) {
+        d->manejador = MANEJADOR_OPCODE_INVALIDO;
+    } else {
+        d->manejador = d->opcode * 4 + d->addr_mode;
+    }
+    //Con varios núcleos otro puede reescribir el código por encima de la barrera
+    //sin que este se entere, así que esas entradas se decodifican cada vez
+    if (comp->nucleos == NULL || direccion < MEMORY_DATA_BARRIER) {
+        comp->cache_instr_validas[direccion >> 6] |= 1ULL << (direccion & 63);
+    }
+}
+
+//Palabra de memoria en cualquier dirección de 32 bits, sin reservar nada
+static inline int memoria_valor(const struct computador * comp, int direccion) {
+    uint32_t d = (uint32_t)direccion;
+    if (d < MEMORIA_BAJA) return comp->memoria[d];
+    struct memoria_tabla * t = atomic_load_explicit(&comp->alta->tablas[d >> (MEMORIA_TABLA_BITS + MEMORIA_PAGINA_BITS)], memory_order_acquire);
+    if (t == NULL) return 0;
+    int * pagina = atomic_load_explicit(&t->paginas[(d >> MEMORIA_PAGINA_BITS) & ((1u << MEMORIA_TABLA_BITS) - 1)], memory_order_acquire);
+    return pagina != NULL ? pagina[d & (MEMORIA_PAGINA - 1)] : 0;
+}
+
+//Reserva, si aún no existe, lo que cuelga de *hueco; si otro núcleo se adelanta
+//se usa lo suyo. Devuelve 1 en *reservado si la reserva ha sido esta.
+static void * memoria_reservar(void * _Atomic * hueco, size_t tam, int * reservado) {
+    void * actual = atomic_load_explicit(hueco, memory_order_acquire);
+    *reservado = 0;
+    if (actual != NULL) return actual;
+    void * nuevo = calloc(1, tam);
+    if (nuevo == NULL) error("Sin memoria para una página del espacio de direcciones");
+    if (!atomic_compare_exchange_strong_explicit(hueco, &actual, nuevo, memory_order_acq_rel, memory_order_acquire)) {
+        free(nuevo);
+        return actual;
+    }
+    *reservado = 1;
+    return nuevo;
+}
+
+//Palabra de memoria para escribirla: reserva su página si hace falta
+static int * memoria_celda(struct computador * comp, int direccion) {
+    uint32_t d = (uint32_t)direccion;
+    if (d < MEMORIA_BAJA) return &comp->memoria[d];
+    struct memoria_alta * alta = comp->alta;
+    int reservada;
+    struct memoria_tabla * t = memoria_reservar((void * _Atomic *)&alta->tablas[d >> (MEMORIA_TABLA_BITS + MEMORIA_PAGINA_BITS)], sizeof(*t), &reservada);
+    int * pagina = memoria_reservar((void * _Atomic *)&t->paginas[(d >> MEMORIA_PAGINA_BITS) & ((1u << MEMORIA_TABLA_BITS) - 1)],
+        MEMORIA_PAGINA * sizeof(int), &reservada);
+    if (reservada) atomic_fetch_add_explicit(&alta->paginas, 1, memory_order_relaxed);
+    return &pagina[d & (MEMORIA_PAGINA - 1)];
+}
+
+//Recorre las páginas reservadas por encima de MEMORIA_BAJA en orden de dirección
+static void memoria_recorrer(const struct memoria_alta * alta, void (*visitar)(void * arg, uint32_t direccion, const int * pagina), void * arg) {
+    for (uint32_t i = 0; i < (1u << MEMORIA_DIRECTORIO_BITS); i++) {
+        struct memoria_tabla * t = atomic_load(&alta->tablas[i]);
+        if (t == NULL) continue;
+        for (uint32_t j = 0; j < (1u << MEMORIA_TABLA_BITS); j++) {
+            int * pagina = atomic_load(&t->paginas[j]);
+            if (pagina != NULL) visitar(arg, (i << MEMORIA_TABLA_BITS | j) << MEMORIA_PAGINA_BITS, pagina);
+        }
+    }
+}
+
+static void memoria_alta_destruir(struct memoria_alta * alta) {
+    if (alta == NULL) return;
+    for (uint32_t i = 0; i < (1u << MEMORIA_DIRECTORIO_BITS); i++) {
+        struct memoria_tabla * t = atomic_load(&alta->tablas[i]);
+        if (t == NULL) continue;
+        for (uint32_t j = 0; j < (1u << MEMORIA_TABLA_BITS); j++) {
+            free(atomic_load(&t->paginas[j]));
+        }
+        free(t);
+    }
+    free(alta);
+}
+
+//Formato de ROM por secciones: una cabecera y una tabla de segmentos
+//(dirección, palabras, desplazamiento en el fichero), seguidas de los datos.
+//Solo ocupa lo que el programa usa; las palabras fuera de los segmentos valen 0.
+//Un fichero sin la firma es una ROM plana: la palabra i va a la dirección i.
+#define ROM_MAGICO "ASOCROM1"
+#define ROM_VERSION 1
+
+struct rom_cabecera {
+    char magico[8];
+    uint32_t version;
+    uint32_t num_segmentos;
+};
+
+struct rom_segmento {
+    uint32_t direccion; // En palabras
+    uint32_t palabras;
+    uint32_t offset; // En bytes desde el principio del fichero
+};
+
+//Copia un segmento del fichero a memoria. Las páginas enteras cuyo desplazamiento
+//en el fichero coincide (módulo página) con el de la memoria se proyectan con
+//mmap privado en lugar de copiarse: no se leen hasta que se tocan y una escritura
+//solo duplica esa página. Los trozos sueltos de los extremos se leen con pread.
+static int rom_cargar_segmento(struct computador * comp, int fd, uint32_t direccion, uint32_t palabras, uint64_t offset) {
+    long pagina = sysconf(_SC_PAGESIZE);
+    char * base = (char *) comp->memoria;
+    uint64_t inicio = (uint64_t) direccion * sizeof(int);
+    uint64_t fin = inicio + (uint64_t) palabras * sizeof(int);
+    uint64_t p0 = inicio, p1 = inicio;
+    if (pagina > 0 && (inicio - offset) % (uint64_t) pagina == 0) {
+        p0 = (inicio + pagina - 1) / pagina * pagina;
+        p1 = fin / pagina * pagina;
+        if (p1 <= p0) {
+            p0 = p1 = inicio;
+        } else if (mmap(base + p0, p1 - p0, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                        (off_t) (offset + (p0 - inicio))) == MAP_FAILED) {
+            p0 = p1 = fin;
+        }
+    }
+    //Cabeza [inicio, p0) y cola [p1, fin); sin proyección la cabeza lo cubre todo
+    uint64_t trozos[2][2] = { { inicio, p0 }, { p1, fin } };
+    for (int i = 0; i < 2; i++) {
+        uint64_t desde = trozos[i][0], hasta = trozos[i][1];
+        while (desde < hasta) {
+            ssize_t n = pread(fd, base + desde, hasta - desde, (off_t) (offset + (desde - inicio)));
+            if (n <= 0) return -1;
+            desde += n;
+        }
+    }
+    return 0;
+}
+
+//Copia un segmento por encima de MEMORIA_BAJA a sus páginas, que se reservan
+static int rom_cargar_alto(struct computador * comp, int fd, uint32_t direccion, uint32_t palabras, uint64_t offset) {
+    while (palabras > 0) {
+        uint32_t n = MEMORIA_PAGINA - (direccion & (MEMORIA_PAGINA - 1));
+        if (n > palabras) n = palabras;
+        size_t bytes = (size_t) n * sizeof(int);
+        if (pread(fd, memoria_celda(comp, (int) direccion), bytes, (off_t) offset) != (ssize_t) bytes) return -1;
+        direccion += n;
+        palabras -= n;
+        offset += bytes;
+    }
+    return 0;
+}
+
+//Devuelve 0 si la ROM se ha cargado entera, 1 si una ROM plana no llena la
+//memoria, -1 si no se pudo abrir y -2 si la tabla de segmentos no es válida
+//(en ese caso no se carga nada)
+int cargar_rom(struct computador * comp, const char * ruta) {
+    int fd = open(ruta, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    struct rom_cabecera cab;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    uint64_t tam = (uint64_t) st.st_size;
+    int resultado = 0;
+    if (pread(fd, &cab, sizeof(cab), 0) == (ssize_t) sizeof(cab) && memcmp(cab.magico, ROM_MAGICO, 8) == 0) {
+        struct rom_segmento * tabla = NULL;
+        size_t bytes_tabla = (size_t) cab.num_segmentos * sizeof(*tabla);
+        int valida = cab.version == ROM_VERSION && cab.num_segmentos <= 0x10000 &&
+                     (tabla = malloc(bytes_tabla > 0 ? bytes_tabla : 1)) != NULL &&
+                     pread(fd, tabla, bytes_tabla, sizeof(cab)) == (ssize_t) bytes_tabla;
+        //Se valida toda la tabla antes de tocar la memoria
+        for (uint32_t i = 0; valida && i < cab.num_segmentos; i++) {
+            valida = (uint64_t) tabla[i].direccion + tabla[i].palabras <= (1ULL << 32) &&
+                     tabla[i].offset % sizeof(int) == 0 &&
+                     (uint64_t) tabla[i].offset + (uint64_t) tabla[i].palabras * sizeof(int) <= tam;
+        }
+        for (uint32_t i = 0; valida && i < cab.num_segmentos; i++) {
+            //La parte por debajo de MEMORIA_BAJA se proyecta; la de encima se copia a sus páginas
+            uint32_t direccion = tabla[i].direccion, palabras = tabla[i].palabras;
+            uint32_t bajas = direccion >= MEMORIA_BAJA ? 0 : palabras < MEMORIA_BAJA - direccion ? palabras : MEMORIA_BAJA - direccion;
+            if (bajas > 0 && rom_cargar_segmento(comp, fd, direccion, bajas, tabla[i].offset) != 0) {
+                resultado = 1;
+            }
+            if (bajas < palabras && rom_cargar_alto(comp, fd, direccion + bajas, palabras - bajas, tabla[i].offset + (uint64_t) bajas * sizeof(int)) != 0) {
+                resultado = 1;
+            }
+        }
+        if (!valida) resultado = -2;
+        free(tabla);
+    } else {
+        uint64_t palabras = tam / sizeof(int);
+        if (palabras > 0x10000) palabras = 0x10000;
+        if (rom_cargar_segmento(comp, fd, 0, (uint32_t) palabras, 0) != 0 || palabras < 0x10000) {
+            resultado = 1;
+        }
+    }
+    close(fd);
+    return resultado;
+}
+
+//Modelo de caché entre la CPU y la memoria (--cache). Solo modela el tiempo: los
+//datos siguen en comp->memoria y la caché recuerda qué líneas estarían presentes
+//y cuáles sucias. Cada acceso de la CPU a memoria (búsqueda, lectura del operando
+//o escritura de ST) cuesta acierto o fallo flancos en lugar de los dos de la
+//transacción de bus, y la diferencia se suma a la instrucción. La E/S de
+//0xFFF0-0xFFFF no pasa por la caché. Dentro de cada conjunto se reemplaza la
+//línea usada hace más tiempo (LRU).
+//- Post-escritura (wb): la escritura que acierta solo marca la línea sucia; la que
+//  falla trae la línea. Expulsar una línea sucia cuesta otro fallo.
+//- Escritura directa (wt): toda escritura va a memoria y cuesta un fallo; si falla
+//  no trae la línea.
+#define CICLOS_ACCESO_MEMORIA 2 // Flancos de una transacción de bus con la memoria
+
+enum cache_tipo { CACHE_INSTRUCCION, CACHE_LECTURA, CACHE_ESCRITURA };
+
+struct cache_config {
+    int activa;
+    int palabras; // Tamaño total
+    int vias;
+    int linea; // Palabras por línea
+    int post_escritura; // 1 wb, 0 wt
+    int acierto; // Flancos de un acceso que acierta
+    int fallo; // Flancos de un acceso a memoria
+};
+
+//Configuración de --cache, la misma para todas las máquinas del proceso
+static struct cache_config cache_config = {0, 256, 2, 4, 1, 2, 10};
+
+struct cache_via {
+    unsigned int etiqueta;
+    int valida;
+    int sucia;
+    unsigned long long uso; // Marca LRU
+};
+
+struct cache {
+    struct cache_config config;
+    int conjuntos;
+    struct cache_via * vias; // conjuntos * vias
+    unsigned long long marca;
+    unsigned long long aciertos[2]; // [0 instrucciones, 1 datos]
+    unsigned long long fallos[2];
+    unsigned long long escrituras_memoria; // Líneas sucias expulsadas y escrituras directas
+    unsigned long long ciclos; // Flancos de más por la caché
+    unsigned long long ciclos_instruccion; // Los de la instrucción en curso, para el perfil
+};
+
+//Lee "tam=256,vias=2,linea=4,escritura=wb,acierto=2,fallo=10"; las claves que
+//faltan conservan su valor. Devuelve -1 si algo no es válido.
+static int cache_parsear(const char * texto, struct cache_config * c) {
+    char copia[256];
+    snprintf(copia, sizeof(copia), "%s", texto);
+    char * resto = copia;
+    char * par;
+    while ((par = strtok_r(resto, ",", &resto)) != NULL) {
+        char * valor = strchr(par, '=');
+        if (valor == NULL) return -1;
+        *valor++ = '\0';
+        if (strcmp(par, "escritura") == 0) {
+            if (strcmp(valor, "wb") == 0) c->post_escritura = 1;
+            else if (strcmp(valor, "wt") == 0) c->post_escritura = 0;
+            else return -1;
+            continue;
+        }
+        char * fin;
+        long n = strtol(valor, &fin, 0);
+        if (*fin != '\0' || n <= 0 || n > 0x10000) return -1;
+        if (strcmp(par, "tam") == 0) c->palabras = (int)n;
+        else if (strcmp(par, "vias") == 0) c->vias = (int)n;
+        else if (strcmp(par, "linea") == 0) c->linea = (int)n;
+        else if (strcmp(par, "acierto") == 0) c->acierto = (int)n;
+        else if (strcmp(par, "fallo") == 0) c->fallo = (int)n;
+        else return -1;
+    }
+    //Línea y tamaño potencias de 2, y un número entero de conjuntos
+    if ((c->linea & (c->linea - 1)) != 0 || (c->palabras & (c->palabras - 1)) != 0 ||
+        c->palabras % (c->linea * c->vias) != 0 || c->acierto < CICLOS_ACCESO_MEMORIA || c->fallo < c->acierto) {
+        return -1;
+    }
+    c->activa = 1;
+    return 0;
+}
+
+static struct cache * cache_crear(const struct cache_config * config) {
+    struct cache * c = calloc(1, sizeof(*c));
+    if (c == NULL) return NULL;
+    c->config = *config;
+    c->conjuntos = config->palabras / (config->linea * config->vias);
+    c->vias = calloc((size_t)config->palabras / config->linea, sizeof(*c->vias));
+    if (c->vias == NULL) {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+static void cache_destruir(struct cache * c) {
+    if (c == NULL) return;
+    free(c->vias);
+    free(c);
+}
+
+//Flancos que cuesta un acceso de la CPU a la dirección (de memoria) dada
+static unsigned int cache_latencia(struct cache * c, int direccion, enum cache_tipo tipo) {
+    unsigned int linea = (unsigned int)direccion / (unsigned int)c->config.linea;
+    unsigned int etiqueta = linea / (unsigned int)c->conjuntos;
+    struct cache_via * conjunto = &c->vias[(linea % (unsigned int)c->conjuntos) * (unsigned int)c->config.vias];
+    int datos = tipo != CACHE_INSTRUCCION;
+    int escritura = tipo == CACHE_ESCRITURA;
+    struct cache_via * victima = &conjunto[0];
+    for (int i = 0; i < c->config.vias; i++) {
+        struct cache_via * v = &conjunto[i];
+        if (v->valida && v->etiqueta == etiqueta) {
+            c->aciertos[datos]++;
+            v->uso = ++c->marca;
+            if (escritura && !c->config.post_escritura) {
+                c->escrituras_memoria++;
+                return (unsigned int)c->config.fallo;
+            }
+            if (escritura) v->sucia = 1;
+            return (unsigned int)c->config.acierto;
+        }
+        if (!v->valida ? victima->valida : victima->valida && v->uso < victima->uso) {
+            victima = v;
+        }
+    }
+    c->fallos[datos]++;
+    unsigned int ciclos = (unsigned int)c->config.fallo;
+    if (escritura && !c->config.post_escritura) {
+        c->escrituras_memoria++;
+        return ciclos; //Sin asignación en escritura
+    }
+    if (victima->valida && victima->sucia) {
+        c->escrituras_memoria++;
+        ciclos += (unsigned int)c->config.fallo;
+    }
+    victima->valida = 1;
+    victima->sucia = escritura;
+    victima->etiqueta = etiqueta;
+    victima->uso = ++c->marca;
+    return ciclos;
+}
+
+//El DMA escribe en memoria sin pasar por la caché: la línea con la copia vieja se descarta
+static void cache_invalidar(struct cache * c, int direccion) {
+    unsigned int linea = (unsigned int)direccion / (unsigned int)c->config.linea;
+    struct cache_via * conjunto = &c->vias[(linea % (unsigned int)c->conjuntos) * (unsigned int)c->config.vias];
+    for (int i = 0; i < c->config.vias; i++) {
+        if (conjunto[i].valida && conjunto[i].etiqueta == linea / (unsigned int)c->conjuntos) {
+            conjunto[i].valida = 0;
+        }
+    }
+}
+
+//MMU (--mmu): entre la CPU y el bus, traduce con paginación las direcciones
+//virtuales de la búsqueda, de los operandos y de las escrituras a físicas. La
+//tabla de páginas está en la memoria del invitado y tiene dos niveles, como la de
+//x86 pero con páginas de MEMORIA_PAGINA palabras: los 12 bits altos de la
+//dirección virtual eligen la entrada del directorio (4096 palabras a partir de
+//MMU_TABLA_ADDR), los 10 siguientes la de la tabla (una página) y los 10 bajos
+//la palabra. Cada entrada es la dirección física de la página (o de la tabla)
+//con los permisos en los bits bajos. La E/S de 0xFFF0-0xFFFF no se traduce.
+//Un TLB asociativo por conjuntos guarda las últimas traducciones; un fallo del TLB
+//recorre la tabla: dos lecturas de memoria más la escritura de los bits de
+//accedida o sucia si cambian, y esos flancos se suman a la instrucción.
+//Un fallo de página deja la dirección y la causa en los registros de la MMU y
+//entra en el manejador de interrupción con el PC de la instrucción que falló, que
+//se repite entera al volver con RETI. Hasta el fallo la instrucción solo ha leído,
+//así que no ha cambiado nada salvo en un caso: un indirecto cuyo puntero está en la
+//E/S (LD ACC, @0xFFF2) ya ha hecho esa lectura, con sus efectos, cuando falla la
+//dirección a la que apunta, y al repetirse se vuelve a leer el dispositivo.
+#define MMU_CONTROL_ADDR 0xFFFB // Bit 0: paginación activa. Escribir vacía el TLB
+#define MMU_TABLA_ADDR 0xFFFC // Dirección física del directorio. Escribir vacía el TLB
+#define MMU_FALLO_ADDR 0xFFFD // Leer: dirección virtual del último fallo; escribir: quita del TLB esa página
+#define MMU_CAUSA_ADDR 0xFFFE // Leer: causa del último fallo; escribir: la pone a 0
+#define MMU_ACTIVA 0x1
+#define MMU_PRESENTE 0x1 // Bits de las entradas del directorio y de las tablas
+#define MMU_ESCRIBIBLE 0x2 // En el directorio y en la tabla para poder escribir
+#define MMU_ACCEDIDA 0x4 // Solo en la tabla: los pone la MMU
+#define MMU_SUCIA 0x8
+#define MMU_CAUSA_PROTECCION 0x1 // Bits de la causa: página presente pero sin permiso
+#define MMU_CAUSA_ESCRITURA 0x2 // El acceso era una escritura
+#define MMU_CAUSA_INSTRUCCION 0x4 // El acceso era la búsqueda de la instrucción
+#define MMU_CAUSA_PENDIENTE 0x8 // La entrada al manejador es un fallo de página
+#define MMU_DIRECTORIO_BITS 12
+
+enum mmu_reemplazo { MMU_LRU, MMU_FIFO, MMU_ALEATORIO };
+static const char * const nombres_reemplazo[] = {"lru", "fifo", "aleatorio"};
+
+struct mmu_config {
+    int activa;
+    int entradas; // Del TLB
+    int vias;
+    enum mmu_reemplazo reemplazo;
+};
+
+//Configuración de --mmu, la misma para todas las máquinas del proceso
+static struct mmu_config mmu_config = {0, 16, 4, MMU_LRU};
+
+struct tlb_entrada {
+    unsigned int pagina; // Número de página virtual
+    int marco; // Dirección física de la página
+    int entrada; // Dirección física de la entrada de la tabla, para marcarla sucia
+    int valida;
+    int escribible;
+    int sucia;
+    unsigned long long uso; // Marca LRU o FIFO
+};
+
+struct mmu {
+    struct mmu_config config;
+    int conjuntos;
+    struct tlb_entrada * tlb; // conjuntos * vias
+    unsigned long long marca;
+    unsigned int semilla; // Reemplazo aleatorio, siempre la misma secuencia
+    //Registros
+    int control;
+    int tabla;
+    int direccion_fallo;
+    int causa;
+    //La instrucción en curso y si la CPU está dentro del manejador (de la entrada a RETI)
+    int pc_instruccion;
+    unsigned long long ciclos_inicio; // comp->ciclos al empezar la instrucción en curso
+    int en_manejador;
+    jmp_buf fallo; // Vuelve a unidad_de_control() para abandonar la instrucción
+    unsigned long long aciertos[2]; // [0 instrucciones, 1 datos]
+    unsigned long long fallos_tlb[2];
+    unsigned long long fallos_pagina;
+    unsigned long long vaciados; // Del TLB entero
+    unsigned long long ciclos; // Flancos de los recorridos de la tabla
+    unsigned long long ciclos_instruccion; // Los de la instrucción en curso, para el perfil
+};
+
+//Lee "tlb=16,vias=4,reemplazo=lru"; las claves que faltan conservan su valor.
+//Devuelve -1 si algo no es válido.
+static int mmu_parsear(const char * texto, struct mmu_config * c) {
+    char copia[256];
+    snprintf(copia, sizeof(copia), "%s", texto);
+    char * resto = copia;
+    char * par;
+    while ((par = strtok_r(resto, ",", &resto)) != NULL) {
+        char * valor = strchr(par, '=');
+        if (valor == NULL) return -1;
+        *valor++ = '\0';
+        if (strcmp(par, "reemplazo") == 0) {
+            if (strcmp(valor, "lru") == 0) c->reemplazo = MMU_LRU;
+            else if (strcmp(valor, "fifo") == 0) c->reemplazo = MMU_FIFO;
+            else if (strcmp(valor, "aleatorio") == 0) c->reemplazo = MMU_ALEATORIO;
+            else return -1;
+            continue;
+        }
+        char * fin;
+        long n = strtol(valor, &fin, 0);
+        if (*fin != '\0' || n <= 0 || n > 0x10000) return -1;
+        if (strcmp(par, "tlb") == 0) c->entradas = (int)n;
+        else if (strcmp(par, "vias") == 0) c->vias = (int)n;
+        else return -1;
+    }
+    //Un número de conjuntos potencia de 2
+    int conjuntos = c->entradas / c->vias;
+    if (c->entradas % c->vias != 0 || (conjuntos & (conjuntos - 1)) != 0) return -1;
+    c->activa = 1;
+    return 0;
+}
+
+static struct mmu * mmu_crear(const struct mmu_config * config) {
+    struct mmu * m = calloc(1, sizeof(*m));
+    if (m == NULL) return NULL;
+    m->config = *config;
+    m->conjuntos = config->entradas / config->vias;
+    m->semilla = 0x2545F491;
+    m->tlb = calloc((size_t)config->entradas, sizeof(*m->tlb));
+    if (m->tlb == NULL) {
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+static void mmu_destruir(struct mmu * m) {
+    if (m == NULL) return;
+    free(m->tlb);
+    free(m);
+}
+
+static void mmu_vaciar(struct mmu * m) {
+    for (int i = 0; i < m->config.entradas; i++) {
+        m->tlb[i].valida = 0;
+    }
+    m->vaciados++;
+}
+
+static struct tlb_entrada * tlb_buscar(struct mmu * m, unsigned int pagina) {
+    struct tlb_entrada * conjunto = &m->tlb[(pagina % (unsigned int)m->conjuntos) * (unsigned int)m->config.vias];
+    for (int i = 0; i < m->config.vias; i++) {
+        if (conjunto[i].valida && conjunto[i].pagina == pagina) return &conjunto[i];
+    }
+    return NULL;
+}
+
+//Vía en la que se guarda una traducción nueva: una libre o la que diga la política
+static struct tlb_entrada * tlb_victima(struct mmu * m, unsigned int pagina) {
+    struct tlb_entrada * conjunto = &m->tlb[(pagina % (unsigned int)m->conjuntos) * (unsigned int)m->config.vias];
+    struct tlb_entrada * victima = &conjunto[0];
+    for (int i = 0; i < m->config.vias; i++) {
+        if (!conjunto[i].valida) return &conjunto[i];
+        if (conjunto[i].uso < victima->uso) victima = &conjunto[i];
+    }
+    if (m->config.reemplazo == MMU_ALEATORIO) {
+        m->semilla ^= m->semilla << 13; // xorshift32
+        m->semilla ^= m->semilla >> 17;
+        m->semilla ^= m->semilla << 5;
+        victima = &conjunto[m->semilla % (unsigned int)m->config.vias];
+    }
+    return victima;
+}
+
+//DMA
+//La transferencia avanza en los flancos en los que la CPU deja el bus libre (robo
+//de ciclos): la CPU tiene prioridad y nunca espera, y cada palabra ocupa dos
+//flancos del bus, una lectura y una escritura. Para que todos los núcleos den el
+//mismo resultado, los flancos libres de cada instrucción se le entregan al acabarla.
+#define CICLOS_DMA_PALABRA 2
+
+//Escribir DMA_INICIAR en el control: se comprueba todo el bloque antes de empezar.
+//El origen es memoria; el destino, memoria escribible o el registro de datos de la GPU.
+static void dma_iniciar(struct computador * comp) {
+    struct dma * d = &comp->dma;
+    if (d->estado & DMA_OCUPADO) return;
+    int valido = d->longitud >= 0 && d->origen >= 0 && (long long)d->origen + d->longitud <= GPU_DATA_ADDR &&
+        (d->destino == GPU_DATA_ADDR || (d->destino >= MEMORY_DATA_BARRIER && (long long)d->destino + d->longitud <= GPU_DATA_ADDR));
+    if (!valido) {
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_DMA, EV_DMA_ERROR, d->origen, d->destino, d->longitud, 0);
+        d->estado = DMA_ERROR;
+        return;
+    }
+    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_DMA, EV_DMA_INICIO, d->origen, d->destino, d->longitud, 0);
+    d->transferencias++;
+    d->flancos = 0;
+    d->estado = d->longitud > 0 ? DMA_OCUPADO : DMA_TERMINADO;
+}
+
+static void nucleos_bus_tomar(struct nucleos * n);
+static void nucleos_bus_soltar(struct nucleos * n);
+
+//Con varios núcleos la GPU la comparten todos, así que el DMA también toma el bus
+static void dma_emitir(struct computador * comp, const char * datos, size_t n) {
+    if (comp->nucleos != NULL) nucleos_bus_tomar(comp->nucleos);
+    gpu_emitir(comp, datos, n);
+    if (comp->nucleos != NULL) nucleos_bus_soltar(comp->nucleos);
+}
+
+//Mueve las palabras que caben en los flancos libres que se le dan
+static void dma_avanzar(struct computador * comp, unsigned int flancos) {
+    struct dma * d = &comp->dma;
+    char salida[256]; // Los caracteres para la GPU se encolan por tandas
+    size_t n_salida = 0;
+    d->flancos += flancos;
+    while (d->flancos >= CICLOS_DMA_PALABRA && d->longitud > 0) {
+        d->flancos -= CICLOS_DMA_PALABRA;
+        int valor = comp->memoria[d->origen++];
+        if (d->destino == GPU_DATA_ADDR) {
+            salida[n_salida++] = (char)valor;
+            if (n_salida == sizeof(salida)) {
+                dma_emitir(comp, salida, n_salida);
+                n_salida = 0;
+            }
+            d->palabras_gpu++;
+        } else {
+            comp->memoria[d->destino] = valor;
+            if (comp->cache != NULL) cache_invalidar(comp->cache, d->destino);
+            cache_instr_invalidar(comp, d->destino);
+            jit_notificar_escritura(comp, d->destino);
+            d->destino++;
+        }
+        d->longitud--;
+        d->palabras++;
+    }
+    if (n_salida > 0) {
+        dma_emitir(comp, salida, n_salida);
+    }
+    if (d->longitud == 0) {
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_DMA, EV_DMA_FIN, 0, 0, 0, 0);
+        d->estado = DMA_TERMINADO;
+        d->flancos = 0;
+    }
+}
+
+//Termina la transferencia en curso sin que pase el tiempo (la CPU no usa el bus)
+static void dma_completar(struct computador * comp) {
+    if (comp->dma.estado & DMA_OCUPADO) {
+        dma_avanzar(comp, (unsigned int)comp->dma.longitud * CICLOS_DMA_PALABRA);
+    }
+}
+
+//Registros del DMA
+static int dma_leer(struct computador * comp, int direccion) {
+    struct dma * d = &comp->dma;
+    contar_acceso(comp, DISPOSITIVO_DMA, IO_OP_READ);
+    return direccion == DMA_ORIGEN_ADDR ? d->origen : direccion == DMA_DESTINO_ADDR ? d->destino :
+           direccion == DMA_LONGITUD_ADDR ? d->longitud : d->estado;
+}
+
+static void dma_escribir(struct computador * comp, int direccion, int dato) {
+    struct dma * d = &comp->dma;
+    contar_acceso(comp, DISPOSITIVO_DMA, IO_OP_WRITE);
+    if (direccion == DMA_CONTROL_ADDR) {
+        if (dato == DMA_INICIAR) dma_iniciar(comp);
+    } else if (!(d->estado & DMA_OCUPADO)) { //Durante la transferencia son de solo lectura
+        if (direccion == DMA_ORIGEN_ADDR) d->origen = dato;
+        else if (direccion == DMA_DESTINO_ADDR) d->destino = dato;
+        else d->longitud = dato;
+    }
+}
+
+//Memoria
+static int memoria_leer(struct computador * comp, int direccion) {
+    int valor = memoria_valor(comp, direccion);
+    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_MEM, EV_MEM_LEE, direccion, valor, 0, 0);
+    atomic_store_explicit(&comp->guard, valor, memory_order_release);
+    return valor;
+}
+
+static void memoria_escribir(struct computador * comp, int direccion, int dato) {
+    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_MEM, EV_MEM_ESCRIBE, direccion, dato, 0, 0);
+    memory_protection_emulation(direccion);
+    if ((unsigned int)direccion >= MEMORIA_BAJA) {
+        *memoria_celda(comp, direccion) = dato; // Ni caché de instrucciones ni JIT ahí
+        return;
+    }
+    comp->memoria[direccion] = dato;
+    cache_instr_invalidar(comp, direccion);
+    jit_notificar_escritura(comp, direccion);
+}
+
+//El bus compartido entre núcleos: cuenta las veces que hay que esperar a otro
+static void nucleos_bus_tomar(struct nucleos * n) {
+    if (pthread_mutex_trylock(&n->bus) != 0) {
+        atomic_fetch_add_explicit(&n->esperas, 1, memory_order_relaxed);
+        pthread_mutex_lock(&n->bus);
+    }
+    atomic_fetch_add_explicit(&n->arbitrajes, 1, memory_order_relaxed);
+}
+
+static void nucleos_bus_soltar(struct nucleos * n) {
+    pthread_mutex_unlock(&n->bus);
+}
+
+//GPU y sistema con varios núcleos: el dispositivo es el del núcleo 0
+static int es_compartida_leer(struct computador * comp, int direccion) {
+    struct nucleos * n = comp->nucleos;
+    nucleos_bus_tomar(n);
+    int valor = n->es.rangos[n->es.decodificacion[direccion]].leer(n->maquina[0], direccion);
+    nucleos_bus_soltar(n);
+    return valor;
+}
+
+static void es_compartida_escribir(struct computador * comp, int direccion, int dato) {
+    struct nucleos * n = comp->nucleos;
+    nucleos_bus_tomar(n);
+    n->es.rangos[n->es.decodificacion[direccion]].escribir(n->maquina[0], direccion, dato);
+    nucleos_bus_soltar(n);
+}
+
+//Registros del núcleo, de solo lectura: cada núcleo ve su número
+static int nucleo_leer(struct computador * comp, int direccion) {
+    if (direccion == NUCLEO_ID_ADDR) return comp->nucleo;
+    return comp->nucleos != NULL ? comp->nucleos->num : 1;
+}
+
+static void nucleo_escribir(struct computador * comp, int direccion, int dato) {
+    (void)comp;
+    (void)direccion;
+    (void)dato;
+}
+
+//Registros de la MMU, de cada núcleo
+static int mmu_leer(struct computador * comp, int direccion) {
+    struct mmu * m = comp->mmu;
+    if (direccion == MMU_CONTROL_ADDR) return m->control;
+    if (direccion == MMU_TABLA_ADDR) return m->tabla;
+    if (direccion == MMU_FALLO_ADDR) return m->direccion_fallo;
+    return m->causa;
+}
+
+static void mmu_escribir(struct computador * comp, int direccion, int dato) {
+    struct mmu * m = comp->mmu;
+    if (direccion == MMU_CONTROL_ADDR || direccion == MMU_TABLA_ADDR) {
+        if (direccion == MMU_CONTROL_ADDR) m->control = dato & MMU_ACTIVA;
+        else m->tabla = (int)((unsigned int)dato & ~(MEMORIA_PAGINA - 1));
+        mmu_vaciar(m);
+    } else if (direccion == MMU_FALLO_ADDR) {
+        struct tlb_entrada * e = tlb_buscar(m, (unsigned int)dato >> MEMORIA_PAGINA_BITS);
+        if (e != NULL) e->valida = 0;
+    } else {
+        m->causa = 0;
+    }
+}
+
+//XCHG: intercambia un registro con una palabra de memoria en un solo ciclo de
+//lectura-escritura del bus, así que ningún otro núcleo puede escribir en medio.
+//La E/S no admite XCHG.
+static int memoria_intercambiar(struct computador * comp, int direccion, int dato) {
+    int alta = (unsigned int)direccion >= MEMORIA_BAJA;
+    if (!alta && comp->bus.rangos[comp->bus.decodificacion[direccion]].leer != memoria_leer) {
+        error("XCHG solo admite direcciones de memoria");
+    }
+    memory_protection_emulation(direccion);
+    int * celda = memoria_celda(comp, direccion);
+    if (comp->nucleos != NULL) nucleos_bus_tomar(comp->nucleos);
+    int valor = __atomic_exchange_n(celda, dato, __ATOMIC_SEQ_CST);
+    if (comp->nucleos != NULL) nucleos_bus_soltar(comp->nucleos);
+    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_MEM, EV_MEM_LEE, direccion, valor, 0, 0);
+    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_MEM, EV_MEM_ESCRIBE, direccion, dato, 0, 0);
+    if (!alta) {
+        cache_instr_invalidar(comp, direccion);
+        jit_notificar_escritura(comp, direccion);
+    }
+    return valor;
+}
+
+//Asigna [desde, hasta] a un dispositivo. Cada dirección la atiende uno solo, así
+//que un rango que pisa otro ya registrado se rechaza (-1); también si no queda
+//sitio en la tabla. INHIBIR_BUS no se puede asignar: es el bus en reposo.
+int bus_registrar(struct bus_es * bus, const char * nombre, int desde, int hasta, bus_leer_fn leer, bus_escribir_fn escribir) {
+    if (bus->num_rangos == BUS_MAX_RANGOS || desde < 0 || hasta < desde || hasta >= INHIBIR_BUS) {
+        return -1;
+    }
+    for (int direccion = desde; direccion <= hasta; direccion++) {
+        if (bus->decodificacion[direccion] != BUS_NADIE) return -1;
+    }
+    int i = bus->num_rangos++;
+    bus->rangos[i] = (struct bus_rango){ nombre, desde, hasta, leer, escribir };
+    memset(&bus->decodificacion[desde], i, (size_t)(hasta - desde + 1));
+    return i;
+}
+
+//Mapa de direcciones de la máquina: la memoria ocupa todo lo que no es E/S. Con
+//varios núcleos la GPU y el registro de sistema se comparten a través del bus
+//arbitrado; el teclado y el DMA son solo del núcleo 0. Con --mmu sus registros
+//ocupan las últimas direcciones, que sin ella son memoria.
+static void bus_iniciar(struct computador * comp) {
+    struct bus_es * bus = &comp->bus;
+    memset(bus->decodificacion, BUS_NADIE, sizeof(bus->decodificacion));
+    bus->num_rangos = 0;
+    if (comp->nucleos == NULL) {
+        bus_registrar(bus, "GPU", GPU_DATA_ADDR, GPU_STATUS_ADDR, gpu_leer, gpu_escribir);
+        bus_registrar(bus, "sistema", SISTEMA_CONTROL_ADDR, SISTEMA_CONTROL_ADDR, sistema_leer, sistema_escribir);
+    } else {
+        bus_registrar(bus, "GPU", GPU_DATA_ADDR, GPU_STATUS_ADDR, es_compartida_leer, es_compartida_escribir);
+        bus_registrar(bus, "sistema", SISTEMA_CONTROL_ADDR, SISTEMA_CONTROL_ADDR, es_compartida_leer, es_compartida_escribir);
+    }
+    if (comp->nucleo == 0) {
+        bus_registrar(bus, "teclado", TECLADO_DATA_ADDR, TECLADO_STATUS_ADDR, teclado_leer, teclado_escribir);
+        bus_registrar(bus, "DMA", DMA_ORIGEN_ADDR, DMA_CONTROL_ADDR, dma_leer, dma_escribir);
+    }
+    bus_registrar(bus, "núcleo", NUCLEO_ID_ADDR, NUCLEO_CUENTA_ADDR, nucleo_leer, nucleo_escribir);
+    bus->alta = (unsigned char) bus_registrar(bus, "memoria", 0x0000, GPU_DATA_ADDR - 1, memoria_leer, memoria_escribir);
+    if (comp->mmu != NULL) {
+        bus_registrar(bus, "MMU", MMU_CONTROL_ADDR, MMU_CAUSA_ADDR, mmu_leer, mmu_escribir);
+    } else {
+        bus_registrar(bus, "memoria", NUCLEO_CUENTA_ADDR + 1, INHIBIR_BUS - 1, memoria_leer, memoria_escribir);
+    }
+}
+
+//Despachador del bus, una vez por flanco: si hay una transacción la atiende el
+//dispositivo que decodifica la dirección y el bus vuelve a reposo. Las 32 líneas
+//de dirección llegan enteras: por encima de 0xFFFF todo es memoria.
+static inline void bus_ciclo(struct computador * comp) {
+    struct io_channel * io = comp->io;
+    int direccion = LEER_BUS(io->direcciones);
+    if (direccion == INHIBIR_BUS) return;
+    unsigned int i = (unsigned int)direccion < MEMORIA_BAJA ? comp->bus.decodificacion[direccion] : comp->bus.alta;
+    if (i == BUS_NADIE) return;
+    const struct bus_rango * r = &comp->bus.rangos[i];
+    if (LEER_BUS(io->control) == IO_OP_READ) {
+        ESCRIBIR_BUS(io->datos, r->leer(comp, direccion));
+    } else {
+        r->escribir(comp, direccion, LEER_BUS(io->datos));
+    }
+    ESCRIBIR_BUS(io->direcciones, INHIBIR_BUS); //Inhibir bus after operation
+}
+
+//Crea una máquina con la CPU y los buses a cero. La memoria y las cachés son
+//grandes, así que la máquina siempre vive en el heap.
+struct computador * computador_crear(void) {
+    struct computador * comp = calloc(1, sizeof(*comp));
+    if (comp == NULL) return NULL;
+    //Alineada a página para poder proyectar encima la ROM o una instantánea
+    comp->memoria = mmap(NULL, 0x10000 * sizeof(int), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (comp->memoria == MAP_FAILED) {
+        free(comp);
+        return NULL;
+    }
+    comp->alta = calloc(1, sizeof(*comp->alta));
+    if (comp->alta == NULL) {
+        munmap(comp->memoria, 0x10000 * sizeof(int));
+        free(comp);
+        return NULL;
+    }
+    comp->procesador = &comp->cpu;
+    comp->io = &comp->canal;
+    comp->canal.direcciones = &comp->bus_direcciones;
+    comp->canal.datos = &comp->bus_datos;
+    comp->canal.control = &comp->bus_control;
+    comp->limite_instrucciones = ULLONG_MAX;
+    comp->limite_ciclos = ULLONG_MAX;
+    comp->proxima_publicacion = ULLONG_MAX;
+    bus_iniciar(comp);
+    return comp;
+}
+
+static void jit_liberar(struct computador * comp);
+static void precarga_destruir(struct precarga * p);
+
+void computador_destruir(struct computador * comp) {
+    if (comp == NULL) return;
+    jit_liberar(comp);
+    free(comp->perfil);
+    cache_destruir(comp->cache);
+    free(comp->segmentado);
+    precarga_destruir(comp->precarga);
+    mmu_destruir(comp->mmu);
+    if (comp->nucleo == 0) { // Los demás núcleos usan la suya
+        munmap(comp->memoria, 0x10000 * sizeof(int));
+        memoria_alta_destruir(comp->alta);
+    }
+    free(comp);
+}
+
+//Instantáneas
+//Una cabecera con la CPU, los contadores, el estado de los buses y las colas de
+//E/S, seguida de MEMORIA_BAJA en un desplazamiento alineado a página. Al
+//restaurar, esa parte se proyecta con mmap privado: muchas ejecuciones pueden
+//partir del mismo fichero sin copiarlo y cada una paga solo las páginas que escribe.
+//Detrás van las páginas reservadas por encima, cada una con su dirección delante.
+#define SNAPSHOT_MAGICO "ASOCSNP1"
+#define SNAPSHOT_VERSION 6
+
+struct snapshot_cabecera {
+    char magico[8];
+    uint32_t version;
+    uint32_t tam_cabecera;
+    uint64_t offset_memoria;
+    uint64_t palabras_memoria;
+    uint64_t paginas_altas; // Cada una: dirección (uint32_t) y MEMORIA_PAGINA palabras
+    int32_t pc;
+    int32_t registros[2];
+    uint32_t flags; // Z N C V IE en los bits 0-4
+    int32_t vector, pc_retorno;
+    uint32_t flags_retorno;
+    int32_t dma_origen, dma_destino, dma_longitud, dma_estado;
+    uint32_t dma_flancos;
+    int32_t mmu_control, mmu_tabla, mmu_fallo, mmu_causa; // Todo a 0 sin --mmu
+    uint32_t mmu_en_manejador;
+    uint64_t ciclos;
+    uint64_t instrucciones;
+    int32_t bus_direcciones, bus_datos, bus_control, guard, reloj;
+    uint32_t vth_head, vth_tail, htv_head, htv_tail; // Índices sin reducir módulo ANILLO_TAM
+    char vth_buf[ANILLO_TAM];
+    char htv_buf[ANILLO_TAM];
+};
+
+//Pedida con SIGUSR1; la atiende la máquina al acabar la instrucción en curso
+static volatile sig_atomic_t snapshot_senal = 0;
+
+static void snapshot_manejador_senal(int senal) {
+    (void)senal;
+    snapshot_senal = 1;
+}
+
+static uint32_t snapshot_flags(struct estado e) {
+    return (e.z & 1) | (e.n & 1) << 1 | (e.c & 1) << 2 | (e.v & 1) << 3 | (e.ie & 1) << 4;
+}
+
+static struct estado snapshot_estado(uint32_t flags) {
+    struct estado e = {0};
+    e.z = flags & 1;
+    e.n = (flags >> 1) & 1;
+    e.c = (flags >> 2) & 1;
+    e.v = (flags >> 3) & 1;
+    e.ie = (flags >> 4) & 1;
+    return e;
+}
+
+//Las copias de los índices remotos se ponen al día: nadie puede fiarse de las viejas
+static void snapshot_anillo(struct anillo * a, const char * buf, uint32_t cabeza, uint32_t cola) {
+    memcpy(a->buf, buf, ANILLO_TAM);
+    a->cola_vista = cola;
+    a->cabeza_vista = cabeza;
+    atomic_store(&a->cola, cola);
+    atomic_store(&a->cabeza, cabeza);
+}
+
+struct snapshot_escritura {
+    FILE * f;
+    int ok;
+};
+
+static void snapshot_pagina(void * arg, uint32_t direccion, const int * pagina) {
+    struct snapshot_escritura * e = arg;
+    e->ok = e->ok && fwrite(&direccion, sizeof(direccion), 1, e->f) == 1 &&
+            fwrite(pagina, sizeof(int), MEMORIA_PAGINA, e->f) == MEMORIA_PAGINA;
+}
+
+//Se escribe en un temporal y se renombra para que nadie restaure un fichero a medias
+int snapshot_guardar(struct computador * comp, const char * ruta) {
+    struct snapshot_cabecera * c = calloc(1, sizeof(*c));
+    if (c == NULL) return -1;
+    long pagina = sysconf(_SC_PAGESIZE);
+    if (pagina <= 0) pagina = 4096;
+    memcpy(c->magico, SNAPSHOT_MAGICO, 8);
+    c->version = SNAPSHOT_VERSION;
+    c->tam_cabecera = sizeof(*c);
+    c->offset_memoria = (sizeof(*c) + pagina - 1) / pagina * pagina;
+    c->palabras_memoria = MEMORIA_BAJA;
+    c->paginas_altas = atomic_load(&comp->alta->paginas);
+    c->pc = comp->cpu.pc;
+    c->registros[0] = comp->cpu.registros[0];
+    c->registros[1] = comp->cpu.registros[1];
+    c->flags = snapshot_flags(comp->cpu.flags);
+    c->vector = comp->cpu.vector;
+    c->pc_retorno = comp->cpu.pc_retorno;
+    c->flags_retorno = snapshot_flags(comp->cpu.flags_retorno);
+    c->dma_origen = comp->dma.origen;
+    c->dma_destino = comp->dma.destino;
+    c->dma_longitud = comp->dma.longitud;
+    c->dma_estado = comp->dma.estado;
+    c->dma_flancos = comp->dma.flancos;
+    if (comp->mmu != NULL) {
+        c->mmu_control = comp->mmu->control;
+        c->mmu_tabla = comp->mmu->tabla;
+        c->mmu_fallo = comp->mmu->direccion_fallo;
+        c->mmu_causa = comp->mmu->causa;
+        c->mmu_en_manejador = (uint32_t)comp->mmu->en_manejador;
+    }
+    c->ciclos = comp->ciclos;
+    c->instrucciones = comp->instrucciones;
+    c->bus_direcciones = LEER_BUS(&comp->bus_direcciones);
+    c->bus_datos = LEER_BUS(&comp->bus_datos);
+    c->bus_control = LEER_BUS(&comp->bus_control);
+    c->guard = atomic_load(&comp->guard);
+    c->reloj = LEER_BUS(&comp->reloj.val);
+    if (comp->shm) {
+        c->vth_head = atomic_load(&comp->shm->vth.cabeza);
+        c->vth_tail = atomic_load(&comp->shm->vth.cola);
+        c->htv_head = atomic_load(&comp->shm->htv.cabeza);
+        c->htv_tail = atomic_load(&comp->shm->htv.cola);
+        memcpy(c->vth_buf, comp->shm->vth.buf, ANILLO_TAM);
+        memcpy(c->htv_buf, comp->shm->htv.buf, ANILLO_TAM);
+    }
+
+    char temporal[PATH_MAX];
+    snprintf(temporal, sizeof(temporal), "%s.tmp", ruta);
+    FILE * f = fopen(temporal, "wb");
+    int ok = f != NULL;
+    if (ok) {
+        static const char ceros[4096] = {0};
+        ok = fwrite(c, sizeof(*c), 1, f) == 1;
+        for (uint64_t relleno = c->offset_memoria - sizeof(*c); ok && relleno > 0; ) {
+            size_t n = relleno < sizeof(ceros) ? relleno : sizeof(ceros);
+            ok = fwrite(ceros, 1, n, f) == n;
+            relleno -= n;
+        }
+        ok = ok && fwrite(comp->memoria, sizeof(int), MEMORIA_BAJA, f) == MEMORIA_BAJA;
+        struct snapshot_escritura e = { f, ok };
+        memoria_recorrer(comp->alta, snapshot_pagina, &e);
+        ok = (fclose(f) == 0) && e.ok;
+        ok = ok && rename(temporal, ruta) == 0;
+        if (!ok) unlink(temporal);
+    }
+    free(c);
+    return ok ? 0 : -1;
+}
+
+//Lee las páginas de encima de MEMORIA_BAJA, que se copian a páginas nuevas
+static int snapshot_paginas_altas(struct computador * comp, int fd, uint64_t offset, uint64_t paginas) {
+    for (uint64_t i = 0; i < paginas; i++) {
+        uint32_t direccion;
+        if (pread(fd, &direccion, sizeof(direccion), (off_t)offset) != (ssize_t)sizeof(direccion) ||
+            direccion < MEMORIA_BAJA || direccion % MEMORIA_PAGINA != 0) {
+            return -1;
+        }
+        size_t bytes = MEMORIA_PAGINA * sizeof(int);
+        if (pread(fd, memoria_celda(comp, (int)direccion), bytes, (off_t)(offset + sizeof(direccion))) != (ssize_t)bytes) return -1;
+        offset += sizeof(direccion) + bytes;
+    }
+    return 0;
+}
+
+//Devuelve 0 si se ha restaurado, 1 si el fichero no es una instantánea y -1 si falla.
+//Una instantánea con la paginación activa solo se restaura con --mmu; el TLB empieza vacío.
+int snapshot_restaurar(struct computador * comp, const char * ruta) {
+    int fd = open(ruta, O_RDONLY);
+    if (fd < 0) return -1;
+    struct snapshot_cabecera * c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        close(fd);
+        return -1;
+    }
+    int resultado = -1;
+    ssize_t leidos = read(fd, c, sizeof(*c));
+    long pagina = sysconf(_SC_PAGESIZE);
+    if (leidos < 8 || memcmp(c->magico, SNAPSHOT_MAGICO, 8) != 0) {
+        resultado = 1;
+    } else if (leidos == (ssize_t)sizeof(*c) && c->version == SNAPSHOT_VERSION && c->tam_cabecera == sizeof(*c) &&
+               c->palabras_memoria == MEMORIA_BAJA && pagina > 0 && c->offset_memoria % pagina == 0 &&
+               (comp->mmu != NULL || !(c->mmu_control & MMU_ACTIVA)) &&
+               snapshot_paginas_altas(comp, fd, c->offset_memoria + MEMORIA_BAJA * sizeof(int), c->paginas_altas) == 0) {
+        //Encima de la memoria anónima: la dirección no cambia
+        if (mmap(comp->memoria, MEMORIA_BAJA * sizeof(int), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, (off_t)c->offset_memoria) != MAP_FAILED) {
+            comp->cpu.pc = c->pc;
+            comp->cpu.registros[0] = c->registros[0];
+            comp->cpu.registros[1] = c->registros[1];
+            comp->cpu.flags = snapshot_estado(c->flags);
+            comp->cpu.vector = c->vector;
+            comp->cpu.pc_retorno = c->pc_retorno;
+            comp->cpu.flags_retorno = snapshot_estado(c->flags_retorno);
+            comp->dma.origen = c->dma_origen;
+            comp->dma.destino = c->dma_destino;
+            comp->dma.longitud = c->dma_longitud;
+            comp->dma.estado = c->dma_estado;
+            comp->dma.flancos = c->dma_flancos;
+            if (comp->mmu != NULL) {
+                comp->mmu->control = c->mmu_control;
+                comp->mmu->tabla = c->mmu_tabla;
+                comp->mmu->direccion_fallo = c->mmu_fallo;
+                comp->mmu->causa = c->mmu_causa;
+                comp->mmu->en_manejador = (int)c->mmu_en_manejador;
+            }
+            comp->ciclos = c->ciclos;
+            comp->instrucciones = c->instrucciones;
+            atomic_store(&comp->reloj.generacion, (unsigned int)c->ciclos);
+            ESCRIBIR_BUS(&comp->bus_direcciones, c->bus_direcciones);
+            ESCRIBIR_BUS(&comp->bus_datos, c->bus_datos);
+            ESCRIBIR_BUS(&comp->bus_control, c->bus_control);
+            atomic_store(&comp->guard, c->guard);
+            ESCRIBIR_BUS(&comp->reloj.val, c->reloj);
+            if (comp->shm && c->vth_head - c->vth_tail <= ANILLO_TAM && c->htv_head - c->htv_tail <= ANILLO_TAM) {
+                snapshot_anillo(&comp->shm->vth, c->vth_buf, c->vth_head, c->vth_tail);
+                snapshot_anillo(&comp->shm->htv, c->htv_buf, c->htv_head, c->htv_tail);
+                anillo_despertar(&comp->shm->vth);
+            }
+            resultado = 0;
+        }
+    }
+    free(c);
+    close(fd);
+    return resultado;
+}
+
+//Flancos que cuesta buscar una instrucción: inhibir el bus y una lectura de memoria
+#define CICLOS_BUSQUEDA 3
+//Flancos para obtener el operando según el modo de direccionamiento
+#define CICLOS_MODO_IMM 0
+#define CICLOS_MODO_DIR 2
+#define CICLOS_MODO_IND 4
+#define CICLOS_MODO_IDX 2
+#define CICLOS_ESCRITURA 2 // ST escribe en el bus
+#define CICLOS_FIN 2 // Los dos flancos finales de cada instrucción
+
+static const int ciclos_modo[4] = {CICLOS_MODO_IMM, CICLOS_MODO_DIR, CICLOS_MODO_IND, CICLOS_MODO_IDX};
+static const int lecturas_modo[4] = {0, 1, 2, 1}; // Lecturas del operando por modo
+
+//ST y XCHG escriben en memoria después de obtener el operando
+#define ESCRIBE_MEMORIA(opcode) ((opcode) == 0 || (opcode) == 25)
+
+//Flancos de una instrucción por su clave opcode * 4 + modo (HALT para antes de los finales)
+static inline unsigned int ciclos_clave(int clave) {
+    int opcode = clave / 4;
+    return CICLOS_BUSQUEDA + ciclos_modo[clave % 4] + (ESCRIBE_MEMORIA(opcode) ? CICLOS_ESCRITURA : 0) + (opcode == 19 ? 0 : CICLOS_FIN);
+}
+
+//Flancos de la instrucción en los que la CPU no usa el bus: todos menos la
+//búsqueda, las lecturas del operando y la escritura de ST o XCHG
+static inline unsigned int flancos_libres_clave(int clave) {
+    return ciclos_clave(clave) - 1 - lecturas_modo[clave % 4] - ESCRIBE_MEMORIA(clave / 4);
+}
+
+//Modelo de CPU segmentada (--segmentado). Como el de caché, solo modela el
+//tiempo: la máquina sigue ejecutando una instrucción detrás de otra con sus ciclos
+//de siempre, y al completar cada una el modelo calcula en qué ciclo pasaría por
+//cada etapa de un cauce IF, ID, OF, EX, WB que empieza una instrucción por ciclo.
+//Un ciclo del cauce es lo que dura una transacción de bus.
+//- Riesgos estructurales: solo hay un bus y lo usan la búsqueda (IF), cada lectura
+//  del operando (OF, dos en indirecto) y la escritura de ST o XCHG (WB). Si está ocupado
+//  la etapa espera; la instrucción más antigua tiene prioridad.
+//- Riesgos de datos en X, ACC y flags: con adelantamiento el resultado se puede
+//  usar al terminar EX, sin él (--segmentado-sin-adelanto) al terminar WB. El
+//  indexado necesita X al empezar OF, las operaciones su registro en EX y JZ/JN los
+//  flags en EX. Leer o buscar una dirección que un ST anterior aún no ha escrito
+//  espera a esa escritura.
+//- Saltos: se predicen no tomados y se resuelven en EX. Si la instrucción siguiente
+//  no es la de PC + 1 (salto tomado, RETI o interrupción) se descartan las que se
+//  habían buscado y la búsqueda vuelve a empezar al terminar EX.
+//Cada ciclo que una instrucción sale de WB más tarde que el siguiente al de la
+//anterior es una parada, y se atribuye a la causa que la retrasó en la etapa más
+//tardía. El tiempo parado en WAIT no se modela.
+enum seg_etapa { SEG_IF, SEG_ID, SEG_OF, SEG_EX, SEG_WB, SEG_ETAPAS };
+enum seg_causa { SEG_BUS, SEG_DATOS, SEG_MEMORIA, SEG_CONTROL, SEG_NUM_CAUSAS, SEG_NINGUNA = SEG_NUM_CAUSAS };
+static const char * const nombres_seg_causa[SEG_NUM_CAUSAS] = {"bus", "datos", "memoria", "control"};
+
+#define SEG_VENTANA_BUS 256 // Potencia de 2; ninguna reserva se adelanta tanto
+#define SEG_ESCRITURAS 64 // Potencia de 2
+#define SEG_FLAGS 2 // Índice de los flags en listo[], después de X y ACC
+
+//Opcodes que leen o escriben su registro y los que escriben los flags
+#define SEG_OPS(a, b) (((1u << ((b) + 1)) - 1) & ~((1u << (a)) - 1))
+#define SEG_LEEN_REGISTRO (1u << 0 | SEG_OPS(3, 11) | 1u << 15 | SEG_OPS(17, 18) | 1u << 25)
+#define SEG_ESCRIBEN_REGISTRO (SEG_OPS(1, 11) | 1u << 15 | SEG_OPS(17, 18) | 1u << 25)
+#define SEG_ESCRIBEN_FLAGS (SEG_ESCRIBEN_REGISTRO | 1u << 23)
+
+//Configuración de --segmentado, la misma para todas las máquinas del proceso
+static int usar_segmentado = 0;
+static int segmentado_adelanto = 1;
+
+struct seg_escritura {
+    long long direccion; // -1 libre
+    long long ciclo;
+};
+
+struct segmentado {
+    int adelanto;
+    long long etapa[SEG_ETAPAS]; // Ciclo en que la instrucción anterior entró en cada etapa
+    long long listo[3]; // Primer ciclo en que se pueden usar X, ACC y los flags
+    long long bus[SEG_VENTANA_BUS]; // Ciclo + 1 de cada reserva del bus
+    struct seg_escritura escrituras[SEG_ESCRITURAS]; // Últimos ST, por dirección
+    long long pc_siguiente; // -1 antes de la primera instrucción
+    unsigned long long instrucciones;
+    unsigned long long ciclos; // Hasta que la última instrucción sale de WB
+    unsigned long long flancos_secuenciales; // Lo que costaron sin cauce
+    unsigned long long paradas[SEG_NUM_CAUSAS];
+    unsigned long long vaciados;
+};
+
+static struct segmentado * segmentado_crear(int adelanto) {
+    struct segmentado * s = calloc(1, sizeof(*s));
+    if (s == NULL) return NULL;
+    s->adelanto = adelanto;
+    //Como si la instrucción anterior hubiera entrado en IF en el ciclo -1
+    for (int k = 0; k < SEG_ETAPAS; k++) {
+        s->etapa[k] = k - 1;
+    }
+    for (int i = 0; i < SEG_ESCRITURAS; i++) {
+        s->escrituras[i].direccion = -1;
+    }
+    s->pc_siguiente = -1;
+    return s;
+}
+
+//Retrasa *t hasta minimo si hace falta y apunta la causa
+static inline void seg_esperar(long long * t, long long minimo, enum seg_causa causa, enum seg_causa * motivo) {
+    if (minimo > *t) {
+        *t = minimo;
+        *motivo = causa;
+    }
+}
+
+//Transacción de bus de una etapa que está lista en el ciclo t: espera al ST en
+//vuelo a la misma dirección (direccion -1 si no importa) y al primer ciclo con el
+//bus libre, lo reserva y devuelve ese ciclo
+static long long seg_transaccion(struct segmentado * s, long long t, long long direccion, enum seg_causa * motivo) {
+    if (direccion >= 0) {
+        const struct seg_escritura * e = &s->escrituras[direccion & (SEG_ESCRITURAS - 1)];
+        if (e->direccion == direccion) seg_esperar(&t, e->ciclo + 1, SEG_MEMORIA, motivo);
+    }
+    long long libre = t;
+    while (s->bus[libre & (SEG_VENTANA_BUS - 1)] == libre + 1) {
+        libre++;
+    }
+    seg_esperar(&t, libre, SEG_BUS, motivo);
+    s->bus[t & (SEG_VENTANA_BUS - 1)] = t + 1;
+    return t;
+}
+
+static inline long long seg_max(long long a, long long b) {
+    return a > b ? a : b;
+}
+
+//Pasa por el cauce la instrucción completada en pc. de es su dirección efectiva.
+static void segmentado_instruccion(struct segmentado * s, int pc, int clave, int reg, int operando, int de) {
+    int opcode = clave / 4;
+    int modo = clave % 4;
+    unsigned int bit = 1u << opcode;
+    long long t[SEG_ETAPAS];
+    enum seg_causa motivo[SEG_ETAPAS];
+    for (int k = 0; k < SEG_ETAPAS; k++) {
+        motivo[k] = SEG_NINGUNA;
+    }
+    reg &= 1;
+
+    //Cada etapa empieza cuando la anterior de la instrucción termina y la
+    //instrucción de delante ha dejado libre la etapa
+    t[SEG_IF] = s->etapa[SEG_ID];
+    if (s->pc_siguiente >= 0 && (unsigned int)pc != s->pc_siguiente) {
+        s->vaciados++;
+        seg_esperar(&t[SEG_IF], s->etapa[SEG_EX] + 1, SEG_CONTROL, &motivo[SEG_IF]);
+    }
+    t[SEG_IF] = seg_transaccion(s, t[SEG_IF], (unsigned int)pc, &motivo[SEG_IF]);
+
+    t[SEG_ID] = seg_max(t[SEG_IF] + 1, s->etapa[SEG_OF]);
+
+    t[SEG_OF] = seg_max(t[SEG_ID] + 1, s->etapa[SEG_EX]);
+    if (modo == 3) seg_esperar(&t[SEG_OF], s->listo[0], SEG_DATOS, &motivo[SEG_OF]);
+    long long fin_of = t[SEG_OF];
+    if (modo == 2) fin_of = seg_transaccion(s, fin_of, operando & 0xFFFF, &motivo[SEG_OF]) + 1;
+    if (modo != 0) fin_of = seg_transaccion(s, fin_of, (unsigned int)de, &motivo[SEG_OF]);
+    fin_of++;
+
+    t[SEG_EX] = seg_max(fin_of, s->etapa[SEG_WB]);
+    if (bit & SEG_LEEN_REGISTRO) seg_esperar(&t[SEG_EX], s->listo[reg], SEG_DATOS, &motivo[SEG_EX]);
+    if (opcode == 13 || opcode == 14) seg_esperar(&t[SEG_EX], s->listo[SEG_FLAGS], SEG_DATOS, &motivo[SEG_EX]);
+
+    t[SEG_WB] = seg_max(t[SEG_EX] + 1, s->etapa[SEG_WB] + 1);
+    if (ESCRIBE_MEMORIA(opcode)) {
+        t[SEG_WB] = seg_transaccion(s, t[SEG_WB], -1, &motivo[SEG_WB]);
+        struct seg_escritura * e = &s->escrituras[de & (SEG_ESCRITURAS - 1)];
+        e->direccion = (unsigned int)de;
+        e->ciclo = t[SEG_WB];
+    }
+
+    long long disponible = s->adelanto ? t[SEG_EX] + 1 : t[SEG_WB] + 1;
+    if (bit & SEG_ESCRIBEN_REGISTRO) s->listo[reg] = disponible;
+    if (bit & SEG_ESCRIBEN_FLAGS) s->listo[SEG_FLAGS] = disponible;
+
+    long long parada = t[SEG_WB] - (s->etapa[SEG_WB] + 1);
+    if (parada > 0) {
+        //Sin otra causa, la retrasó una etapa de varios ciclos (lecturas del operando)
+        enum seg_causa causa = SEG_BUS;
+        for (int k = SEG_WB; k >= SEG_IF; k--) {
+            if (motivo[k] != SEG_NINGUNA) {
+                causa = motivo[k];
+                break;
+            }
+        }
+        s->paradas[causa] += (unsigned long long)parada;
+    }
+    memcpy(s->etapa, t, sizeof(t));
+    s->pc_siguiente = (unsigned int)(pc + 1);
+    s->instrucciones++;
+    s->ciclos = (unsigned long long)t[SEG_WB] + 1;
+    s->flancos_secuenciales += ciclos_clave(clave);
+}
+
+//Unidad de búsqueda con cola de precarga (--precarga). Como los modelos de caché
+//y de cauce solo modela el tiempo, y no cambia los ciclos de la máquina. Mientras
+//una instrucción deja el bus libre la unidad trae las palabras siguientes a una
+//cola, a razón de una por transacción (CICLOS_ACCESO_MEMORIA flancos), igual que
+//el DMA; si hay una transferencia de DMA en curso los flancos libres son suyos. Si
+//la instrucción siguiente está al principio de la cola, su búsqueda no necesita
+//el bus y se ahorra esa transacción; si no, la cola se vacía y la unidad sigue
+//desde ella. Un ST o XCHG a una dirección que está en la cola también la vacía.
+//Al precargar un salto el predictor decide por qué camino seguir:
+//- estatico: JMP siempre tomado; JZ/JN tomados si saltan hacia atrás.
+//- bimodal: un contador de 2 bits por entrada, indexado por PC.
+//- btb: tabla de destinos con un contador de 2 bits por entrada; sin entrada, no
+//  tomado. Es el único que conoce los destinos de los saltos indirectos e indexados.
+//Si el destino predicho no se conoce la unidad deja de precargar hasta el siguiente fallo.
+#define PRECARGA_MAX_COLA 16
+
+enum predictor { PREDICTOR_ESTATICO, PREDICTOR_BIMODAL, PREDICTOR_BTB };
+static const char * const nombres_predictor[] = {"estatico", "bimodal", "btb"};
+
+struct precarga_config {
+    int activa;
+    int cola; // Palabras
+    enum predictor predictor;
+    int entradas; // Del predictor bimodal o la BTB
+};
+
+//Configuración de --precarga, la misma para todas las máquinas del proceso
+static struct precarga_config precarga_config = {0, 4, PREDICTOR_BIMODAL, 64};
+
+struct btb_entrada {
+    int pc; // -1 libre
+    int destino;
+    unsigned char contador;
+};
+
+struct precarga {
+    struct precarga_config config;
+    int cola[PRECARGA_MAX_COLA]; // Direcciones precargadas, circular
+    int primera;
+    int num;
+    int siguiente; // Próxima dirección a precargar, -1 si no se sabe
+    unsigned char * contadores; // Bimodal
+    struct btb_entrada * btb;
+    unsigned long long aciertos; // Búsquedas servidas por la cola
+    unsigned long long fallos;
+    unsigned long long palabras; // Precargadas
+    unsigned long long saltos;
+    unsigned long long saltos_acertados;
+    unsigned long long flancos_ahorrados;
+};
+
+//Lee "cola=4,predictor=bimodal,entradas=64"; las claves que faltan conservan su
+//valor. Devuelve -1 si algo no es válido.
+static int precarga_parsear(const char * texto, struct precarga_config * c) {
+    char copia[256];
+    snprintf(copia, sizeof(copia), "%s", texto);
+    char * resto = copia;
+    char * par;
+    while ((par = strtok_r(resto, ",", &resto)) != NULL) {
+        char * valor = strchr(par, '=');
+        if (valor == NULL) return -1;
+        *valor++ = '\0';
+        if (strcmp(par, "predictor") == 0) {
+            if (strcmp(valor, "estatico") == 0) c->predictor = PREDICTOR_ESTATICO;
+            else if (strcmp(valor, "bimodal") == 0) c->predictor = PREDICTOR_BIMODAL;
+            else if (strcmp(valor, "btb") == 0) c->predictor = PREDICTOR_BTB;
+            else return -1;
+            continue;
+        }
+        char * fin;
+        long n = strtol(valor, &fin, 0);
+        if (*fin != '\0' || n <= 0 || n > 0x10000) return -1;
+        if (strcmp(par, "cola") == 0) c->cola = (int)n;
+        else if (strcmp(par, "entradas") == 0) c->entradas = (int)n;
+        else return -1;
+    }
+    if (c->cola > PRECARGA_MAX_COLA || (c->entradas & (c->entradas - 1)) != 0) return -1;
+    c->activa = 1;
+    return 0;
+}
+
+static struct precarga * precarga_crear(const struct precarga_config * config) {
+    struct precarga * p = calloc(1, sizeof(*p));
+    if (p == NULL) return NULL;
+    p->config = *config;
+    p->siguiente = -1;
+    if (config->predictor == PREDICTOR_BIMODAL) {
+        p->contadores = malloc((size_t)config->entradas);
+        if (p->contadores == NULL) {
+            free(p);
+            return NULL;
+        }
+        memset(p->contadores, 1, (size_t)config->entradas); // Débilmente no tomado
+    } else if (config->predictor == PREDICTOR_BTB) {
+        p->btb = calloc((size_t)config->entradas, sizeof(*p->btb));
+        if (p->btb == NULL) {
+            free(p);
+            return NULL;
+        }
+        for (int i = 0; i < config->entradas; i++) {
+            p->btb[i].pc = -1;
+        }
+    }
+    return p;
+}
+
+static void precarga_destruir(struct precarga * p) {
+    if (p == NULL) return;
+    free(p->contadores);
+    free(p->btb);
+    free(p);
+}
+
+//Dirección que sigue a la instrucción instr en pc según el predictor, o -1 si
+//se predice un salto cuyo destino no se conoce
+static int precarga_predecir(const struct precarga * p, int pc, int instr) {
+    int opcode = (instr >> 24) & 0xFF;
+    if (opcode < 12 || opcode > 14) return pc + 1;
+    int modo = (instr >> 16) & 0x0F;
+    //Directo salta al operando e inmediato a 0 (su dirección efectiva)
+    int destino = modo == 1 ? instr & 0xFFFF : modo == 0 ? 0 : -1;
+    int tomado = opcode == 12;
+    switch (p->config.predictor) {
+        case PREDICTOR_ESTATICO:
+            tomado = tomado || (destino >= 0 && destino <= pc);
+            break;
+        case PREDICTOR_BIMODAL:
+            tomado = tomado || p->contadores[pc & (p->config.entradas - 1)] >= 2;
+            break;
+        case PREDICTOR_BTB: {
+            const struct btb_entrada * e = &p->btb[pc & (p->config.entradas - 1)];
+            if (e->pc == pc) {
+                tomado = tomado || e->contador >= 2;
+                if (destino < 0) destino = e->destino;
+            }
+            break;
+        }
+    }
+    return tomado ? destino : pc + 1;
+}
+
+//El salto en pc ha terminado y la ejecución sigue en siguiente
+static void precarga_resolver(struct precarga * p, int pc, int instr, int siguiente) {
+    int tomado = siguiente != pc + 1;
+    p->saltos++;
+    if (precarga_predecir(p, pc, instr) == siguiente) p->saltos_acertados++;
+    if (p->config.predictor == PREDICTOR_BIMODAL) {
+        unsigned char * c = &p->contadores[pc & (p->config.entradas - 1)];
+        if (tomado && *c < 3) (*c)++;
+        if (!tomado && *c > 0) (*c)--;
+    } else if (p->config.predictor == PREDICTOR_BTB) {
+        struct btb_entrada * e = &p->btb[pc & (p->config.entradas - 1)];
+        if (e->pc != pc) {
+            if (!tomado) return;
+            e->pc = pc;
+            e->contador = 1;
+        }
+        if (tomado) {
+            e->destino = siguiente;
+            if (e->contador < 3) e->contador++;
+        } else if (e->contador > 0) {
+            e->contador--;
+        }
+    }
+}
+
+//Pasa por la unidad de búsqueda la instrucción completada en pc. de es su
+//dirección efectiva y siguiente el PC con el que sigue la ejecución.
+static void precarga_instruccion(struct computador * comp, struct precarga * p, int pc, int clave, int de, int siguiente) {
+    int opcode = clave / 4;
+    int instr = memoria_valor(comp, pc);
+    if (p->num > 0 && p->cola[p->primera] == pc) {
+        p->aciertos++;
+        p->flancos_ahorrados += CICLOS_ACCESO_MEMORIA;
+        p->primera = (p->primera + 1) % PRECARGA_MAX_COLA;
+        p->num--;
+    } else {
+        p->fallos++;
+        p->num = 0;
+        p->siguiente = precarga_predecir(p, pc, instr);
+    }
+    if (opcode >= 12 && opcode <= 14) precarga_resolver(p, pc, instr, siguiente);
+    if (ESCRIBE_MEMORIA(opcode)) {
+        for (int i = 0; i < p->num; i++) {
+            if (p->cola[(p->primera + i) % PRECARGA_MAX_COLA] == de) {
+                p->num = 0;
+                p->siguiente = -1;
+                break;
+            }
+        }
+    }
+    if (comp->dma.estado & DMA_OCUPADO) return;
+    //La E/S no se precarga: leerla tiene efectos
+    for (unsigned int libres = flancos_libres_clave(clave); libres >= CICLOS_ACCESO_MEMORIA &&
+         p->num < p->config.cola && p->siguiente >= 0 && (p->siguiente < GPU_DATA_ADDR || p->siguiente > INHIBIR_BUS);
+         libres -= CICLOS_ACCESO_MEMORIA) {
+        int direccion = p->siguiente;
+        p->cola[(p->primera + p->num) % PRECARGA_MAX_COLA] = direccion;
+        p->num++;
+        p->palabras++;
+        p->siguiente = precarga_predecir(p, direccion, memoria_valor(comp, direccion));
+    }
+}
+
+//Los modelos de tiempo que ven pasar cada instrucción completada
+#define MODELAR_INSTRUCCION(comp, pc_instr, clave, reg, operando, de) \
+    do { \
+        if ((comp)->segmentado != NULL) segmentado_instruccion((comp)->segmentado, (pc_instr), (clave), (reg), (operando), (de)); \
+        if ((comp)->precarga != NULL) precarga_instruccion((comp), (comp)->precarga, (pc_instr), (clave), (de), (comp)->procesador->pc); \
+    } while (0)
+
+//Perfil exacto por PC (--perfil): ejecuciones y flancos de cada dirección
+struct perfil {
+    unsigned long long ejecuciones[0x10000];
+    unsigned long long ciclos[0x10000];
+};
+
+//Cuenta una instrucción completada para las estadísticas y, si está activo, el
+//perfil, y le da al DMA los flancos en los que la instrucción dejó el bus libre
+static inline void contar_instruccion(struct computador * comp, int pc, int clave) {
+    comp->ejecuciones[clave]++;
+    if (comp->dma.estado & DMA_OCUPADO) {
+        dma_avanzar(comp, flancos_libres_clave(clave));
+    }
+    if (comp->perfil != NULL && (unsigned int)pc < MEMORIA_BAJA) {
+        comp->perfil->ejecuciones[pc]++;
+        comp->perfil->ciclos[pc] += ciclos_clave(clave);
+        if (comp->cache != NULL) comp->perfil->ciclos[pc] += comp->cache->ciclos_instruccion;
+        if (comp->mmu != NULL) comp->perfil->ciclos[pc] += comp->mmu->ciclos_instruccion;
+    }
+    if (comp->cache != NULL) comp->cache->ciclos_instruccion = 0;
+    if (comp->mmu != NULL) comp->mmu->ciclos_instruccion = 0;
+}
+
+//Avanza la generación del reloj virtual, la que ven las trazas (solo modo turbo)
+static inline void reloj_avanzar(struct computador * comp, unsigned long long flancos) {
+    atomic_store_explicit(&comp->reloj.generacion, atomic_load_explicit(&comp->reloj.generacion, memory_order_relaxed) + flancos, memory_order_relaxed);
+}
+
+//Avanza el reloj virtual sin que haya transacciones en el bus (solo modo turbo)
+static inline void cpu_avanzar(struct computador * comp, unsigned long long flancos) {
+    comp->ciclos += flancos;
+    reloj_avanzar(comp, flancos);
+}
+
+//La CPU espera al siguiente flanco. En modo turbo no hay hilo de reloj: el flanco
+//es virtual y la CPU hace avanzar a los dispositivos ella misma, en el mismo orden
+//en el que lo harían sus hilos al despertar.
+static inline void cpu_sync(struct computador * comp) {
+    comp->ciclos++;
+    if (modo_turbo) {
+        atomic_store_explicit(&comp->reloj.generacion, atomic_load_explicit(&comp->reloj.generacion, memory_order_relaxed) + 1, memory_order_relaxed);
+        bus_ciclo(comp);
+    } else {
+        CLOCK_SYNC(comp);
+    }
+}
+
+//Flancos que la CPU espera sin transacción en el bus (con reloj, con el bus inhibido)
+static void cpu_esperar_flancos(struct computador * comp, unsigned int flancos) {
+    if (modo_turbo) {
+        cpu_avanzar(comp, flancos);
+    } else {
+        ESCRIBIR_BUS(comp->io->direcciones, INHIBIR_BUS);
+        for (unsigned int i = 0; i < flancos; i++) {
+            cpu_sync(comp);
+        }
+    }
+}
+
+//Acceso de la CPU a memoria con --cache: después de la transacción de bus, la CPU
+//espera los flancos que la caché añade
+static void cache_acceso(struct computador * comp, int direccion, enum cache_tipo tipo) {
+    if ((unsigned int)direccion >= GPU_DATA_ADDR && (unsigned int)direccion <= INHIBIR_BUS) return;
+    struct cache * c = comp->cache;
+    unsigned int extra = cache_latencia(c, direccion, tipo) - CICLOS_ACCESO_MEMORIA;
+    c->ciclos += extra;
+    c->ciclos_instruccion += extra;
+    cpu_esperar_flancos(comp, extra);
+}
+
+#define CACHE_ACCESO(comp, direccion, tipo) \
+    do { \
+        if ((comp)->cache != NULL) cache_acceso((comp), (direccion), (tipo)); \
+    } while (0)
+
+#define CICLOS_INTERRUPCION 2 // Guardar PC y flags y saltar al vector
+
+//Entrada al manejador: la CPU guarda PC y flags, deshabilita las interrupciones
+//y salta al vector. Se hace entre dos instrucciones, nunca en medio de una.
+static void entrar_interrupcion(struct computador * comp) {
+    struct cpu * cpu = comp->procesador;
+    TRAZA(TRAZA_NIVEL_INSTR, TRAZA_CPU, EV_CPU_INTERRUPCION, cpu->pc, cpu->vector, 0, 0);
+    cpu->pc_retorno = cpu->pc;
+    cpu->flags_retorno = cpu->flags;
+    cpu->flags.ie = 0;
+    cpu->pc = cpu->vector;
+    comp->interrupciones++;
+    if (comp->mmu != NULL) comp->mmu->en_manejador = 1;
+    if (comp->dma.estado & DMA_OCUPADO) {
+        dma_avanzar(comp, CICLOS_INTERRUPCION);
+    }
+    if (modo_turbo) {
+        cpu_avanzar(comp, CICLOS_INTERRUPCION);
+    } else {
+        ESCRIBIR_BUS(comp->io->direcciones, INHIBIR_BUS);
+        cpu_sync(comp);
+        cpu_sync(comp);
+    }
+}
+
+//Flancos del recorrido de la tabla de páginas
+static void mmu_esperar(struct computador * comp, unsigned int flancos) {
+    comp->mmu->ciclos += flancos;
+    comp->mmu->ciclos_instruccion += flancos;
+    cpu_esperar_flancos(comp, flancos);
+}
+
+//La MMU marca la entrada de la tabla como accedida o sucia. Con varios núcleos
+//la tabla puede ser de todos, así que no se pisan los bits que ponga otro.
+static void mmu_marcar(struct computador * comp, int entrada, int bits) {
+    __atomic_fetch_or(memoria_celda(comp, entrada), bits, __ATOMIC_RELAXED);
+    if ((unsigned int)entrada < MEMORIA_BAJA) cache_instr_invalidar(comp, entrada);
+}
+
+//Fallo de página: como en x86 se quita la página del TLB, y la CPU vuelve al PC
+//de la instrucción y entra en el manejador. Un fallo dentro del manejador
+//perdería el PC de retorno (solo hay un nivel), así que detiene la máquina.
+//En el perfil, los flancos de la instrucción abandonada y los de la entrada al
+//manejador son de esa instrucción, aunque no cuente como ejecutada.
+static _Noreturn void mmu_fallo(struct computador * comp, unsigned int direccion, int causa) {
+    struct mmu * m = comp->mmu;
+    if (m->en_manejador) {
+        char mensaje[96];
+        snprintf(mensaje, sizeof(mensaje), "Fallo de página en 0x%X dentro del manejador de interrupción", direccion);
+        detener(comp, PARADA_ERROR, mensaje);
+    }
+    struct tlb_entrada * e = tlb_buscar(m, direccion >> MEMORIA_PAGINA_BITS);
+    if (e != NULL) e->valida = 0;
+    m->fallos_pagina++;
+    m->direccion_fallo = (int)direccion;
+    m->causa = causa | MMU_CAUSA_PENDIENTE;
+    comp->procesador->pc = m->pc_instruccion;
+    entrar_interrupcion(comp);
+    if (comp->perfil != NULL && (unsigned int)m->pc_instruccion < MEMORIA_BAJA) {
+        comp->perfil->ciclos[m->pc_instruccion] += comp->ciclos - m->ciclos_inicio;
+    }
+    m->ciclos_instruccion = 0;
+    if (comp->cache != NULL) comp->cache->ciclos_instruccion = 0;
+    longjmp(m->fallo, 1);
+}
+
+//Dirección física de un acceso de la CPU con --mmu. Sin paginación activa es la
+//misma; si la página no está o no se puede escribir, no vuelve.
+static int mmu_traducir(struct computador * comp, int direccion, enum cache_tipo tipo) {
+    struct mmu * m = comp->mmu;
+    unsigned int virtual = (unsigned int)direccion;
+    if (!(m->control & MMU_ACTIVA) || (virtual >= GPU_DATA_ADDR && virtual <= INHIBIR_BUS)) return direccion;
+    unsigned int pagina = virtual >> MEMORIA_PAGINA_BITS;
+    int datos = tipo != CACHE_INSTRUCCION;
+    int escritura = tipo == CACHE_ESCRITURA;
+    int causa = (escritura ? MMU_CAUSA_ESCRITURA : 0) | (datos ? 0 : MMU_CAUSA_INSTRUCCION);
+    unsigned int flancos = 0;
+    struct tlb_entrada * e = tlb_buscar(m, pagina);
+    if (e != NULL) {
+        m->aciertos[datos]++;
+        if (m->config.reemplazo == MMU_LRU) e->uso = ++m->marca;
+    } else {
+        //Recorrido: la entrada del directorio y, si está, la de la tabla
+        m->fallos_tlb[datos]++;
+        int directorio = memoria_valor(comp, (int)((unsigned int)m->tabla + (virtual >> (32 - MMU_DIRECTORIO_BITS))));
+        int entrada = 0, valor = 0;
+        flancos = CICLOS_ACCESO_MEMORIA;
+        if (directorio & MMU_PRESENTE) {
+            entrada = (int)(((unsigned int)directorio & ~(MEMORIA_PAGINA - 1)) + (pagina & (MEMORIA_PAGINA - 1)));
+            valor = memoria_valor(comp, entrada);
+            flancos += CICLOS_ACCESO_MEMORIA;
+        }
+        int escribible = (directorio & valor & MMU_ESCRIBIBLE) != 0;
+        if (!(valor & MMU_PRESENTE) || (escritura && !escribible)) {
+            mmu_esperar(comp, flancos);
+            mmu_fallo(comp, virtual, causa | ((valor & MMU_PRESENTE) ? MMU_CAUSA_PROTECCION : 0));
+        }
+        int bits = MMU_ACCEDIDA | (escritura ? MMU_SUCIA : 0);
+        if ((valor & bits) != bits) {
+            mmu_marcar(comp, entrada, bits);
+            flancos += CICLOS_ACCESO_MEMORIA;
+        }
+        e = tlb_victima(m, pagina);
+        e->pagina = pagina;
+        e->marco = (int)((unsigned int)valor & ~(MEMORIA_PAGINA - 1));
+        e->entrada = entrada;
+        e->valida = 1;
+        e->escribible = escribible;
+        e->sucia = escritura || (valor & MMU_SUCIA);
+        e->uso = ++m->marca;
+    }
+    if (escritura && !e->escribible) {
+        mmu_fallo(comp, virtual, causa | MMU_CAUSA_PROTECCION);
+    }
+    if (escritura && !e->sucia) {
+        //Primera escritura en la página desde que está en el TLB
+        mmu_marcar(comp, e->entrada, MMU_SUCIA);
+        flancos += CICLOS_ACCESO_MEMORIA;
+        e->sucia = 1;
+    }
+    if (flancos > 0) mmu_esperar(comp, flancos);
+    return (int)((unsigned int)e->marco | (virtual & (MEMORIA_PAGINA - 1)));
+}
+
+//Dirección física de un acceso de la CPU: sin --mmu, la virtual
+#define TRADUCIR(comp, direccion, tipo) ((comp)->mmu != NULL ? mmu_traducir((comp), (direccion), (tipo)) : (direccion))
+
+//WAIT: la CPU se para hasta que se active la línea de interrupción, aunque estén
+//deshabilitadas (entonces sigue con la instrucción siguiente). Con reloj pasan
+//flancos sin transacciones; en modo turbo no hay tiempo que simular y el hilo
+//duerme en el timbre de la cola del teclado hasta que terminal escriba algo. Sin terminal toda la entrada está ya
+//cargada, así que si no queda nada la CPU no se despertaría nunca.
+//La línea solo llega al núcleo 0: en los demás WAIT no terminaría nunca.
+static void cpu_esperar_interrupcion(struct computador * comp, int pc) {
+    if (comp->nucleo != 0) {
+        detener(comp, PARADA_ERROR, "WAIT en un núcleo secundario: solo el núcleo 0 recibe interrupciones");
+    }
+    if (teclado_irq(comp)) return;
+    if (modo_turbo) {
+        //Mientras la CPU duerme el bus es todo del DMA
+        dma_completar(comp);
+        if (comp->shm == NULL) {
+            detener(comp, PARADA_ESPERA, "WAIT sin entrada de teclado pendiente");
+        }
+        while (!teclado_irq(comp)) {
+            anillo_esperar(&comp->shm->htv, comp->shm->htv.cabeza_vista, NULL);
+        }
+        return;
+    }
+    unsigned long long inicio = comp->ciclos;
+    ESCRIBIR_BUS(comp->io->direcciones, INHIBIR_BUS);
+    while (!teclado_irq(comp)) {
+        cpu_sync(comp);
+    }
+    comp->ciclos_espera += comp->ciclos - inicio;
+    if (comp->dma.estado & DMA_OCUPADO) {
+        dma_avanzar(comp, (unsigned int)(comp->ciclos - inicio));
+    }
+    if (comp->perfil != NULL && (unsigned int)pc < MEMORIA_BAJA) comp->perfil->ciclos[pc] += comp->ciclos - inicio;
+    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_CPU_ESPERA, (uint32_t)(comp->ciclos - inicio), 0, 0, 0);
+}
+
+static void estadisticas_publicar(struct computador * comp);
+
+//Flancos, como mucho, entre dos consultas de la señal de instantánea
+#define EVENTOS_PERIODO 65536
+//Lo menos que cuesta una instrucción completada que no sea HALT
+#define CICLOS_INSTRUCCION_MIN (CICLOS_BUSQUEDA + CICLOS_FIN)
+
+//Calcula el siguiente evento_ciclos. Los plazos en instrucciones se pasan a flancos
+//con el coste mínimo, así que se atienden a tiempo o, como mucho, antes de tiempo.
+//Con reloj o con terminal y las interrupciones activas se mira en cada instrucción.
+static void eventos_programar(struct computador * comp) {
+    if (!modo_turbo || (comp->cpu.flags.ie && comp->shm != NULL)) {
+        comp->evento_ciclos = comp->ciclos;
+        return;
+    }
+    unsigned long long plazo = comp->limite_ciclos - comp->ciclos < EVENTOS_PERIODO ? comp->limite_ciclos : comp->ciclos + EVENTOS_PERIODO;
+    unsigned long long limite = comp->limite_instrucciones < comp->proxima_publicacion ? comp->limite_instrucciones : comp->proxima_publicacion;
+    if (limite <= comp->instrucciones) {
+        plazo = comp->ciclos;
+    } else if (limite - comp->instrucciones < (plazo - comp->ciclos) / CICLOS_INSTRUCCION_MIN) {
+        plazo = comp->ciclos + (limite - comp->instrucciones) * CICLOS_INSTRUCCION_MIN;
+    }
+    comp->evento_ciclos = plazo;
+}
+
+static void atender_eventos(struct computador * comp) {
+    if (comp->instrucciones >= comp->proxima_publicacion) {
+        estadisticas_publicar(comp);
+    }
+    if (comp->snapshot_pendiente || snapshot_senal) {
+        comp->snapshot_pendiente = 0;
+        snapshot_senal = 0;
+        if (comp->ruta_snapshot != NULL) {
+            if (snapshot_guardar(comp, comp->ruta_snapshot) == 0) {
+                fprintf(stderr, "[SNAPSHOT] Instantánea guardada en %s (PC 0x%04X, %llu instrucciones)\n", comp->ruta_snapshot, comp->cpu.pc, comp->instrucciones);
+            } else {
+                fprintf(stderr, "[SNAPSHOT] No se pudo guardar %s\n", comp->ruta_snapshot);
+            }
+        }
+    }
+    if (comp->instrucciones >= comp->limite_instrucciones) {
+        detener(comp, PARADA_LIMITE_INSTRUCCIONES, "límite de instrucciones alcanzado");
+    }
+    if (comp->ciclos >= comp->limite_ciclos) {
+        detener(comp, PARADA_LIMITE_CICLOS, "límite de ciclos alcanzado");
+    }
+    if (comp->nucleos != NULL && atomic_load_explicit(&comp->nucleos->parar, memory_order_acquire)) {
+        struct nucleos * n = comp->nucleos;
+        if (comp->nucleo == 0 && n->motivo != PARADA_NINGUNA) detener(comp, n->motivo, n->mensaje);
+        detener(comp, PARADA_NINGUNA, "máquina detenida");
+    }
+    if (comp->cpu.flags.ie && teclado_irq(comp)) {
+        entrar_interrupcion(comp);
+    }
+    eventos_programar(comp);
+}
+
+//Se comprueba al empezar cada instrucción: límites, estadísticas, instantáneas
+//pendientes, parada de los demás núcleos e interrupciones
+static inline void comprobar_eventos(struct computador * comp) {
+    if (comp->ciclos >= comp->evento_ciclos || atomic_load_explicit(&comp->avisos, memory_order_relaxed)) {
+        atender_eventos(comp);
+    }
+}
+
+const char *operaciones[] = {
+    "ST", // Cargar de memoria a registro
+    "LD", // Almacenar de registro a memoria
+    "LDI", // Cargar inmediato a registro
+    "ADD", // Sumar
+    "SUB", // Restar
+    "MUL", // Multiplicar
+    "DIV", // Dividir
+    "MOD",  // Módulo
+    "AND", // AND bit a bit
+    "OR",  // OR bit a bit
+    "XOR", // XOR bit a bit
+    "NOT", // NOT bit a bit
+    "JMP", // Salto incondicional
+    "JZ",  // Salto si cero
+    "JN",  // Salto si negativo
+    "CLR", // Limpiar registro
+    "NOP", // No operación
+    "DEC", // Decrementar
+    "INC", // Incrementar
+    "HALT", // Detener ejecución
+    "IVEC", // Fijar el vector de interrupción
+    "EI", // Habilitar interrupciones
+    "DI", // Deshabilitar interrupciones
+    "RETI", // Volver del manejador de interrupción
+    "WAIT", // Esperar una interrupción
+    "XCHG" // Intercambiar registro y memoria de forma atómica
+};
+
+const char *registros[] = {
+    "X",
+    "ACC"
+};
+
+const char *modos_direccionamiento[] = {
+    "Inmediato",
+    "Directo",
+    "Indirecto",
+    "Indexado"
+};
+
+#define ALU_MODE_ARITHMETHIC 0
+#define ALU_OP_ADD 0
+#define ALU_OP_SUB 1
+#define ALU_OP_MUL 2
+#define ALU_OP_DIV 3
+#define ALU_OP_MOD 4
+#define ALU_MODE_LOGIC 1
+#define ALU_OP_AND 0
+#define ALU_OP_OR 1
+#define ALU_OP_XOR 2
+#define ALU_OP_NOT 3
+int alu_operation(struct cpu * cpu_inst, int mode, int opcode, int operand_1, int operand_2) {
+    //Check if the number is signed 16-bit
+    if (operand_1 > 32767 || operand_1 < -32768 || operand_2 > 32767 || operand_2 < -32768) {
+        char mensaje[96];
+        snprintf(mensaje, sizeof(mensaje), "Operando fuera de rango de 16 bits con signo (operadores: %d, %d)", operand_1, operand_2);
+        error(mensaje);
+    }
+    int has_signed = (operand_1 < 0 || operand_2 < 0);
+    if (has_signed) TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_ALU, EV_ALU_SIGNO, 0, 0, 0, 0);
+    //Make the operation and update the cpu flags accordingly
+    if (mode == ALU_MODE_ARITHMETHIC) {
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_ALU, EV_ALU_ARITMETICA, 0, 0, 0, 0);
+        switch (opcode) {
+            case ALU_OP_ADD:
+                {
+                    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_ALU, EV_ALU_ADD, operand_1, operand_2, 0, 0);
+                    int result = operand_1 + operand_2;
+                    cpu_inst->flags.c = (result > 32767 || result < -32768);
+                    cpu_inst->flags.v = ((operand_1 > 0 && operand_2 > 0 && result < 0) || (operand_1 < 0 && operand_2 < 0 && result > 0));
+                    cpu_inst->flags.z = (result == 0);
+                    cpu_inst->flags.n = (result < 0);
+                    return result & 0xFFFF; //Return as 16-bit value
+                }
+            case ALU_OP_SUB:
+                {
+                    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_ALU, EV_ALU_SUB, operand_1, operand_2, 0, 0);
+                    int result = operand_1 - operand_2;
+                    cpu_inst->flags.c = (result > 32767 || result < -32768);
+                    cpu_inst->flags.v = ((operand_1 > 0 && operand_2 < 0 && result < 0) || (operand_1 < 0 && operand_2 > 0 && result > 0));
+                    cpu_inst->flags.z = (result == 0);
+                    cpu_inst->flags.n = (result < 0);
+                    return result & 0xFFFF; //Return as 16-bit value
+                }
+            case ALU_OP_MUL:
+                {
+                    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_ALU, EV_ALU_MUL, operand_1, operand_2, 0, 0);
+                    int result = operand_1 * operand_2;
+                    cpu_inst->flags.c = (result > 32767 || result < -32768);
+                    cpu_inst->flags.v = cpu_inst->flags.c; //Overflow if carry
+                    cpu_inst->flags.z = (result == 0);
+                    cpu_inst->flags.n = (result < 0);
+                    return result & 0xFFFF; //Return as 16-bit value
+                }
+            case ALU_OP_DIV:
+                {
+                    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_ALU, EV_ALU_DIV, operand_1, operand_2, 0, 0);
+                    if (operand_2 == 0) {
+                        error("División por cero");
+                    }
+                    int result = operand_1 / operand_2;
+                    cpu_inst->flags.c = 0; //No carry in division
+                    cpu_inst->flags.v = 0; //No overflow in division
+                    cpu_inst->flags.z = (result == 0);
+                    cpu_inst->flags.n = (result < 0);
+                    return result & 0xFFFF; //Return as 16-bit value
+                }
+        }
+    } else if (mode == ALU_MODE_LOGIC) {
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_ALU, EV_ALU_LOGICA, 0, 0, 0, 0);
+        switch (opcode) {
+            case ALU_OP_AND:
+                {
+                    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_ALU, EV_ALU_AND, operand_1, operand_2, 0, 0);
+                    int result = operand_1 & operand_2;
+                    cpu_inst->flags.z = (result == 0);
+                    cpu_inst->flags.n = (result < 0);
+                    return result & 0xFFFF; //Return as 16-bit value
+                }
+            case ALU_OP_OR:
+                {
+                    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_ALU, EV_ALU_OR, operand_1, operand_2, 0, 0);
+                    int result = operand_1 | operand_2;
+                    cpu_inst->flags.z = (result == 0);
+                    cpu_inst->flags.n = (result < 0);
+                    return result & 0xFFFF; //Return as 16-bit value
+                }
+            case ALU_OP_XOR:
+                {
+                    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_ALU, EV_ALU_XOR, operand_1, operand_2, 0, 0);
+                    int result = operand_1 ^ operand_2;
+                    cpu_inst->flags.z = (result == 0);
+                    cpu_inst->flags.n = (result < 0);
+                    return result & 0xFFFF; //Return as 16-bit value
+                }
+            case ALU_OP_NOT:
+                {
+                    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_ALU, EV_ALU_NOT, operand_1, 0, 0, 0);
+                    int result = ~operand_1;
+                    cpu_inst->flags.z = (result == 0);
+                    cpu_inst->flags.n = (result < 0);
+                    return result & 0xFFFF; //Return as 16-bit value
+                }
+        }
+    } else {
+        error("Modo de ALU inválido");
+    }
+
+    return 0;
+
+}
+
+void unidad_de_control(struct computador * comp) {
+    comprobar_eventos(comp);
+    //Print CPU state
+    TRAZA(TRAZA_NIVEL_INSTR, TRAZA_CPU, EV_CPU_ESTADO, comp->procesador->pc, comp->procesador->registros[0], comp->procesador->registros[1],
+        (comp->procesador->flags.z & 1) | (comp->procesador->flags.n & 1) << 1 | (comp->procesador->flags.c & 1) << 2 | (comp->procesador->flags.v & 1) << 3 | (comp->procesador->flags.ie & 1) << 4);
+    ESCRIBIR_BUS(comp->io->direcciones, INHIBIR_BUS); //Inhibir bus at the start of the cycle
+    int direccion_instr = comp->procesador->pc;
+    if (comp->mmu != NULL) {
+        comp->mmu->pc_instruccion = direccion_instr;
+        comp->mmu->ciclos_inicio = comp->ciclos;
+    }
+    //Con --mmu las direcciones de la CPU son virtuales: al bus, a la caché de
+    //instrucciones y al modelo de caché van las físicas
+    int fisica = TRADUCIR(comp, direccion_instr, CACHE_INSTRUCCION);
+    int instr, opcode, reg, addr_mode, operando;
+    if (modo_turbo && (unsigned int)fisica < MEMORIA_BAJA && cache_instr_valida(comp, fisica)) {
+        //Acierto: ni bus ni decodificación, solo se cuentan los ciclos de la búsqueda
+        const struct instr_decodificada * d = &comp->cache_instr[fisica];
+        comp->cache_instr_aciertos++;
+        cpu_avanzar(comp, CICLOS_BUSQUEDA);
+        comp->procesador->pc += 1;
+        instr = d->instr;
+        opcode = d->opcode;
+        reg = d->reg;
+        addr_mode = d->addr_mode;
+        operando = d->operando;
+    } else {
+        cpu_sync(comp);
+        ESCRIBIR_BUS(comp->io->control, IO_OP_READ);
+        ESCRIBIR_BUS(comp->io->direcciones, fisica);
+        comp->procesador->pc += 1;
+        cpu_sync(comp);
+        cpu_sync(comp);
+        instr = LEER_BUS(comp->io->datos);
+        //La búsqueda debe llegar de la memoria: guard es lo último que ha leído
+        if (instr != atomic_load_explicit(&comp->guard, memory_order_acquire)) {
+            char mensaje[96];
+            snprintf(mensaje, sizeof(mensaje), "Instrucción leída 0x%08X distinta de la que dio la memoria 0x%08X",
+                (unsigned int)instr, (unsigned int)atomic_load(&comp->guard));
+            detener(comp, PARADA_ERROR, mensaje);
+        }
+
+        //Decodificación de la instrucción
+        //Formato de instrucción (32 bits):
+        // opcode (8 bits) | registro (4 bits) | direccionamiento (4 bits) | operando (16 bits)
+        opcode = (instr >> 24) & 0xFF;
+        reg = (instr >> 20) & 0x0F;
+        addr_mode = (instr >> 16) & 0x0F;
+        operando = instr & 0xFFFF;
+        if (modo_turbo && (unsigned int)fisica < MEMORIA_BAJA) {
+            comp->cache_instr_fallos++;
+            cache_instr_guardar(comp, fisica, instr);
+        }
+    }
+    CACHE_ACCESO(comp, fisica, CACHE_INSTRUCCION);
+    if (comp->procesador->pc - 1 == 0x0 && instr == 0x0) {
+        detener(comp, PARADA_INSTR_NULA, "Instrucción nula en dirección 0x0000");
+    }
+    TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_IF, instr, 0, 0, 0);
 
     //Aplicamos direccionamiento para obtener la dirección efectiva o valor efectivo
     int direccion_efectiva = 0;
@@ -417,221 +2794,2246 @@ void unidad_de_control(struct computador * comp) {
         case 0: // Inmediato
             valor_efectivo = operando;
             break;
-        case 1: // Directo
-            direccion_efectiva = operando;
-            ESCRIBIR_BUS(comp->io->direcciones, direccion_efectiva);
-            ESCRIBIR_BUS(comp->io->control, IO_OP_READ);
-            CLOCK_SYNC();
-            CLOCK_SYNC();
-            valor_efectivo = LEER_BUS(comp->io->datos);
+        case 1: // Directo
+            direccion_efectiva = operando;
+            fisica = TRADUCIR(comp, direccion_efectiva, CACHE_LECTURA);
+            ESCRIBIR_BUS(comp->io->direcciones, fisica);
+            ESCRIBIR_BUS(comp->io->control, IO_OP_READ);
+            cpu_sync(comp);
+            cpu_sync(comp);
+            valor_efectivo = LEER_BUS(comp->io->datos);
+            CACHE_ACCESO(comp, fisica, CACHE_LECTURA);
+            break;
+        case 2: // Indirecto
+            //Con --mmu, si el puntero es de la E/S su lectura no se deshace aunque
+            //después falle la página del destino (ver la MMU)
+            fisica = TRADUCIR(comp, operando, CACHE_LECTURA);
+            ESCRIBIR_BUS(comp->io->direcciones, fisica);
+            ESCRIBIR_BUS(comp->io->control, IO_OP_READ);
+            cpu_sync(comp);
+            cpu_sync(comp);
+            direccion_efectiva = LEER_BUS(comp->io->datos);
+            CACHE_ACCESO(comp, fisica, CACHE_LECTURA);
+            fisica = TRADUCIR(comp, direccion_efectiva, CACHE_LECTURA);
+            ESCRIBIR_BUS(comp->io->direcciones, fisica);
+            ESCRIBIR_BUS(comp->io->control, IO_OP_READ);
+            cpu_sync(comp);
+            cpu_sync(comp);
+            valor_efectivo = LEER_BUS(comp->io->datos);
+            CACHE_ACCESO(comp, fisica, CACHE_LECTURA);
+            break;
+        case 3: // Indexado (usamos siempre el registro X para este ejemplo)
+            direccion_efectiva = operando + comp->procesador->registros[0];
+            fisica = TRADUCIR(comp, direccion_efectiva, CACHE_LECTURA);
+            ESCRIBIR_BUS(comp->io->direcciones, fisica);
+            ESCRIBIR_BUS(comp->io->control, IO_OP_READ);
+            cpu_sync(comp);
+            cpu_sync(comp);
+            valor_efectivo = LEER_BUS(comp->io->datos);
+            CACHE_ACCESO(comp, fisica, CACHE_LECTURA);
+            break;
+        default:
+            error("Modo de direccionamiento inválido");
+            break;
+    }
+    TRAZA(TRAZA_NIVEL_INSTR, TRAZA_CPU, EV_ID, instr, direccion_efectiva, valor_efectivo, 0);
+    
+    //Ejecutamos la instrucción
+    //Importante tener en cuenta cómo se alteran las flags del procesador
+    switch (opcode) {
+        case 0: // ST
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 0, 0, 0, 0);
+            fisica = TRADUCIR(comp, direccion_efectiva, CACHE_ESCRITURA);
+            //Cuidado con el orden en las escrituras: ¿Que pasa si reordeno?
+            ESCRIBIR_BUS(comp->io->control, IO_OP_WRITE);
+            ESCRIBIR_BUS(comp->io->datos, comp->procesador->registros[reg]);
+            ESCRIBIR_BUS(comp->io->direcciones, fisica);
+            cpu_sync(comp);
+            cpu_sync(comp);
+            CACHE_ACCESO(comp, fisica, CACHE_ESCRITURA);
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX_ST, reg, direccion_efectiva, comp->procesador->registros[reg], 0);
+            break;
+        case 1: // LD
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 1, 0, 0, 0);
+            comp->procesador->registros[reg] = valor_efectivo;
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX_LD, reg, comp->procesador->registros[reg], 0, 0);
+            comp->procesador->flags.z = (comp->procesador->registros[reg] == 0);
+            comp->procesador->flags.n = (comp->procesador->registros[reg] < 0);
+            break;
+        case 2: // LDI es igual a LD ya que precomputamos el valor efectivo
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 2, 0, 0, 0);
+            comp->procesador->registros[reg] = valor_efectivo;
+            comp->procesador->flags.z = (comp->procesador->registros[reg] == 0);
+            comp->procesador->flags.n = (comp->procesador->registros[reg] < 0);
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX_LDI, reg, comp->procesador->registros[reg], 0, 0);
+            break;
+        case 3: // ADD
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 3, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_ADD, comp->procesador->registros[reg], valor_efectivo);
+            break;
+        case 4: // SUB
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 4, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_SUB, comp->procesador->registros[reg], valor_efectivo);
+            break;
+        case 5: // MUL
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 5, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_MUL, comp->procesador->registros[reg], valor_efectivo);
+            break;
+        case 6: // DIV
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 6, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_DIV, comp->procesador->registros[reg], valor_efectivo);
+            break;
+        case 7: // MOD
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 7, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_MOD, comp->procesador->registros[reg], valor_efectivo);
+            break;
+        case 8: // AND
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 8, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_LOGIC, ALU_OP_AND, comp->procesador->registros[reg], valor_efectivo);
+            break;
+        case 9: // OR
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 9, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_LOGIC, ALU_OP_OR, comp->procesador->registros[reg], valor_efectivo);
+            break;
+        case 10: // XOR
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 10, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_LOGIC, ALU_OP_XOR, comp->procesador->registros[reg], valor_efectivo);
+            break;
+        case 11: // NOT
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 11, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_LOGIC, ALU_OP_NOT, comp->procesador->registros[reg], 0);
+            break;
+        case 12: // JMP
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 12, 0, 0, 0);
+            comp->procesador->pc = direccion_efectiva;
+            break;
+        case 13: // JZ
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 13, 0, 0, 0);
+            if (comp->procesador->flags.z) {
+                comp->procesador->pc = direccion_efectiva;
+            }
+            break;
+        case 14: // JN
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 14, 0, 0, 0);
+            if (comp->procesador->flags.n) {
+                comp->procesador->pc = direccion_efectiva;
+            }
+            break;
+        case 15: // CLR
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 15, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_SUB, comp->procesador->registros[reg], comp->procesador->registros[reg]);
+            break;
+        case 16: // NOP
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 16, 0, 0, 0);
+            //No hacer nada
+            break;
+        case 17: // DEC
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 17, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_SUB, comp->procesador->registros[reg], 1);
+            break;
+        case 18: // INC
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 18, 0, 0, 0);
+            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_ADD, comp->procesador->registros[reg], 1);
             break;
-        case 2: // Indirecto
-            ESCRIBIR_BUS(comp->io->direcciones, operando);
-            ESCRIBIR_BUS(comp->io->control, IO_OP_READ);
-            CLOCK_SYNC();
-            CLOCK_SYNC();
-            direccion_efectiva = LEER_BUS(comp->io->datos);
-            ESCRIBIR_BUS(comp->io->direcciones, direccion_efectiva);
-            ESCRIBIR_BUS(comp->io->control, IO_OP_READ);
-            CLOCK_SYNC();
-            CLOCK_SYNC();
-            valor_efectivo = LEER_BUS(comp->io->datos);
+        case 19: // HALT
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 19, 0, 0, 0);
+            MODELAR_INSTRUCCION(comp, direccion_instr, opcode * 4 + addr_mode, reg, operando, direccion_efectiva);
+            contar_instruccion(comp, direccion_instr, opcode * 4 + addr_mode);
+            comp->instrucciones++;
+            detener(comp, PARADA_HALT, "HALT");
             break;
-        case 3: // Indexado (usamos siempre el registro X para este ejemplo)
-            direccion_efectiva = operando + comp->procesador->registros[0];
-            ESCRIBIR_BUS(comp->io->direcciones, direccion_efectiva);
-            ESCRIBIR_BUS(comp->io->control, IO_OP_READ);
-            CLOCK_SYNC();
-            CLOCK_SYNC();
-            valor_efectivo = LEER_BUS(comp->io->datos);
+        case 20: // IVEC
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 20, 0, 0, 0);
+            comp->procesador->vector = direccion_efectiva;
+            break;
+        case 21: // EI
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 21, 0, 0, 0);
+            comp->procesador->flags.ie = 1;
+            comp->evento_ciclos = 0;
+            break;
+        case 22: // DI
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 22, 0, 0, 0);
+            comp->procesador->flags.ie = 0;
+            break;
+        case 23: // RETI
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 23, 0, 0, 0);
+            comp->procesador->pc = comp->procesador->pc_retorno;
+            comp->procesador->flags = comp->procesador->flags_retorno;
+            comp->evento_ciclos = 0;
+            if (comp->mmu != NULL) comp->mmu->en_manejador = 0;
+            break;
+        case 24: // WAIT
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 24, 0, 0, 0);
+            cpu_esperar_interrupcion(comp, direccion_instr);
+            break;
+        case 25: // XCHG: la lectura del operando ya ha pasado, la escritura cuesta como la de ST
+            TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, 25, 0, 0, 0);
+            fisica = TRADUCIR(comp, direccion_efectiva, CACHE_ESCRITURA);
+            valor_efectivo = memoria_intercambiar(comp, fisica, comp->procesador->registros[reg]);
+            ESCRIBIR_BUS(comp->io->direcciones, INHIBIR_BUS);
+            cpu_sync(comp);
+            cpu_sync(comp);
+            CACHE_ACCESO(comp, fisica, CACHE_ESCRITURA);
+            comp->procesador->registros[reg] = valor_efectivo;
+            comp->procesador->flags.z = (comp->procesador->registros[reg] == 0);
+            comp->procesador->flags.n = (comp->procesador->registros[reg] < 0);
             break;
         default:
-            error("Modo de direccionamiento inválido");
+            error("Código de operación inválido");
             break;
     }
-    printf("[ID] Instrucción: %s %s, %s 0x%04X => DE: 0x%04X VE: 0x%04X\n", operaciones[opcode], registros[reg], modos_direccionamiento[addr_mode], operando, direccion_efectiva, valor_efectivo);
-    
-    //Ejecutamos la instrucción
-    //Importante tener en cuenta cómo se alteran las flags del procesador
-    switch (opcode) {
-        case 0: // ST
-            printf("[EX] Ejecutando ST\n");
-            //Cuidado con el orden en las escrituras: ¿Que pasa si reordeno?
-            ESCRIBIR_BUS(comp->io->control, IO_OP_WRITE);
-            ESCRIBIR_BUS(comp->io->datos, comp->procesador->registros[reg]);
-            ESCRIBIR_BUS(comp->io->direcciones, direccion_efectiva);
-            CLOCK_SYNC();
-            CLOCK_SYNC();
-            printf("[EX] Registro %s almacenado en memoria en dirección 0x%04X con valor 0x%04X\n", registros[reg], direccion_efectiva, comp->procesador->registros[reg]);
-            break;
-        case 1: // LD
-            printf("[EX] Ejecutando LD\n");
-            comp->procesador->registros[reg] = valor_efectivo;
-            printf("[EX] Registro %s cargado con valor 0x%04X\n", registros[reg], comp->procesador->registros[reg]);
-            comp->procesador->flags.z = (comp->procesador->registros[reg] == 0);
-            comp->procesador->flags.n = (comp->procesador->registros[reg] < 0);
-            break;
-        case 2: // LDI es igual a LD ya que precomputamos el valor efectivo
-            printf("[EX] Ejecutando LDI\n");
-            comp->procesador->registros[reg] = valor_efectivo;
-            comp->procesador->flags.z = (comp->procesador->registros[reg] == 0);
-            comp->procesador->flags.n = (comp->procesador->registros[reg] < 0);
-            printf("[EX] Registro %s cargado con valor inmediato 0x%04X\n", registros[reg], comp->procesador->registros[reg]);
-            break;
-        case 3: // ADD
-            printf("[EX] Ejecutando ADD\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_ADD, comp->procesador->registros[reg], valor_efectivo);
-            break;
-        case 4: // SUB
-            printf("[EX] Ejecutando SUB\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_SUB, comp->procesador->registros[reg], valor_efectivo);
-            break;
-        case 5: // MUL
-            printf("[EX] Ejecutando MUL\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_MUL, comp->procesador->registros[reg], valor_efectivo);
-            break;
-        case 6: // DIV
-            printf("[EX] Ejecutando DIV\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_DIV, comp->procesador->registros[reg], valor_efectivo);
-            break;
-        case 7: // MOD
-            printf("[EX] Ejecutando MOD\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_MOD, comp->procesador->registros[reg], valor_efectivo);
-            break;
-        case 8: // AND
-            printf("[EX] Ejecutando AND\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_LOGIC, ALU_OP_AND, comp->procesador->registros[reg], valor_efectivo);
-            break;
-        case 9: // OR
-            printf("[EX] Ejecutando OR\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_LOGIC, ALU_OP_OR, comp->procesador->registros[reg], valor_efectivo);
-            break;
-        case 10: // XOR
-            printf("[EX] Ejecutando XOR\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_LOGIC, ALU_OP_XOR, comp->procesador->registros[reg], valor_efectivo);
-            break;
-        case 11: // NOT
-            printf("[EX] Ejecutando NOT\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_LOGIC, ALU_OP_NOT, comp->procesador->registros[reg], 0);
-            break;
-        case 12: // JMP
-            printf("[EX] Ejecutando JMP\n");
-            comp->procesador->pc = direccion_efectiva;
-            break;
-        case 13: // JZ
-            printf("[EX] Ejecutando JZ\n");
-            if (comp->procesador->flags.z) {
-                comp->procesador->pc = direccion_efectiva;
+
+    cpu_sync(comp);
+    cpu_sync(comp);
+
+#ifdef step_by_step
+    getchar();
+#endif
+    // En algunas arquitecturas aquí van los pasos de memoria y write-back, nosotros ya los hicimos en la ejecución directamente
+    MODELAR_INSTRUCCION(comp, direccion_instr, opcode * 4 + addr_mode, reg, operando, direccion_efectiva);
+    contar_instruccion(comp, direccion_instr, opcode * 4 + addr_mode);
+    comp->instrucciones++;
+}
+
+#ifdef INTERPRETE_HILADO
+//Intérprete de código hilado para el modo turbo (make INTERPRETE=hilado)
+//Hay un manejador por cada par (opcode, modo de direccionamiento). La caché de
+//instrucciones guarda el índice del manejador, así que despachar es leer la entrada
+//del PC y saltar: con GCC/Clang por goto calculado, en el resto (o con
+//-DHILADO_SIN_GOTO) por un switch.
+//El resultado y los ciclos son los mismos que los de unidad_de_control() en modo turbo.
+
+#define PARA_CADA_MODO(X, op) X(op, IMM) X(op, DIR) X(op, IND) X(op, IDX)
+#define PARA_CADA_INSTR(X) \
+    PARA_CADA_MODO(X, ST) PARA_CADA_MODO(X, LD) PARA_CADA_MODO(X, LDI) PARA_CADA_MODO(X, ADD) \
+    PARA_CADA_MODO(X, SUB) PARA_CADA_MODO(X, MUL) PARA_CADA_MODO(X, DIV) PARA_CADA_MODO(X, MOD) \
+    PARA_CADA_MODO(X, AND) PARA_CADA_MODO(X, OR) PARA_CADA_MODO(X, XOR) PARA_CADA_MODO(X, NOT) \
+    PARA_CADA_MODO(X, JMP) PARA_CADA_MODO(X, JZ) PARA_CADA_MODO(X, JN) PARA_CADA_MODO(X, CLR) \
+    PARA_CADA_MODO(X, NOP) PARA_CADA_MODO(X, DEC) PARA_CADA_MODO(X, INC) PARA_CADA_MODO(X, HALT) \
+    PARA_CADA_MODO(X, IVEC) PARA_CADA_MODO(X, EI) PARA_CADA_MODO(X, DI) PARA_CADA_MODO(X, RETI) \
+    PARA_CADA_MODO(X, WAIT) PARA_CADA_MODO(X, XCHG)
+
+//El índice de cada manejador es opcode * 4 + modo
+#define INDICE_MANEJADOR(op, modo) M_##op##_##modo,
+enum manejador_hilado {
+    PARA_CADA_INSTR(INDICE_MANEJADOR)
+    M_OPCODE_INVALIDO = MANEJADOR_OPCODE_INVALIDO,
+    M_MODO_INVALIDO = MANEJADOR_MODO_INVALIDO
+};
+
+//Transacción de bus en modo turbo para las direcciones que no son memoria normal:
+//el dispositivo responde en el primer flanco, el segundo no cambia nada
+static int bus_transaccion(struct computador * comp, int control, int direccion, int dato) {
+    ESCRIBIR_BUS(comp->io->control, control);
+    ESCRIBIR_BUS(comp->io->datos, dato);
+    ESCRIBIR_BUS(comp->io->direcciones, direccion);
+    bus_ciclo(comp);
+    return LEER_BUS(comp->io->datos);
+}
+
+static inline int hilado_leer(struct computador * comp, int direccion) {
+    if ((unsigned int)direccion < GPU_DATA_ADDR) {
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_MEM, EV_MEM_LEE, direccion, comp->memoria[direccion], 0, 0);
+        return comp->memoria[direccion];
+    }
+    return bus_transaccion(comp, IO_OP_READ, direccion, LEER_BUS(comp->io->datos));
+}
+
+static inline void hilado_escribir(struct computador * comp, int direccion, int valor) {
+    if ((unsigned int)direccion < GPU_DATA_ADDR) {
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_MEM, EV_MEM_ESCRIBE, direccion, valor, 0, 0);
+        memory_protection_emulation(direccion);
+        comp->memoria[direccion] = valor;
+        cache_instr_invalidar(comp, direccion);
+        jit_notificar_escritura(comp, direccion);
+        return;
+    }
+    bus_transaccion(comp, IO_OP_WRITE, direccion, valor);
+}
+
+static const struct instr_decodificada * hilado_buscar_lento(struct computador * comp, int pc);
+
+//Busca y decodifica la instrucción del PC si no está en la caché. El PC se lee
+//después de los eventos porque una interrupción lo cambia. Lo normal, una
+//instrucción ya decodificada, no sale de aquí.
+static inline const struct instr_decodificada * hilado_buscar(struct computador * comp) {
+    comprobar_eventos(comp);
+    int pc = comp->procesador->pc;
+    if ((unsigned int)pc < MEMORIA_BAJA && cache_instr_valida(comp, pc)) {
+        comp->cache_instr_aciertos++;
+        return &comp->cache_instr[pc];
+    }
+    return hilado_buscar_lento(comp, pc);
+}
+
+//La caché de instrucciones solo cubre MEMORIA_BAJA: el código de más arriba lo
+//ejecuta unidad_de_control()
+static const struct instr_decodificada * hilado_buscar_lento(struct computador * comp, int pc) {
+    while ((unsigned int)pc >= MEMORIA_BAJA) {
+        unidad_de_control(comp);
+        comprobar_eventos(comp);
+        pc = comp->procesador->pc;
+    }
+    if (cache_instr_valida(comp, pc)) {
+        comp->cache_instr_aciertos++;
+        return &comp->cache_instr[pc];
+    }
+    int instr = hilado_leer(comp, pc);
+    if (pc == 0x0 && instr == 0x0) {
+        cpu_avanzar(comp, CICLOS_BUSQUEDA);
+        detener(comp, PARADA_INSTR_NULA, "Instrucción nula en dirección 0x0000");
+    }
+    comp->cache_instr_fallos++;
+    cache_instr_guardar(comp, pc, instr);
+    return &comp->cache_instr[pc];
+}
+
+//Obtención del operando, igual para todas las instrucciones que comparten modo
+#define OPERANDO_IMM ve = d->operando;
+#define OPERANDO_DIR de = d->operando; ve = hilado_leer(comp, de);
+#define OPERANDO_IND de = hilado_leer(comp, d->operando); ve = hilado_leer(comp, de);
+#define OPERANDO_IDX de = d->operando + cpu->registros[0]; ve = hilado_leer(comp, de);
+
+#define ALU(modo, op, b) cpu->registros[d->reg] = alu_operation(cpu, (modo), (op), cpu->registros[d->reg], (b));
+#define CARGAR \
+    cpu->registros[d->reg] = ve; \
+    cpu->flags.z = (cpu->registros[d->reg] == 0); \
+    cpu->flags.n = (cpu->registros[d->reg] < 0);
+
+//Como en unidad_de_control(), la memoria escribe en el primer flanco de la transacción
+#define EJECUTAR_ST \
+    cpu_avanzar(comp, 1); \
+    hilado_escribir(comp, de, cpu->registros[d->reg]); \
+    extra = CICLOS_ESCRITURA - 1;
+#define EJECUTAR_LD CARGAR
+#define EJECUTAR_LDI CARGAR
+#define EJECUTAR_ADD ALU(ALU_MODE_ARITHMETHIC, ALU_OP_ADD, ve)
+#define EJECUTAR_SUB ALU(ALU_MODE_ARITHMETHIC, ALU_OP_SUB, ve)
+#define EJECUTAR_MUL ALU(ALU_MODE_ARITHMETHIC, ALU_OP_MUL, ve)
+#define EJECUTAR_DIV ALU(ALU_MODE_ARITHMETHIC, ALU_OP_DIV, ve)
+#define EJECUTAR_MOD ALU(ALU_MODE_ARITHMETHIC, ALU_OP_MOD, ve)
+#define EJECUTAR_AND ALU(ALU_MODE_LOGIC, ALU_OP_AND, ve)
+#define EJECUTAR_OR ALU(ALU_MODE_LOGIC, ALU_OP_OR, ve)
+#define EJECUTAR_XOR ALU(ALU_MODE_LOGIC, ALU_OP_XOR, ve)
+#define EJECUTAR_NOT ALU(ALU_MODE_LOGIC, ALU_OP_NOT, 0)
+#define EJECUTAR_JMP cpu->pc = de;
+#define EJECUTAR_JZ if (cpu->flags.z) cpu->pc = de;
+#define EJECUTAR_JN if (cpu->flags.n) cpu->pc = de;
+#define EJECUTAR_CLR ALU(ALU_MODE_ARITHMETHIC, ALU_OP_SUB, cpu->registros[d->reg])
+#define EJECUTAR_NOP
+#define EJECUTAR_DEC ALU(ALU_MODE_ARITHMETHIC, ALU_OP_SUB, 1)
+#define EJECUTAR_INC ALU(ALU_MODE_ARITHMETHIC, ALU_OP_ADD, 1)
+#define EJECUTAR_HALT \
+    CONTAR(d->manejador) \
+    comp->instrucciones++; \
+    detener(comp, PARADA_HALT, "HALT");
+#define EJECUTAR_XCHG \
+    ve = memoria_intercambiar(comp, de, cpu->registros[d->reg]); \
+    CARGAR \
+    extra = CICLOS_ESCRITURA;
+#define EJECUTAR_IVEC cpu->vector = de;
+#define EJECUTAR_EI cpu->flags.ie = 1; comp->evento_ciclos = 0;
+#define EJECUTAR_DI cpu->flags.ie = 0;
+#define EJECUTAR_RETI cpu->pc = cpu->pc_retorno; cpu->flags = cpu->flags_retorno; comp->evento_ciclos = 0;
+#define EJECUTAR_WAIT \
+    cpu_esperar_interrupcion(comp, (int)(d - comp->cache_instr));
+
+#if defined(__GNUC__) && !defined(HILADO_SIN_GOTO)
+#define ETIQUETA_MANEJADOR(op, modo) [M_##op##_##modo] = &&h_##op##_##modo,
+#define MANEJADOR(op, modo) h_##op##_##modo:
+#define DESPACHAR() goto *manejadores[(d = hilado_buscar(comp))->manejador]
+#else
+#define MANEJADOR(op, modo) case M_##op##_##modo:
+#define DESPACHAR() continue
+#endif
+
+//Como contar_instruccion(), sin el perfil: con --perfil no se usa este intérprete
+#define CONTAR(clave) \
+    comp->ejecuciones[(clave)]++; \
+    if (comp->dma.estado & DMA_OCUPADO) dma_avanzar(comp, flancos_libres_clave((clave)));
+
+//La búsqueda y el operando se cuentan antes de ejecutar: si la instrucción para la
+//máquina (HALT, WAIT sin entrada, un error), los ciclos son los de unidad_de_control().
+//La generación del reloj, que solo ven las trazas, avanza de una vez al final.
+#define CUERPO_MANEJADOR(op, modo) \
+    MANEJADOR(op, modo) { \
+        int de = 0, ve = 0, extra = 0; \
+        (void)ve; \
+        TRAZA(TRAZA_NIVEL_INSTR, TRAZA_CPU, EV_CPU_ESTADO, cpu->pc, cpu->registros[0], cpu->registros[1], \
+            (cpu->flags.z & 1) | (cpu->flags.n & 1) << 1 | (cpu->flags.c & 1) << 2 | (cpu->flags.v & 1) << 3 | (cpu->flags.ie & 1) << 4); \
+        cpu->pc += 1; \
+        OPERANDO_##modo \
+        comp->ciclos += CICLOS_BUSQUEDA + CICLOS_MODO_##modo; \
+        TRAZA(TRAZA_NIVEL_INSTR, TRAZA_CPU, EV_ID, d->instr, de, ve, 0); \
+        TRAZA(TRAZA_NIVEL_DETALLE, TRAZA_CPU, EV_EX, d->opcode, 0, 0, 0); \
+        EJECUTAR_##op \
+        comp->ciclos += extra + CICLOS_FIN; \
+        reloj_avanzar(comp, CICLOS_BUSQUEDA + CICLOS_MODO_##modo + extra + CICLOS_FIN); \
+        CONTAR(M_##op##_##modo) \
+        comp->instrucciones++; \
+        DESPACHAR(); \
+    }
+
+void ejecutar_hilado(struct computador * comp) {
+    struct cpu * cpu = comp->procesador;
+    const struct instr_decodificada * d;
+#if defined(__GNUC__) && !defined(HILADO_SIN_GOTO)
+    static void * const manejadores[] = {
+        PARA_CADA_INSTR(ETIQUETA_MANEJADOR)
+        [M_OPCODE_INVALIDO] = &&h_opcode_invalido,
+        [M_MODO_INVALIDO] = &&h_modo_invalido,
+    };
+    DESPACHAR();
+    PARA_CADA_INSTR(CUERPO_MANEJADOR)
+h_opcode_invalido:
+    cpu_avanzar(comp, CICLOS_BUSQUEDA + ciclos_modo[d->addr_mode]);
+    error("Código de operación inválido");
+h_modo_invalido:
+    cpu_avanzar(comp, CICLOS_BUSQUEDA);
+    error("Modo de direccionamiento inválido");
+#else
+    while (1) {
+        d = hilado_buscar(comp);
+        switch (d->manejador) {
+            PARA_CADA_INSTR(CUERPO_MANEJADOR)
+            case M_OPCODE_INVALIDO:
+                cpu_avanzar(comp, CICLOS_BUSQUEDA + ciclos_modo[d->addr_mode]);
+                error("Código de operación inválido");
+                break;
+            default:
+                cpu_avanzar(comp, CICLOS_BUSQUEDA);
+                error("Modo de direccionamiento inválido");
+                break;
+        }
+    }
+#endif
+}
+#endif
+
+#if defined(__x86_64__)
+#define JIT_DISPONIBLE 1
+//JIT de bloques básicos a x86-64 para el modo turbo (--jit)
+//Un bloque es una secuencia de instrucciones que termina en JMP/JZ/JN, en una
+//instrucción que el JIT no traduce (HALT, E/S en 0xFFF0-0xFFFF, escrituras
+//protegidas conocidas al traducir...) o al llegar a JIT_MAX_INSTR. Las comprobaciones
+//que solo se pueden hacer en ejecución (rango de 16 bits de la ALU, división por
+//cero, direcciones indirectas/indexadas que caen en E/S o en zona protegida,
+//escrituras sobre código traducido) salen del bloque antes de modificar nada y
+//unidad_de_control() ejecuta esa instrucción. Los bloques se guardan por PC y sus
+//salidas con destino fijo se encadenan directamente cuando el destino se traduce.
+//
+//Cada máquina tiene su propia caché de código; el código generado lleva incrustadas
+//las direcciones de sus mapas de bits (jit->cubierto y cache_instr_validas).
+//
+//Convenio del código generado: rdi = struct jit_estado *, rsi = comp->memoria,
+//eax/ecx/edx/r8-r11 temporales. Devuelve 0 al salir normalmente y 1 cuando la
+//instrucción en estado->pc debe interpretarse.
+
+#define JIT_MEMORIA_CODIGO (16 * 1024 * 1024)
+#define JIT_HOLGURA (64 * 1024) // Espacio mínimo libre para traducir otro bloque
+#define JIT_MAX_INSTR 128
+#define JIT_MAX_SALIDAS 65536
+#define JIT_COMBUSTIBLE 100000 // Bloques encadenados antes de volver al despachador
+#define JIT_COMBUSTIBLE_IRQ 1000 // Con interrupciones habilitadas, para acotar la latencia
+#define JIT_NO_TRADUCIBLE ((void *)1)
+
+struct jit_estado {
+    int32_t x;
+    int32_t acc;
+    int32_t z, n, c, v; // 0 o 1
+    int32_t pc;
+    int32_t combustible;
+    uint64_t ciclos;
+    uint64_t instrucciones;
+};
+
+typedef int (*jit_bloque)(struct jit_estado *, int32_t *);
+
+struct jit_salida {
+    uint8_t * parche; // rel32 del jmp de encadenamiento
+    int destino;
+};
+
+//Contador de una salida de bloque: cuántas veces se ha tomado y cuántas de las
+//instrucciones del bloque (claves[clave...], opcode * 4 + modo, desde pc) se han
+//ejecutado al tomarla. Se vuelcan en las estadísticas y el perfil de la máquina al
+//publicar, al salir y al vaciar la caché.
+#define JIT_MAX_CONTADORES 65536
+#define JIT_MAX_CLAVES (1 << 20)
+
+struct jit_contador {
+    uint64_t veces;
+    uint32_t clave;
+    uint16_t pc;
+    uint16_t instrucciones;
+};
+
+static int usar_jit = 0;
+static int jit_verificar = 0;
+
+struct jit {
+    uint8_t * memoria;
+    size_t usado;
+    void * bloques[0x10000];
+    uint64_t cubierto[0x10000 / 64]; // Direcciones que forman parte de algún bloque
+    int vaciar_pendiente;
+    struct jit_salida salidas[JIT_MAX_SALIDAS];
+    int num_salidas;
+    unsigned long long traducidos, entradas, salidas_lentas, interpretadas, vaciados;
+    struct jit_contador contadores[JIT_MAX_CONTADORES];
+    int num_contadores;
+    uint8_t claves[JIT_MAX_CLAVES];
+    int num_claves;
+    struct computador * comp;
+    //Solo con --jit-verificar
+    int * memoria_verificacion;
+    int * memoria_resultado;
+};
+
+
+//Desplazamientos dentro de struct jit_estado (todos caben en disp8)
+#define JE(campo) ((uint8_t)offsetof(struct jit_estado, campo))
+#define JE_REG(r) ((uint8_t)(offsetof(struct jit_estado, x) + 4 * (r)))
+
+static inline void jit_notificar_escritura(struct computador * comp, int direccion) {
+    struct jit * j = comp->jit;
+    if (j != NULL && (unsigned int)direccion < 0x10000 && ((j->cubierto[direccion >> 6] >> (direccion & 63)) & 1)) {
+        j->vaciar_pendiente = 1;
+    }
+}
+
+//Emisión de código
+struct jit_emisor {
+    uint8_t * p;
+    struct jit * jit;
+    int clave; // Primera clave del bloque en jit->claves
+    int pc; // Dirección de la primera instrucción del bloque
+};
+
+static void e8(struct jit_emisor * e, uint8_t b) { *e->p++ = b; }
+static void e32(struct jit_emisor * e, uint32_t v) { memcpy(e->p, &v, 4); e->p += 4; }
+static void e64(struct jit_emisor * e, uint64_t v) { memcpy(e->p, &v, 8); e->p += 8; }
+static void eb(struct jit_emisor * e, const char * bytes, int n) { memcpy(e->p, bytes, n); e->p += n; }
+
+//jcc rel32 hacia una etiqueta aún desconocida; devuelve la posición del rel32
+static uint8_t * e_jcc(struct jit_emisor * e, uint8_t cc) {
+    e8(e, 0x0F); e8(e, cc);
+    uint8_t * rel = e->p;
+    e32(e, 0);
+    return rel;
+}
+
+static void jit_enlazar(uint8_t * rel, const uint8_t * destino) {
+    int32_t d = (int32_t)(destino - (rel + 4));
+    memcpy(rel, &d, 4);
+}
+
+#define JCC_B 0x82  // jb / jc
+#define JCC_AE 0x83 // jae
+#define JCC_E 0x84  // je / jz
+#define JCC_A 0x87  // ja
+#define JCC_LE 0x8E // jle
+
+//mov r32, [rdi+campo]  (r: 0 eax, 1 ecx, 2 edx)
+static void e_cargar_estado(struct jit_emisor * e, int r, uint8_t disp) { e8(e, 0x8B); e8(e, 0x47 | (r << 3)); e8(e, disp); }
+//mov [rdi+campo], r32
+static void e_guardar_estado(struct jit_emisor * e, int r, uint8_t disp) { e8(e, 0x89); e8(e, 0x47 | (r << 3)); e8(e, disp); }
+//mov dword [rdi+campo], imm32
+static void e_guardar_estado_imm(struct jit_emisor * e, uint8_t disp, uint32_t v) { e8(e, 0xC7); e8(e, 0x47); e8(e, disp); e32(e, v); }
+//mov r32, [rsi + dir*4]
+static void e_cargar_memoria_fija(struct jit_emisor * e, int r, int direccion) { e8(e, 0x8B); e8(e, 0x86 | (r << 3)); e32(e, (uint32_t)direccion * 4); }
+//mov r32, imm32
+static void e_mov_imm(struct jit_emisor * e, int r, uint32_t v) { e8(e, 0xB8 + r); e32(e, v); }
+//add qword [rdi+campo], imm32
+static void e_sumar64(struct jit_emisor * e, uint8_t disp, uint32_t v) { e8(e, 0x48); e8(e, 0x81); e8(e, 0x47); e8(e, disp); e32(e, v); }
+
+//Sale hacia la instrucción lenta si r32 (eax o ecx) no cabe en 16 bits con signo
+static uint8_t * e_comprobar_rango(struct jit_emisor * e, int r) {
+    //lea r10d, [rax/rcx + 0x8000]; cmp r10d, 0xFFFF; ja
+    e8(e, 0x44); e8(e, 0x8D); e8(e, 0x90 | r); e32(e, 0x8000);
+    eb(e, "\x41\x81\xFA", 3); e32(e, 0xFFFF);
+    return e_jcc(e, JCC_A);
+}
+
+//Guarda en el flag indicado el resultado de setcc sobre r10b
+static void e_setcc_flag(struct jit_emisor * e, uint8_t setcc, uint8_t disp) {
+    e8(e, 0x41); e8(e, 0x0F); e8(e, setcc); e8(e, 0xC2); // setcc r10b
+    eb(e, "\x45\x0F\xB6\xD2", 4);                       // movzx r10d, r10b
+    e8(e, 0x44); e8(e, 0x89); e8(e, 0x57); e8(e, disp); // mov [rdi+disp], r10d
+}
+
+//Flags Z y N a partir de eax
+static void e_flags_zn(struct jit_emisor * e) {
+    eb(e, "\x85\xC0", 2); // test eax, eax
+    e_setcc_flag(e, 0x94, JE(z));
+    e_setcc_flag(e, 0x98, JE(n));
+}
+
+//Flag C (y V si se pide) si eax no cabe en 16 bits con signo
+static void e_flag_c(struct jit_emisor * e, int tambien_v) {
+    e8(e, 0x44); e8(e, 0x8D); e8(e, 0x90); e32(e, 0x8000); // lea r10d, [rax+0x8000]
+    eb(e, "\x41\x81\xFA", 3); e32(e, 0xFFFF);             // cmp r10d, 0xFFFF
+    e_setcc_flag(e, 0x97, JE(c));
+    if (tambien_v) {
+        eb(e, "\x44\x89\x57", 3); e8(e, JE(v));           // mov [rdi+v], r10d
+    }
+}
+
+//Cuenta la salida para las estadísticas (mov r8, &contador->veces; inc qword [r8])
+static void e_contar_salida(struct jit_emisor * e, uint32_t instrucciones) {
+    if (instrucciones == 0) return;
+    struct jit_contador * c = &e->jit->contadores[e->jit->num_contadores++];
+    c->veces = 0;
+    c->clave = (uint32_t)e->clave;
+    c->pc = (uint16_t)e->pc;
+    c->instrucciones = (uint16_t)instrucciones;
+    e8(e, 0x49); e8(e, 0xB8); e64(e, (uint64_t)(uintptr_t)&c->veces);
+    eb(e, "\x49\xFF\x00", 3);
+}
+
+//Salida con destino fijo, encadenable
+static void e_salida_fija(struct jit_emisor * e, uint32_t ciclos, uint32_t instrucciones, int destino) {
+    e_contar_salida(e, instrucciones);
+    e_sumar64(e, JE(ciclos), ciclos);
+    e_sumar64(e, JE(instrucciones), instrucciones);
+    e_guardar_estado_imm(e, JE(pc), (uint32_t)destino);
+    e8(e, 0xFF); e8(e, 0x4F); e8(e, JE(combustible)); // dec dword [rdi+combustible]
+    uint8_t * sin_combustible = e_jcc(e, JCC_LE);
+    e8(e, 0xE9);
+    uint8_t * parche = e->p;
+    e32(e, 0);
+    jit_enlazar(sin_combustible, e->p);
+    jit_enlazar(parche, e->p);
+    eb(e, "\x31\xC0\xC3", 3); // xor eax, eax; ret
+    struct jit * j = e->jit;
+    if ((unsigned int)destino < 0x10000 && j->bloques[destino] != NULL && j->bloques[destino] != JIT_NO_TRADUCIBLE) {
+        jit_enlazar(parche, j->bloques[destino]);
+    } else if (j->num_salidas < JIT_MAX_SALIDAS) {
+        j->salidas[j->num_salidas].parche = parche;
+        j->salidas[j->num_salidas].destino = destino;
+        j->num_salidas++;
+    }
+}
+
+//Salida con destino en edx
+static void e_salida_dinamica(struct jit_emisor * e, uint32_t ciclos, uint32_t instrucciones) {
+    e_contar_salida(e, instrucciones);
+    e_sumar64(e, JE(ciclos), ciclos);
+    e_sumar64(e, JE(instrucciones), instrucciones);
+    e_guardar_estado(e, 2, JE(pc));
+    eb(e, "\x31\xC0\xC3", 3);
+}
+
+#define JIT_MAX_LENTAS 8 // Saltos a la salida lenta por instrucción
+
+//Decide si una instrucción se puede traducir mirando solo la instrucción
+static int jit_traducible(int direccion, int instr) {
+    int opcode = (instr >> 24) & 0xFF;
+    int reg = (instr >> 20) & 0x0F;
+    int modo = (instr >> 16) & 0x0F;
+    int operando = instr & 0xFFFF;
+    if (modo > 3 || reg > 1 || opcode >= NUM_OPERACIONES) return 0;
+    if (direccion == 0 && instr == 0) return 0;
+    //El operando directo o el puntero indirecto no pueden ser E/S
+    if ((modo == 1 || modo == 2) && operando >= GPU_DATA_ADDR) return 0;
+    switch (opcode) {
+        case 0: // ST
+            if (modo == 0) return 0; // Escribe en 0x0000, siempre protegida
+            if (modo == 1 && operando < MEMORY_DATA_BARRIER) return 0;
+            return 1;
+        case 3: case 4: case 5: case 6: case 7: case 8: case 9: case 10:
+            //Un inmediato fuera de rango provoca siempre el error de la ALU
+            if (modo == 0 && operando > 32767) return 0;
+            if (opcode == 6 && modo == 0 && operando == 0) return 0;
+            return 1;
+        case 19: // HALT
+        case 20: case 21: case 22: case 23: case 24: // IVEC, EI, DI, RETI, WAIT
+        case 25: // XCHG
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+static int jit_es_salto(int opcode) {
+    return opcode == 12 || opcode == 13 || opcode == 14;
+}
+
+//Traduce el bloque que empieza en pc. Devuelve el código o JIT_NO_TRADUCIBLE.
+static void * jit_traducir(struct computador * comp, int pc) {
+    struct jit * j = comp->jit;
+    if ((unsigned int)pc >= GPU_DATA_ADDR) return JIT_NO_TRADUCIBLE;
+    //Cada instrucción añade como mucho una salida lenta; el salto final, dos fijas
+    if (JIT_MEMORIA_CODIGO - j->usado < JIT_HOLGURA || j->num_contadores + JIT_MAX_INSTR + 2 > JIT_MAX_CONTADORES ||
+        j->num_claves + JIT_MAX_INSTR > JIT_MAX_CLAVES) {
+        return NULL; //Sin espacio: el despachador vacía la caché y reintenta
+    }
+    struct jit_emisor em = { j->memoria + j->usado, j, j->num_claves, pc };
+    struct jit_emisor * e = &em;
+    uint8_t * inicio = e->p;
+
+    //Salidas lentas pendientes: rel32 a enlazar, con el estado de la instrucción
+    struct { uint8_t * rel[JIT_MAX_LENTAS]; int n; int pc; uint32_t ciclos; uint32_t instrucciones; } lentas[JIT_MAX_INSTR];
+    int num_lentas = 0;
+
+    uint32_t ciclos = 0, instrucciones = 0;
+    int direccion = pc;
+    int terminado = 0;
+    while (!terminado && instrucciones < JIT_MAX_INSTR && (unsigned int)direccion < GPU_DATA_ADDR) {
+        int instr = comp->memoria[direccion];
+        if (!jit_traducible(direccion, instr)) break;
+        int opcode = (instr >> 24) & 0xFF;
+        int reg = (instr >> 20) & 0x0F;
+        int modo = (instr >> 16) & 0x0F;
+        int operando = instr & 0xFFFF;
+        uint32_t coste = CICLOS_BUSQUEDA + ciclos_modo[modo] + CICLOS_FIN + (opcode == 0 ? CICLOS_ESCRITURA : 0);
+        j->claves[e->clave + instrucciones] = (uint8_t)(opcode * 4 + modo);
+
+        lentas[num_lentas].n = 0;
+        lentas[num_lentas].pc = direccion;
+        lentas[num_lentas].ciclos = ciclos;
+        lentas[num_lentas].instrucciones = instrucciones;
+#define LENTA(salto) (lentas[num_lentas].rel[lentas[num_lentas].n++] = (salto))
+
+        //Operando: edx = dirección efectiva (si es variable), ecx = valor efectivo
+        int de_fija = 1, de = 0, ve_fijo = 0, ve = 0;
+        int necesita_ve = !(jit_es_salto(opcode) || opcode == 0);
+        switch (modo) {
+            case 0:
+                ve_fijo = 1;
+                ve = operando;
+                break;
+            case 1:
+                de = operando;
+                if (necesita_ve) e_cargar_memoria_fija(e, 1, de);
+                break;
+            case 2:
+                de_fija = 0;
+                e_cargar_memoria_fija(e, 2, operando);
+                break;
+            case 3:
+                de_fija = 0;
+                e_cargar_estado(e, 2, JE_REG(0));
+                e8(e, 0x81); e8(e, 0xC2); e32(e, (uint32_t)operando); // add edx, operando
+                break;
+        }
+        if (!de_fija) {
+            //La lectura del operando no puede caer en E/S
+            e8(e, 0x81); e8(e, 0xFA); e32(e, GPU_DATA_ADDR); // cmp edx, 0xFFF0
+            LENTA(e_jcc(e, JCC_AE));
+            if (necesita_ve) eb(e, "\x8B\x0C\x96", 3); // mov ecx, [rsi+rdx*4]
+        }
+        if (ve_fijo) e_mov_imm(e, 1, (uint32_t)ve);
+
+        switch (opcode) {
+            case 0: // ST
+                if (de_fija) e_mov_imm(e, 2, (uint32_t)de);
+                else {
+                    e8(e, 0x81); e8(e, 0xFA); e32(e, MEMORY_DATA_BARRIER); // cmp edx, barrera
+                    LENTA(e_jcc(e, JCC_B));
+                }
+                //Escritura sobre código traducido: la hace el intérprete y se vacía la caché
+                e8(e, 0x49); e8(e, 0xB8); e64(e, (uint64_t)(uintptr_t)j->cubierto); // mov r8, jit->cubierto
+                eb(e, "\x41\x0F\xA3\x10", 4);                                    // bt [r8], edx
+                LENTA(e_jcc(e, JCC_B));
+                e_cargar_estado(e, 0, JE_REG(reg));
+                eb(e, "\x89\x04\x96", 3);                                        // mov [rsi+rdx*4], eax
+                e8(e, 0x49); e8(e, 0xB9); e64(e, (uint64_t)(uintptr_t)comp->cache_instr_validas); // mov r9, validas
+                eb(e, "\x41\x0F\xB3\x11", 4);                                    // btr [r9], edx
+                break;
+            case 1: // LD
+            case 2: // LDI
+                if (ve_fijo) {
+                    e_guardar_estado_imm(e, JE_REG(reg), (uint32_t)ve);
+                    e_guardar_estado_imm(e, JE(z), ve == 0);
+                    e_guardar_estado_imm(e, JE(n), 0);
+                } else {
+                    eb(e, "\x89\xC8", 2); // mov eax, ecx
+                    e_guardar_estado(e, 0, JE_REG(reg));
+                    e_flags_zn(e);
+                }
+                break;
+            case 3: case 4: case 5: case 6: case 7: // ADD SUB MUL DIV MOD
+            case 8: case 9: case 10:               // AND OR XOR
+                e_cargar_estado(e, 0, JE_REG(reg));
+                LENTA(e_comprobar_rango(e, 0));
+                if (!ve_fijo) LENTA(e_comprobar_rango(e, 1));
+                switch (opcode) {
+                    case 3: eb(e, "\x01\xC8", 2); e_flag_c(e, 0); e_guardar_estado_imm(e, JE(v), 0); break;
+                    case 4: eb(e, "\x29\xC8", 2); e_flag_c(e, 0); e_guardar_estado_imm(e, JE(v), 0); break;
+                    case 5: eb(e, "\x0F\xAF\xC1", 3); e_flag_c(e, 1); break;
+                    case 6:
+                        if (!ve_fijo) {
+                            eb(e, "\x85\xC9", 2); // test ecx, ecx
+                            LENTA(e_jcc(e, JCC_E));
+                        }
+                        eb(e, "\x99\xF7\xF9", 3); // cdq; idiv ecx
+                        e_guardar_estado_imm(e, JE(c), 0);
+                        e_guardar_estado_imm(e, JE(v), 0);
+                        break;
+                    case 7: break; // MOD no está implementado en la ALU: resultado 0 sin tocar flags
+                    case 8: eb(e, "\x21\xC8", 2); break;
+                    case 9: eb(e, "\x09\xC8", 2); break;
+                    case 10: eb(e, "\x31\xC8", 2); break;
+                }
+                if (opcode == 7) {
+                    e_guardar_estado_imm(e, JE_REG(reg), 0);
+                } else {
+                    e_flags_zn(e);
+                    e8(e, 0x25); e32(e, 0xFFFF); // and eax, 0xFFFF
+                    e_guardar_estado(e, 0, JE_REG(reg));
+                }
+                break;
+            case 11: // NOT
+                e_cargar_estado(e, 0, JE_REG(reg));
+                LENTA(e_comprobar_rango(e, 0));
+                eb(e, "\xF7\xD0", 2); // not eax
+                e_flags_zn(e);
+                e8(e, 0x25); e32(e, 0xFFFF);
+                e_guardar_estado(e, 0, JE_REG(reg));
+                break;
+            case 15: // CLR
+                e_cargar_estado(e, 0, JE_REG(reg));
+                LENTA(e_comprobar_rango(e, 0));
+                e_guardar_estado_imm(e, JE_REG(reg), 0);
+                e_guardar_estado_imm(e, JE(z), 1);
+                e_guardar_estado_imm(e, JE(n), 0);
+                e_guardar_estado_imm(e, JE(c), 0);
+                e_guardar_estado_imm(e, JE(v), 0);
+                break;
+            case 16: // NOP
+                break;
+            case 17: // DEC
+            case 18: // INC
+                e_cargar_estado(e, 0, JE_REG(reg));
+                LENTA(e_comprobar_rango(e, 0));
+                e8(e, opcode == 17 ? 0x2D : 0x05); e32(e, 1); // sub/add eax, 1
+                e_flag_c(e, 0);
+                e_guardar_estado_imm(e, JE(v), 0);
+                e_flags_zn(e);
+                e8(e, 0x25); e32(e, 0xFFFF);
+                e_guardar_estado(e, 0, JE_REG(reg));
+                break;
+            case 12: case 13: case 14: { // JMP JZ JN
+                uint32_t ciclos_fin = ciclos + coste, instr_fin = instrucciones + 1;
+                if (opcode != 12) {
+                    e8(e, 0x83); e8(e, 0x7F); e8(e, opcode == 13 ? JE(z) : JE(n)); e8(e, 0x00); // cmp flag, 0
+                    uint8_t * no_tomado = e_jcc(e, JCC_E);
+                    if (de_fija) e_salida_fija(e, ciclos_fin, instr_fin, de);
+                    else e_salida_dinamica(e, ciclos_fin, instr_fin);
+                    jit_enlazar(no_tomado, e->p);
+                    e_salida_fija(e, ciclos_fin, instr_fin, direccion + 1);
+                } else if (de_fija) {
+                    e_salida_fija(e, ciclos_fin, instr_fin, de);
+                } else {
+                    e_salida_dinamica(e, ciclos_fin, instr_fin);
+                }
+                terminado = 1;
+                break;
+            }
+        }
+#undef LENTA
+        if (lentas[num_lentas].n > 0) num_lentas++;
+        ciclos += coste;
+        instrucciones++;
+        direccion++;
+    }
+
+    //Marcamos las direcciones traducidas (o intentadas) para detectar código automodificable
+    for (int d = pc; d <= direccion && d < 0x10000; d++) {
+        j->cubierto[d >> 6] |= 1ULL << (d & 63);
+    }
+    if (instrucciones == 0) {
+        return JIT_NO_TRADUCIBLE;
+    }
+    if (!terminado) {
+        e_salida_fija(e, ciclos, instrucciones, direccion);
+    }
+    for (int i = 0; i < num_lentas; i++) {
+        for (int j = 0; j < lentas[i].n; j++) jit_enlazar(lentas[i].rel[j], e->p);
+        e_contar_salida(e, lentas[i].instrucciones);
+        e_sumar64(e, JE(ciclos), lentas[i].ciclos);
+        e_sumar64(e, JE(instrucciones), lentas[i].instrucciones);
+        e_guardar_estado_imm(e, JE(pc), (uint32_t)lentas[i].pc);
+        e_mov_imm(e, 0, 1);
+        e8(e, 0xC3);
+    }
+
+    j->usado = (size_t)(e->p - j->memoria);
+    j->num_claves += instrucciones;
+    j->traducidos++;
+    //Encadenar las salidas que esperaban este bloque
+    for (int i = 0; i < j->num_salidas; i++) {
+        if (j->salidas[i].destino == pc) {
+            jit_enlazar(j->salidas[i].parche, inicio);
+            j->salidas[i] = j->salidas[--j->num_salidas];
+            i--;
+        }
+    }
+    return inicio;
+}
+
+//Suma las salidas tomadas a las ejecuciones por (opcode, modo) de la máquina
+static void jit_volcar_contadores(struct jit * j) {
+    for (int i = 0; i < j->num_contadores; i++) {
+        struct jit_contador * c = &j->contadores[i];
+        if (c->veces == 0) continue;
+        struct perfil * perfil = j->comp->perfil;
+        for (uint32_t k = 0; k < c->instrucciones; k++) {
+            int clave = j->claves[c->clave + k];
+            j->comp->ejecuciones[clave] += c->veces;
+            if (perfil != NULL) {
+                perfil->ejecuciones[(c->pc + k) & 0xFFFF] += c->veces;
+                perfil->ciclos[(c->pc + k) & 0xFFFF] += c->veces * ciclos_clave(clave);
+            }
+        }
+        c->veces = 0;
+    }
+}
+
+static void jit_vaciar(struct jit * j) {
+    jit_volcar_contadores(j);
+    j->num_contadores = 0;
+    j->num_claves = 0;
+    memset(j->bloques, 0, sizeof(j->bloques));
+    memset(j->cubierto, 0, sizeof(j->cubierto));
+    j->usado = 0;
+    j->num_salidas = 0;
+    j->vaciar_pendiente = 0;
+    j->vaciados++;
+}
+
+int jit_iniciar(struct computador * comp) {
+    struct jit * j = calloc(1, sizeof(*j));
+    if (j == NULL) {
+        perror("calloc JIT");
+        return -1;
+    }
+    j->memoria = mmap(NULL, JIT_MEMORIA_CODIGO, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->memoria == MAP_FAILED) {
+        perror("mmap JIT");
+        free(j);
+        return -1;
+    }
+    if (jit_verificar) {
+        j->memoria_verificacion = malloc(0x10000 * sizeof(int));
+        j->memoria_resultado = malloc(0x10000 * sizeof(int));
+        if (j->memoria_verificacion == NULL || j->memoria_resultado == NULL) {
+            perror("malloc JIT");
+            comp->jit = j;
+            jit_liberar(comp);
+            return -1;
+        }
+    }
+    j->comp = comp;
+    comp->jit = j;
+    return 0;
+}
+
+static void jit_liberar(struct computador * comp) {
+    struct jit * j = comp->jit;
+    if (j == NULL) return;
+    munmap(j->memoria, JIT_MEMORIA_CODIGO);
+    free(j->memoria_verificacion);
+    free(j->memoria_resultado);
+    free(j);
+    comp->jit = NULL;
+}
+
+static void jit_cargar_estado(struct jit_estado * je, const struct cpu * cpu) {
+    je->x = cpu->registros[0];
+    je->acc = cpu->registros[1];
+    je->z = cpu->flags.z != 0;
+    je->n = cpu->flags.n != 0;
+    je->c = cpu->flags.c != 0;
+    je->v = cpu->flags.v != 0;
+    je->pc = cpu->pc;
+    je->ciclos = 0;
+    je->instrucciones = 0;
+}
+
+static void jit_guardar_estado(const struct jit_estado * je, struct cpu * cpu) {
+    cpu->registros[0] = je->x;
+    cpu->registros[1] = je->acc;
+    cpu->flags.z = je->z;
+    cpu->flags.n = je->n;
+    cpu->flags.c = je->c;
+    cpu->flags.v = je->v;
+    cpu->pc = je->pc;
+}
+
+//Modo de verificación: cada bloque se ejecuta una vez en el JIT, se deshace y se
+//repite con unidad_de_control(); registros, flags, PC, ciclos y memoria deben coincidir
+static void jit_verificar_bloque(struct computador * comp, jit_bloque bloque) {
+    struct jit * j = comp->jit;
+    struct cpu * cpu = comp->procesador;
+    struct cpu antes = *cpu;
+    struct jit_estado je;
+    const size_t tam_memoria = 0x10000 * sizeof(int);
+    int * memoria_fisica = comp->memoria;
+    int * memoria_resultado_jit = j->memoria_resultado;
+    memcpy(j->memoria_verificacion, memoria_fisica, tam_memoria);
+    jit_cargar_estado(&je, cpu);
+    je.combustible = 1;
+    jit_volcar_contadores(j);
+    int lenta = bloque(&je, memoria_fisica);
+    memcpy(memoria_resultado_jit, memoria_fisica, tam_memoria);
+    //El intérprete vuelve a contar estas instrucciones
+    for (int i = 0; i < j->num_contadores; i++) j->contadores[i].veces = 0;
+
+    memcpy(memoria_fisica, j->memoria_verificacion, tam_memoria);
+    *cpu = antes;
+    unsigned long long ciclos_antes = comp->ciclos;
+    for (uint64_t i = 0; i < je.instrucciones; i++) {
+        unidad_de_control(comp);
+    }
+    struct jit_estado ji;
+    jit_cargar_estado(&ji, cpu);
+    uint64_t ciclos_interprete = comp->ciclos - ciclos_antes;
+    if (ji.pc != je.pc || ji.x != je.x || ji.acc != je.acc || ji.z != je.z || ji.n != je.n || ji.c != je.c || ji.v != je.v ||
+        ciclos_interprete != je.ciclos || memcmp(memoria_resultado_jit, memoria_fisica, tam_memoria) != 0) {
+        traza_volcar();
+        fprintf(stderr, "[JIT] Discrepancia en el bloque de 0x%04X (%llu instrucciones, salida %s)\n", antes.pc, (unsigned long long)je.instrucciones, lenta ? "lenta" : "normal");
+        fprintf(stderr, "[JIT]   JIT:       PC=0x%08X X=%08X ACC=%08X Z=%d N=%d C=%d V=%d ciclos=%llu\n", je.pc, je.x, je.acc, je.z, je.n, je.c, je.v, (unsigned long long)je.ciclos);
+        fprintf(stderr, "[JIT]   Intérprete: PC=0x%08X X=%08X ACC=%08X Z=%d N=%d C=%d V=%d ciclos=%llu\n", ji.pc, ji.x, ji.acc, ji.z, ji.n, ji.c, ji.v, (unsigned long long)ciclos_interprete);
+        for (int d = 0; d < 0x10000; d++) {
+            if (memoria_resultado_jit[d] != memoria_fisica[d]) {
+                fprintf(stderr, "[JIT]   Memoria 0x%04X: JIT 0x%08X, intérprete 0x%08X\n", d, memoria_resultado_jit[d], memoria_fisica[d]);
+            }
+        }
+        char mensaje[64];
+        snprintf(mensaje, sizeof(mensaje), "Discrepancia del JIT en el bloque de 0x%04X", antes.pc);
+        detener(comp, PARADA_ERROR, mensaje);
+    }
+    if (lenta) {
+        j->salidas_lentas++;
+        j->interpretadas++;
+        unidad_de_control(comp);
+    }
+}
+
+//Bloques que se pueden encadenar sin pasarse de los límites de la máquina. Un
+//bloque ejecuta como mucho JIT_MAX_INSTR instrucciones y ninguna cuesta más que un
+//ST indirecto; con 0 la instrucción se interpreta y el intérprete para en el límite.
+static int32_t jit_combustible(const struct computador * comp) {
+    const unsigned long long ciclos_max_instr = CICLOS_BUSQUEDA + CICLOS_MODO_IND + CICLOS_ESCRITURA + CICLOS_FIN;
+    //Con una transferencia DMA en curso cada instrucción le cede flancos: se interpreta
+    if (comp->dma.estado & DMA_OCUPADO) return 0;
+    unsigned long long bloques = JIT_COMBUSTIBLE;
+    //La línea del teclado solo cambia dentro de un bloque si terminal escribe
+    if (comp->cpu.flags.ie && comp->shm != NULL) bloques = JIT_COMBUSTIBLE_IRQ;
+    if (comp->limite_instrucciones != ULLONG_MAX) {
+        unsigned long long resto = comp->instrucciones < comp->limite_instrucciones ? comp->limite_instrucciones - comp->instrucciones : 0;
+        if (resto / JIT_MAX_INSTR < bloques) bloques = resto / JIT_MAX_INSTR;
+    }
+    if (comp->limite_ciclos != ULLONG_MAX) {
+        unsigned long long resto = comp->ciclos < comp->limite_ciclos ? comp->limite_ciclos - comp->ciclos : 0;
+        if (resto / (JIT_MAX_INSTR * ciclos_max_instr) < bloques) bloques = resto / (JIT_MAX_INSTR * ciclos_max_instr);
+    }
+    return (int32_t)bloques;
+}
+
+void ejecutar_jit(struct computador * comp) {
+    struct jit * j = comp->jit;
+    struct cpu * cpu = comp->procesador;
+    struct jit_estado je;
+    while (1) {
+        comprobar_eventos(comp);
+        if (j->vaciar_pendiente) {
+            jit_vaciar(j);
+        }
+        int pc = cpu->pc;
+        void * bloque = JIT_NO_TRADUCIBLE;
+        if ((unsigned int)pc < 0x10000) {
+            bloque = j->bloques[pc];
+            if (bloque == NULL) {
+                bloque = jit_traducir(comp, pc);
+                if (bloque == NULL) {
+                    jit_vaciar(j);
+                    bloque = jit_traducir(comp, pc);
+                }
+                j->bloques[pc] = bloque;
+            }
+        }
+        int32_t combustible = jit_combustible(comp);
+        if (bloque == JIT_NO_TRADUCIBLE || combustible == 0) {
+            j->interpretadas++;
+            unidad_de_control(comp);
+            continue;
+        }
+        j->entradas++;
+        if (jit_verificar) {
+            jit_verificar_bloque(comp, (jit_bloque)bloque);
+            continue;
+        }
+        jit_cargar_estado(&je, cpu);
+        je.combustible = combustible;
+        int lenta = ((jit_bloque)bloque)(&je, comp->memoria);
+        jit_guardar_estado(&je, cpu);
+        cpu_avanzar(comp, je.ciclos);
+        comp->instrucciones += je.instrucciones;
+        if (lenta) {
+            //Comprobación fallida en ejecución: el intérprete hace la instrucción
+            j->salidas_lentas++;
+            j->interpretadas++;
+            unidad_de_control(comp);
+        }
+    }
+}
+#else
+static inline void jit_notificar_escritura(struct computador * comp, int direccion) { (void)comp; (void)direccion; }
+static void jit_liberar(struct computador * comp) { (void)comp; }
+#endif
+
+//Contadores de rendimiento
+#define ESTADISTICAS_PERIODO_NS 100000000ULL // Una publicación cada ~100 ms
+
+
+static uint64_t timespec_ns(const struct timespec * t) {
+    return (uint64_t)t->tv_sec * 1000000000ULL + (uint64_t)t->tv_nsec;
+}
+
+void estadisticas_iniciar(struct computador * comp, struct estadisticas * pagina) {
+    memset(pagina, 0, sizeof(*pagina));
+    pagina->magico = ESTADISTICAS_MAGICO;
+    pagina->version = ESTADISTICAS_VERSION;
+    pagina->tam = sizeof(*pagina);
+    comp->estadisticas = pagina;
+    comp->paso_publicacion = 1;
+    comp->proxima_publicacion = comp->instrucciones;
+    clock_gettime(CLOCK_MONOTONIC, &comp->ultima_publicacion);
+}
+
+//Deriva los contadores por etapa y por modo de las ejecuciones por (opcode, modo)
+static void estadisticas_calcular(struct computador * comp, struct estadisticas * e) {
+#ifdef JIT_DISPONIBLE
+    if (comp->jit) jit_volcar_contadores(comp->jit);
+#endif
+    e->instrucciones = comp->instrucciones;
+    e->ciclos = comp->ciclos;
+    for (int i = 0; i < NUM_OPERACIONES * 4; i++) {
+        unsigned long long n = comp->ejecuciones[i];
+        int opcode = i / 4, modo = i % 4;
+        e->ejecuciones[i] = n;
+        e->lecturas_busqueda += n;
+        e->lecturas[modo] += n * lecturas_modo[modo];
+        e->ciclos_busqueda += n * CICLOS_BUSQUEDA;
+        e->ciclos_operando += n * ciclos_modo[modo];
+        if (ESCRIBE_MEMORIA(opcode)) {
+            e->escrituras[modo] += n;
+            e->ciclos_ejecucion += n * CICLOS_ESCRITURA;
+        }
+        if (opcode != 19) e->ciclos_ejecucion += n * CICLOS_FIN; // HALT para antes de los flancos finales
+    }
+    //Lo que no va a un dispositivo va a la memoria. El DMA lee siempre de memoria
+    //y escribe en memoria o en la GPU, en flancos que la CPU deja libres.
+    uint64_t por_tipo[2] = { e->lecturas_busqueda + comp->dma.palabras, comp->dma.palabras };
+    for (int m = 0; m < 4; m++) {
+        por_tipo[0] += e->lecturas[m];
+        por_tipo[1] += e->escrituras[m];
+    }
+    e->transacciones = por_tipo[0] + por_tipo[1];
+    for (int rw = 0; rw < 2; rw++) {
+        uint64_t memoria = por_tipo[rw];
+        for (int d = DISPOSITIVO_GPU; d < NUM_DISPOSITIVOS; d++) {
+            e->accesos[d][rw] = atomic_load_explicit(&comp->accesos[d][rw], memory_order_relaxed);
+            if (d == DISPOSITIVO_GPU && rw == 1) e->accesos[d][rw] += comp->dma.palabras_gpu;
+            memoria = memoria > e->accesos[d][rw] ? memoria - e->accesos[d][rw] : 0;
+        }
+        e->accesos[DISPOSITIVO_MEMORIA][rw] = memoria;
+    }
+    e->dma_palabras = comp->dma.palabras;
+    e->dma_transferencias = comp->dma.transferencias;
+    //Cada transacción ocupa un flanco; en el resto el bus está inhibido
+    uint64_t flancos = e->ciclos_busqueda + e->ciclos_operando + e->ciclos_ejecucion;
+    e->ciclos_bus_inhibido = flancos > e->transacciones ? flancos - e->transacciones : 0;
+    e->cache_instr_aciertos = comp->cache_instr_aciertos;
+    e->cache_instr_fallos = comp->cache_instr_fallos;
+    e->interrupciones = comp->interrupciones;
+    e->ciclos_espera = comp->ciclos_espera;
+}
+
+//Escribe la página compartida bajo el seqlock y ajusta el paso (en instrucciones)
+//para que la siguiente publicación llegue en unos ESTADISTICAS_PERIODO_NS
+static void estadisticas_publicar(struct computador * comp) {
+    struct estadisticas * pagina = comp->estadisticas;
+    if (pagina == NULL) return;
+    struct estadisticas e;
+    memset(&e, 0, sizeof(e));
+    estadisticas_calcular(comp, &e);
+    struct timespec ahora;
+    clock_gettime(CLOCK_MONOTONIC, &ahora);
+    e.tiempo_ns = timespec_ns(&ahora);
+
+    const size_t datos = offsetof(struct estadisticas, tiempo_ns);
+    unsigned int secuencia = atomic_load_explicit(&pagina->secuencia, memory_order_relaxed);
+    atomic_store_explicit(&pagina->secuencia, secuencia + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy((char *)pagina + datos, (const char *)&e + datos, sizeof(e) - datos);
+    atomic_store_explicit(&pagina->secuencia, secuencia + 2, memory_order_release);
+
+    uint64_t transcurrido = e.tiempo_ns - timespec_ns(&comp->ultima_publicacion);
+    if (transcurrido < ESTADISTICAS_PERIODO_NS / 2 && comp->paso_publicacion < (1ULL << 30)) {
+        comp->paso_publicacion *= 2;
+    } else if (transcurrido > ESTADISTICAS_PERIODO_NS * 2 && comp->paso_publicacion > 1) {
+        comp->paso_publicacion /= 2;
+    }
+    comp->ultima_publicacion = ahora;
+    comp->proxima_publicacion = comp->instrucciones + comp->paso_publicacion;
+}
+
+//Ejecuta la máquina en el hilo actual. No vuelve: detener() termina el proceso o,
+//si el salto está armado, vuelve a ejecutar_hasta_parada().
+_Noreturn void ejecutar(struct computador * comp) {
+    maquina_actual = comp;
+    traza_reloj = &comp->reloj.generacion;
+    comp->evento_ciclos = 0;
+    //Con --mmu solo unidad_de_control() sabe abandonar una instrucción a medias: un
+    //fallo de página vuelve aquí y se sigue con la primera del manejador. El setjmp
+    //está fuera de unidad_de_control() porque obliga al compilador a tener en
+    //memoria las variables de la función que lo llama.
+    if (comp->mmu != NULL) {
+        setjmp(comp->mmu->fallo);
+        while (1) {
+            unidad_de_control(comp);
+        }
+    }
+#ifdef JIT_DISPONIBLE
+    if (comp->jit != NULL) {
+        ejecutar_jit(comp);
+    }
+#endif
+#ifdef INTERPRETE_HILADO
+    //El intérprete hilado no pasa por los modelos de tiempo ni por el perfil
+    if (modo_turbo && comp->cache == NULL && comp->segmentado == NULL && comp->precarga == NULL && comp->perfil == NULL) {
+        ejecutar_hilado(comp);
+    }
+#endif
+    while (1) {
+        unidad_de_control(comp);
+    }
+}
+
+//Ejecuta la máquina hasta que se detenga sin terminar el proceso
+enum motivo_parada ejecutar_hasta_parada(struct computador * comp) {
+    comp->salto_activo = 1;
+    if (setjmp(comp->salto) == 0) {
+        ejecutar(comp);
+    }
+    comp->salto_activo = 0;
+    maquina_actual = NULL;
+    return comp->motivo;
+}
+
+//Convierte la máquina comp en el núcleo 0 de una de num núcleos. Los demás
+//empiezan en el PC 0 con los registros a cero, sobre la misma memoria. Con --mmu
+//cada uno tiene la suya, con su TLB y sus registros.
+static int nucleos_crear(struct computador * comp, int num) {
+    struct nucleos * n = calloc(1, sizeof(*n));
+    if (n == NULL) return -1;
+    n->num = num;
+    pthread_mutex_init(&n->bus, NULL);
+    memset(n->es.decodificacion, BUS_NADIE, sizeof(n->es.decodificacion));
+    bus_registrar(&n->es, "GPU", GPU_DATA_ADDR, GPU_STATUS_ADDR, gpu_leer, gpu_escribir);
+    bus_registrar(&n->es, "sistema", SISTEMA_CONTROL_ADDR, SISTEMA_CONTROL_ADDR, sistema_leer, sistema_escribir);
+    n->maquina[0] = comp;
+    comp->nucleos = n;
+    bus_iniciar(comp);
+    for (int i = 1; i < num; i++) {
+        struct computador * c = computador_crear();
+        if (c == NULL) return -1;
+        munmap(c->memoria, 0x10000 * sizeof(int));
+        memoria_alta_destruir(c->alta);
+        c->memoria = comp->memoria;
+        c->alta = comp->alta;
+        c->nucleo = i;
+        c->nucleos = n;
+        if (mmu_config.activa && (c->mmu = mmu_crear(&mmu_config)) == NULL) return -1;
+        bus_iniciar(c);
+        n->maquina[i] = c;
+    }
+    return 0;
+}
+
+//Pide a todos los núcleos que se paren al empezar la siguiente instrucción
+static void nucleos_parar(struct nucleos * n) {
+    atomic_store_explicit(&n->parar, 1, memory_order_release);
+    for (int i = 0; i < n->num; i++) {
+        atomic_store_explicit(&n->maquina[i]->avisos, 1, memory_order_relaxed);
+    }
+}
+
+//Hilo de un núcleo secundario. HALT solo para ese núcleo; cualquier otro motivo
+//para la máquina entera, salvo que ya se estuviera parando.
+static void * nucleo_hilo(void * arg) {
+    struct computador * comp = (struct computador *) arg;
+    struct nucleos * n = comp->nucleos;
+    enum motivo_parada motivo = ejecutar_hasta_parada(comp);
+    if (motivo != PARADA_HALT && motivo != PARADA_NINGUNA && atomic_exchange(&n->fallo, 1) == 0) {
+        n->motivo = motivo;
+        snprintf(n->mensaje, sizeof(n->mensaje), "núcleo %d: %.100s", comp->nucleo, comp->mensaje);
+        nucleos_parar(n);
+    }
+    return NULL;
+}
+
+static int nucleos_arrancar(struct nucleos * n) {
+    for (int i = 1; i < n->num; i++) {
+        if (pthread_create(&n->hilos[i], NULL, nucleo_hilo, n->maquina[i]) != 0) return -1;
+    }
+    return 0;
+}
+
+//Para a los núcleos secundarios cuando se ha detenido el 0
+static void nucleos_detener(struct nucleos * n) {
+    nucleos_parar(n);
+    for (int i = 1; i < n->num; i++) {
+        pthread_join(n->hilos[i], NULL);
+    }
+}
+
+//Informe del perfil. Con el listado del ensamblador (assembler.py -l) agrupa por
+//etiqueta y muestra la línea de código de cada dirección; sin él, desensambla.
+#define PERFIL_FILAS 20
+
+struct perfil_simbolo {
+    char nombre[64];
+    int inicio, fin;
+    unsigned long long ejecuciones, ciclos;
+};
+
+struct perfil_fila {
+    int pc;
+    unsigned long long ejecuciones, ciclos;
+};
+
+static int perfil_por_ciclos(const void * a, const void * b) {
+    unsigned long long ca = ((const struct perfil_fila *)a)->ciclos, cb = ((const struct perfil_fila *)b)->ciclos;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static int perfil_simbolo_por_ciclos(const void * a, const void * b) {
+    unsigned long long ca = ((const struct perfil_simbolo *)a)->ciclos, cb = ((const struct perfil_simbolo *)b)->ciclos;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+//Lee el listado: "# symbols" (nombre, primera y última dirección) y "# lines"
+//(dirección, palabra, línea, fuente). Devuelve el número de símbolos o -1.
+static int perfil_leer_listado(const char * ruta, struct perfil_simbolo ** simbolos, char ** fuente) {
+    FILE * f = fopen(ruta, "r");
+    if (f == NULL) return -1;
+    char linea[512];
+    int seccion = 0, n = 0, capacidad = 0;
+    *simbolos = NULL;
+    while (fgets(linea, sizeof(linea), f)) {
+        linea[strcspn(linea, "\r\n")] = '\0';
+        if (linea[0] == '#') {
+            if (strcmp(linea, "# symbols") == 0) seccion = 1;
+            else if (strcmp(linea, "# lines") == 0) seccion = 2;
+            continue;
+        }
+        unsigned int inicio, fin, palabra;
+        int numero, consumidos = 0;
+        if (seccion == 1) {
+            struct perfil_simbolo s = {0};
+            if (sscanf(linea, "%63s %x %x", s.nombre, &inicio, &fin) != 3 || inicio > fin || fin > 0xFFFF) continue;
+            if (n == capacidad) {
+                capacidad = capacidad ? capacidad * 2 : 64;
+                struct perfil_simbolo * nuevos = realloc(*simbolos, capacidad * sizeof(**simbolos));
+                if (nuevos == NULL) break;
+                *simbolos = nuevos;
+            }
+            s.inicio = (int)inicio;
+            s.fin = (int)fin;
+            (*simbolos)[n++] = s;
+        } else if (seccion == 2) {
+            if (sscanf(linea, "%x %x %d %n", &inicio, &palabra, &numero, &consumidos) < 3 || inicio > 0xFFFF || consumidos == 0) continue;
+            char texto[480];
+            snprintf(texto, sizeof(texto), "%d: %s", numero, linea + consumidos);
+            free(fuente[inicio]);
+            fuente[inicio] = strdup(texto);
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+void perfil_escribir(struct computador * comp, FILE * f, const char * ruta_listado) {
+    struct perfil * p = comp->perfil;
+    if (p == NULL) return;
+#ifdef JIT_DISPONIBLE
+    if (comp->jit) jit_volcar_contadores(comp->jit);
+#endif
+    struct perfil_fila * filas = malloc(0x10000 * sizeof(*filas));
+    char ** fuente = calloc(0x10000, sizeof(*fuente));
+    if (filas == NULL || fuente == NULL) {
+        free(filas);
+        free(fuente);
+        return;
+    }
+    unsigned long long total_ciclos = 0, total_instr = 0;
+    int n = 0;
+    for (int pc = 0; pc < 0x10000; pc++) {
+        if (p->ejecuciones[pc] == 0) continue;
+        filas[n].pc = pc;
+        filas[n].ejecuciones = p->ejecuciones[pc];
+        filas[n].ciclos = p->ciclos[pc];
+        total_ciclos += p->ciclos[pc];
+        total_instr += p->ejecuciones[pc];
+        n++;
+    }
+    qsort(filas, n, sizeof(*filas), perfil_por_ciclos);
+    double total = total_ciclos ? (double)total_ciclos : 1.0;
+
+    struct perfil_simbolo * simbolos = NULL;
+    int num_simbolos = ruta_listado ? perfil_leer_listado(ruta_listado, &simbolos, fuente) : -1;
+    fprintf(f, "[PERFIL] %llu instrucciones, %llu ciclos en %d direcciones\n", total_instr, total_ciclos, n);
+    if (num_simbolos > 0) {
+        for (int i = 0; i < num_simbolos; i++) {
+            for (int pc = simbolos[i].inicio; pc <= simbolos[i].fin; pc++) {
+                simbolos[i].ejecuciones += p->ejecuciones[pc];
+                simbolos[i].ciclos += p->ciclos[pc];
             }
-            break;
-        case 14: // JN
-            printf("[EX] Ejecutando JN\n");
-            if (comp->procesador->flags.n) {
-                comp->procesador->pc = direccion_efectiva;
+        }
+        qsort(simbolos, num_simbolos, sizeof(*simbolos), perfil_simbolo_por_ciclos);
+        fprintf(f, "[PERFIL] Etiquetas (%s):\n", ruta_listado);
+        fprintf(f, "[PERFIL] %7s %14s %14s  %-24s %s\n", "%", "ciclos", "ejecuciones", "etiqueta", "rango");
+        for (int i = 0; i < num_simbolos && i < PERFIL_FILAS && simbolos[i].ciclos > 0; i++) {
+            fprintf(f, "[PERFIL] %6.2f%% %14llu %14llu  %-24s 0x%04X-0x%04X\n", 100.0 * simbolos[i].ciclos / total,
+                simbolos[i].ciclos, simbolos[i].ejecuciones, simbolos[i].nombre, simbolos[i].inicio, simbolos[i].fin);
+        }
+    } else if (ruta_listado != NULL && num_simbolos < 0) {
+        fprintf(f, "[PERFIL] Sin listado (%s): se desensambla\n", ruta_listado);
+    }
+    fprintf(f, "[PERFIL] Direcciones:\n");
+    fprintf(f, "[PERFIL] %7s %14s %14s  %-6s %s\n", "%", "ciclos", "ejecuciones", "PC", "código");
+    for (int i = 0; i < n && i < PERFIL_FILAS; i++) {
+        int pc = filas[i].pc;
+        char codigo[96];
+        if (fuente[pc] != NULL) {
+            snprintf(codigo, sizeof(codigo), "%s", fuente[pc]);
+        } else {
+            int instr = comp->memoria[pc];
+            int opcode = (instr >> 24) & 0xFF, modo = (instr >> 16) & 0x0F;
+            snprintf(codigo, sizeof(codigo), "%s %s 0x%04X", opcode < NUM_OPERACIONES ? operaciones[opcode] : "?",
+                modo < 4 ? modos_direccionamiento[modo] : "?", instr & 0xFFFF);
+        }
+        fprintf(f, "[PERFIL] %6.2f%% %14llu %14llu  0x%04X %s\n", 100.0 * filas[i].ciclos / total, filas[i].ciclos, filas[i].ejecuciones, pc, codigo);
+    }
+    for (int pc = 0; pc < 0x10000; pc++) free(fuente[pc]);
+    free(fuente);
+    free(simbolos);
+    free(filas);
+}
+
+//Rendimiento conseguido, se imprime al salir (HALT, error o fin del programa)
+static struct computador * comp_informe = NULL;
+static struct timespec inicio_ejecucion;
+
+static double segundos_desde(const struct timespec * inicio) {
+    struct timespec fin;
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+    return (fin.tv_sec - inicio->tv_sec) + (fin.tv_nsec - inicio->tv_nsec) / 1e9;
+}
+
+static double porcentaje(unsigned long long parte, unsigned long long total) {
+    return total ? 100.0 * (double)parte / (double)total : 0.0;
+}
+
+void informe_rendimiento(void) {
+    if (comp_informe == NULL) return;
+    double segundos = segundos_desde(&inicio_ejecucion);
+    if (segundos <= 0) segundos = 1e-9;
+    printf("[STATS] Modo: %s\n", modo_turbo ? "turbo" : "reloj");
+    printf("[STATS] Instrucciones: %llu, ciclos: %llu, tiempo: %.6f s\n", comp_informe->instrucciones, comp_informe->ciclos, segundos);
+    printf("[STATS] %.0f instrucciones/s, %.0f ciclos emulados/s\n", comp_informe->instrucciones / segundos, comp_informe->ciclos / segundos);
+    if (modo_turbo) {
+        printf("[STATS] Caché de instrucciones: %llu aciertos, %llu fallos\n", comp_informe->cache_instr_aciertos, comp_informe->cache_instr_fallos);
+    }
+#ifdef JIT_DISPONIBLE
+    struct jit * j = comp_informe->jit;
+    if (j != NULL) {
+        printf("[STATS] JIT: %llu bloques traducidos, %llu entradas, %llu salidas lentas, %llu instrucciones interpretadas, %llu vaciados\n",
+            j->traducidos, j->entradas, j->salidas_lentas, j->interpretadas, j->vaciados);
+    }
+#endif
+    struct estadisticas e;
+    memset(&e, 0, sizeof(e));
+    estadisticas_calcular(comp_informe, &e);
+    double flancos = (double)(e.ciclos_busqueda + e.ciclos_operando + e.ciclos_ejecucion);
+    if (flancos > 0) {
+        printf("[STATS] Ciclos: búsqueda %.1f%%, operando %.1f%%, ejecución %.1f%%; bus ocupado %.1f%%, inhibido %llu flancos\n",
+            100.0 * e.ciclos_busqueda / flancos, 100.0 * e.ciclos_operando / flancos, 100.0 * e.ciclos_ejecucion / flancos,
+            100.0 * e.transacciones / flancos, (unsigned long long)e.ciclos_bus_inhibido);
+    }
+    if (comp_informe->dma.transferencias > 0) {
+        printf("[STATS] DMA: %llu transferencias, %llu palabras (%llu a la GPU)\n",
+            comp_informe->dma.transferencias, comp_informe->dma.palabras, comp_informe->dma.palabras_gpu);
+    }
+    unsigned int paginas_altas = atomic_load(&comp_informe->alta->paginas);
+    if (paginas_altas > 0) {
+        printf("[STATS] Memoria por encima de 0xFFFF: %u páginas de %u palabras\n", paginas_altas, MEMORIA_PAGINA);
+    }
+    if (comp_informe->interrupciones > 0 || comp_informe->ciclos_espera > 0) {
+        printf("[STATS] Interrupciones: %llu, flancos en WAIT: %llu\n", comp_informe->interrupciones, comp_informe->ciclos_espera);
+    }
+    struct cache * c = comp_informe->cache;
+    if (c != NULL) {
+        printf("[STATS] Caché de memoria (%d palabras, %d vías, líneas de %d, %s): instrucciones %.1f%% aciertos (%llu/%llu), datos %.1f%% (%llu/%llu)\n",
+            c->config.palabras, c->config.vias, c->config.linea, c->config.post_escritura ? "wb" : "wt",
+            porcentaje(c->aciertos[0], c->aciertos[0] + c->fallos[0]), c->aciertos[0], c->aciertos[0] + c->fallos[0],
+            porcentaje(c->aciertos[1], c->aciertos[1] + c->fallos[1]), c->aciertos[1], c->aciertos[1] + c->fallos[1]);
+        printf("[STATS] Caché de memoria: %llu escrituras a memoria, %llu flancos de espera (%.1f%% de los ciclos)\n",
+            c->escrituras_memoria, c->ciclos, porcentaje(c->ciclos, comp_informe->ciclos));
+    }
+    struct segmentado * s = comp_informe->segmentado;
+    if (s != NULL && s->ciclos > 0) {
+        //Sin cauce una instrucción ocupa sus flancos; un ciclo del cauce son los de una transacción
+        double ciclos_secuenciales = (double)s->flancos_secuenciales / CICLOS_ACCESO_MEMORIA;
+        unsigned long long paradas = 0;
+        for (int i = 0; i < SEG_NUM_CAUSAS; i++) {
+            paradas += s->paradas[i];
+        }
+        printf("[STATS] Cauce segmentado (%s adelantamiento): %llu ciclos, IPC %.3f frente a %.3f sin cauce (%.2fx), %llu vaciados\n",
+            s->adelanto ? "con" : "sin", s->ciclos, (double)s->instrucciones / s->ciclos,
+            ciclos_secuenciales > 0 ? s->instrucciones / ciclos_secuenciales : 0.0, ciclos_secuenciales / s->ciclos, s->vaciados);
+        printf("[STATS] Cauce segmentado: %llu ciclos de parada (%.1f%%): bus %llu, datos %llu, memoria %llu, control %llu\n",
+            paradas, porcentaje(paradas, s->ciclos), s->paradas[SEG_BUS], s->paradas[SEG_DATOS], s->paradas[SEG_MEMORIA], s->paradas[SEG_CONTROL]);
+    }
+    struct precarga * p = comp_informe->precarga;
+    if (p != NULL) {
+        printf("[STATS] Precarga (cola de %d, predictor %s de %d entradas): %.1f%% búsquedas desde la cola (%llu/%llu), %llu palabras precargadas\n",
+            p->config.cola, nombres_predictor[p->config.predictor], p->config.entradas,
+            porcentaje(p->aciertos, p->aciertos + p->fallos), p->aciertos, p->aciertos + p->fallos, p->palabras);
+        printf("[STATS] Precarga: saltos predichos %.1f%% (%llu/%llu), %llu flancos ahorrados (%.1f%% de los ciclos)\n",
+            porcentaje(p->saltos_acertados, p->saltos), p->saltos_acertados, p->saltos,
+            p->flancos_ahorrados, porcentaje(p->flancos_ahorrados, comp_informe->ciclos));
+    }
+    struct mmu * m = comp_informe->mmu;
+    if (m != NULL) {
+        printf("[STATS] TLB (%d entradas, %d vías, %s): instrucciones %.1f%% aciertos (%llu/%llu), datos %.1f%% (%llu/%llu)\n",
+            m->config.entradas, m->config.vias, nombres_reemplazo[m->config.reemplazo],
+            porcentaje(m->aciertos[0], m->aciertos[0] + m->fallos_tlb[0]), m->aciertos[0], m->aciertos[0] + m->fallos_tlb[0],
+            porcentaje(m->aciertos[1], m->aciertos[1] + m->fallos_tlb[1]), m->aciertos[1], m->aciertos[1] + m->fallos_tlb[1]);
+        printf("[STATS] MMU: %llu fallos de página, %llu vaciados del TLB, %llu flancos recorriendo la tabla (%.1f%% de los ciclos)\n",
+            m->fallos_pagina, m->vaciados, m->ciclos, porcentaje(m->ciclos, comp_informe->ciclos));
+    }
+    struct nucleos * n = comp_informe->nucleos;
+    if (n != NULL) {
+        for (int i = 0; i < n->num; i++) {
+            printf("[STATS] Núcleo %d: %llu instrucciones, %llu ciclos\n", i, n->maquina[i]->instrucciones, n->maquina[i]->ciclos);
+        }
+        unsigned long long arbitrajes = atomic_load(&n->arbitrajes), esperas = atomic_load(&n->esperas);
+        printf("[STATS] Bus compartido: %llu arbitrajes, %llu con espera (%.1f%%)\n", arbitrajes, esperas, porcentaje(esperas, arbitrajes));
+    }
+    //Última publicación para quien esté mirando la página compartida
+    estadisticas_publicar(comp_informe);
+}
+
+//Perfil por PC (--perfil FICHERO, "-" es stderr) y listado con el que se simboliza
+static const char * ruta_perfil = NULL;
+static char ruta_listado[PATH_MAX];
+
+static void perfil_guardar(struct computador * comp) {
+    if (ruta_perfil == NULL || comp == NULL) return;
+    FILE * f = strcmp(ruta_perfil, "-") == 0 ? stderr : fopen(ruta_perfil, "w");
+    if (f == NULL) {
+        perror(ruta_perfil);
+        return;
+    }
+    perfil_escribir(comp, f, ruta_listado[0] ? ruta_listado : NULL);
+    if (f != stderr) fclose(f);
+}
+
+static void perfil_al_salir(void) {
+    perfil_guardar(comp_informe);
+}
+
+//Presupuestos de ejecución (--max-instr, --max-ciclos), iguales para todas las máquinas
+static unsigned long long max_instrucciones = ULLONG_MAX;
+static unsigned long long max_ciclos = ULLONG_MAX;
+
+//Ejecución por lotes (--lote): muchas ROMs en el mismo proceso, repartidas entre
+//un grupo fijo de hilos. Cada ejecución es una máquina independiente en modo turbo
+//con el teclado leído de un fichero y la salida de la GPU guardada (o descartada).
+struct trabajo_lote {
+    char * rom;
+    char * entrada; // NULL: el teclado no tiene datos
+    enum motivo_parada motivo;
+    char mensaje[128];
+    unsigned long long instrucciones;
+    unsigned long long ciclos;
+    unsigned long long bytes_salida;
+    double segundos;
+};
+
+struct lote {
+    struct trabajo_lote * trabajos;
+    int num;
+    atomic_int siguiente;
+    const char * dir_salida;
+};
+
+//Lee un fichero entero en memoria ("-" es la entrada estándar)
+static char * leer_fichero(const char * ruta, size_t * tam) {
+    FILE * f = strcmp(ruta, "-") == 0 ? stdin : fopen(ruta, "rb");
+    if (f == NULL) return NULL;
+    size_t capacidad = 4096, usado = 0;
+    char * datos = malloc(capacidad);
+    while (datos != NULL) {
+        usado += fread(datos + usado, 1, capacidad - usado, f);
+        if (usado < capacidad) break;
+        capacidad *= 2;
+        char * nuevo = realloc(datos, capacidad);
+        if (nuevo == NULL) {
+            free(datos);
+            datos = NULL;
+        } else {
+            datos = nuevo;
+        }
+    }
+    if (f != stdin) fclose(f);
+    *tam = usado;
+    return datos;
+}
+
+//Cada línea de la lista es "rom [entrada]"; lo que sigue a '#' es comentario
+static int lote_leer_lista(struct lote * l, const char * ruta) {
+    FILE * f = fopen(ruta, "r");
+    if (f == NULL) {
+        perror(ruta);
+        return -1;
+    }
+    char linea[4096];
+    int capacidad = 0;
+    while (fgets(linea, sizeof(linea), f) != NULL) {
+        char * comentario = strchr(linea, '#');
+        if (comentario) *comentario = '\0';
+        char * resto = NULL;
+        char * rom = strtok_r(linea, " \t\r\n", &resto);
+        if (rom == NULL) continue;
+        char * entrada = strtok_r(NULL, " \t\r\n", &resto);
+        if (l->num == capacidad) {
+            capacidad = capacidad ? capacidad * 2 : 64;
+            struct trabajo_lote * nuevos = realloc(l->trabajos, capacidad * sizeof(*nuevos));
+            if (nuevos == NULL) {
+                perror("realloc");
+                fclose(f);
+                return -1;
             }
-            break;
-        case 15: // CLR
-            printf("[EX] Ejecutando CLR\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_SUB, comp->procesador->registros[reg], comp->procesador->registros[reg]);
-            break;
-        case 16: // NOP
-            printf("[EX] Ejecutando NOP\n");
-            //No hacer nada
-            break;
-        case 17: // DEC
-            printf("[EX] Ejecutando DEC\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_SUB, comp->procesador->registros[reg], 1);
-            break;
-        case 18: // INC
-            printf("[EX] Ejecutando INC\n");
-            comp->procesador->registros[reg] = alu_operation(comp->procesador, ALU_MODE_ARITHMETHIC, ALU_OP_ADD, comp->procesador->registros[reg], 1);
-            break;
-        case 19: // HALT
-            printf("[EX] Ejecutando HALT\n");
-            printf("Ejecución detenida por instrucción HALT.\n");
-            exit(0);
-            break;
-        default:
-            error("Código de operación inválido");
-            break;
+            l->trabajos = nuevos;
+        }
+        struct trabajo_lote * t = &l->trabajos[l->num++];
+        memset(t, 0, sizeof(*t));
+        t->rom = strdup(rom);
+        t->entrada = entrada ? strdup(entrada) : NULL;
+    }
+    fclose(f);
+    return 0;
+}
+
+static void lote_ejecutar(struct lote * l, int indice) {
+    struct trabajo_lote * t = &l->trabajos[indice];
+    struct computador * comp = computador_crear();
+    char * entrada = NULL;
+    FILE * salida = NULL;
+    t->motivo = PARADA_ERROR;
+    if (comp == NULL) {
+        snprintf(t->mensaje, sizeof(t->mensaje), "Sin memoria para la máquina");
+        return;
+    }
+    //Antes de restaurar: la instantánea puede traer los registros de la MMU
+    if (mmu_config.activa) {
+        if ((comp->mmu = mmu_crear(&mmu_config)) == NULL) {
+            snprintf(t->mensaje, sizeof(t->mensaje), "No se pudo crear la MMU");
+            goto fin;
+        }
+        bus_iniciar(comp);
+    }
+    //La ROM también puede ser una instantánea: se restaura en lugar de cargarla
+    int restaurada = snapshot_restaurar(comp, t->rom);
+    int rom = restaurada > 0 ? cargar_rom(comp, t->rom) : 0;
+    if (restaurada < 0 || rom == -1) {
+        snprintf(t->mensaje, sizeof(t->mensaje), "No se pudo abrir la ROM");
+        goto fin;
+    }
+    if (rom == -2) {
+        snprintf(t->mensaje, sizeof(t->mensaje), "Tabla de segmentos de la ROM no válida");
+        goto fin;
+    }
+    if (t->entrada != NULL) {
+        entrada = leer_fichero(t->entrada, &comp->entrada_tam);
+        if (entrada == NULL) {
+            snprintf(t->mensaje, sizeof(t->mensaje), "No se pudo leer la entrada");
+            goto fin;
+        }
+        comp->entrada = entrada;
+    }
+    char ruta_snapshot[PATH_MAX];
+    if (l->dir_salida != NULL) {
+        snprintf(ruta_snapshot, sizeof(ruta_snapshot), "%s/%04d.snap", l->dir_salida, indice);
+        comp->ruta_snapshot = ruta_snapshot;
+        char ruta[PATH_MAX];
+        snprintf(ruta, sizeof(ruta), "%s/%04d.out", l->dir_salida, indice);
+        salida = fopen(ruta, "wb");
+        if (salida == NULL) {
+            snprintf(t->mensaje, sizeof(t->mensaje), "No se pudo crear %.100s", ruta);
+            goto fin;
+        }
+        comp->salida = salida;
+    }
+    comp->limite_instrucciones = max_instrucciones;
+    comp->limite_ciclos = max_ciclos;
+    if (cache_config.activa && (comp->cache = cache_crear(&cache_config)) == NULL) {
+        snprintf(t->mensaje, sizeof(t->mensaje), "No se pudo crear la caché");
+        goto fin;
+    }
+    if (usar_segmentado && (comp->segmentado = segmentado_crear(segmentado_adelanto)) == NULL) {
+        snprintf(t->mensaje, sizeof(t->mensaje), "No se pudo crear el modelo segmentado");
+        goto fin;
+    }
+    if (precarga_config.activa && (comp->precarga = precarga_crear(&precarga_config)) == NULL) {
+        snprintf(t->mensaje, sizeof(t->mensaje), "No se pudo crear la cola de precarga");
+        goto fin;
+    }
+#ifdef JIT_DISPONIBLE
+    if (usar_jit && jit_iniciar(comp) != 0) {
+        snprintf(t->mensaje, sizeof(t->mensaje), "No se pudo iniciar el JIT");
+        goto fin;
+    }
+#endif
+    struct timespec inicio;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+    t->motivo = ejecutar_hasta_parada(comp);
+    t->segundos = segundos_desde(&inicio);
+    memcpy(t->mensaje, comp->mensaje, sizeof(t->mensaje));
+    t->instrucciones = comp->instrucciones;
+    t->ciclos = comp->ciclos;
+    t->bytes_salida = comp->bytes_salida;
+fin:
+    if (salida) fclose(salida);
+    free(entrada);
+    computador_destruir(comp);
+}
+
+static void * trabajador_lote(void * arg) {
+    struct lote * l = (struct lote *) arg;
+    while (1) {
+        int indice = atomic_fetch_add(&l->siguiente, 1);
+        if (indice >= l->num) break;
+        lote_ejecutar(l, indice);
     }
+    return NULL;
+}
 
-    CLOCK_SYNC();
-    CLOCK_SYNC();
+static void csv_campo(FILE * f, const char * s) {
+    fputc('"', f);
+    for (; s && *s; s++) {
+        if (*s == '"') fputc('"', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
 
-#ifdef step_by_step
-    getchar();
+static void json_cadena(FILE * f, const char * s) {
+    if (s == NULL) {
+        fputs("null", f);
+        return;
+    }
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+            fputc(*s, f);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void lote_resultados(const struct lote * l, FILE * f, int json) {
+    if (json) fprintf(f, "[\n");
+    else fprintf(f, "rom,entrada,motivo,mensaje,instrucciones,ciclos,tiempo_s,bytes_salida\n");
+    for (int i = 0; i < l->num; i++) {
+        const struct trabajo_lote * t = &l->trabajos[i];
+        if (json) {
+            fprintf(f, "  {\"rom\": ");
+            json_cadena(f, t->rom);
+            fprintf(f, ", \"entrada\": ");
+            json_cadena(f, t->entrada);
+            fprintf(f, ", \"motivo\": \"%s\", \"mensaje\": ", nombres_parada[t->motivo]);
+            json_cadena(f, t->mensaje);
+            fprintf(f, ", \"instrucciones\": %llu, \"ciclos\": %llu, \"tiempo_s\": %.6f, \"bytes_salida\": %llu}%s\n",
+                t->instrucciones, t->ciclos, t->segundos, t->bytes_salida, i + 1 < l->num ? "," : "");
+        } else {
+            csv_campo(f, t->rom);
+            fputc(',', f);
+            csv_campo(f, t->entrada);
+            fprintf(f, ",%s,", nombres_parada[t->motivo]);
+            csv_campo(f, t->mensaje);
+            fprintf(f, ",%llu,%llu,%.6f,%llu\n", t->instrucciones, t->ciclos, t->segundos, t->bytes_salida);
+        }
+    }
+    if (json) fprintf(f, "]\n");
+    fflush(f);
+}
+
+int ejecutar_lote(const char * lista, int hilos, int json, const char * dir_salida) {
+    struct lote l;
+    memset(&l, 0, sizeof(l));
+    atomic_init(&l.siguiente, 0);
+    l.dir_salida = dir_salida;
+    if (lote_leer_lista(&l, lista) != 0) return 1;
+    if (hilos <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        hilos = cpus > 0 ? (int)cpus : 1;
+    }
+    if (hilos > l.num) hilos = l.num > 0 ? l.num : 1;
+
+    struct timespec inicio;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+    pthread_t * trabajadores = calloc(hilos, sizeof(pthread_t));
+    if (trabajadores == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < hilos; i++) {
+        pthread_create(&trabajadores[i], NULL, trabajador_lote, &l);
+    }
+    for (int i = 0; i < hilos; i++) {
+        pthread_join(trabajadores[i], NULL);
+    }
+    double segundos = segundos_desde(&inicio);
+
+    lote_resultados(&l, stdout, json);
+    fprintf(stderr, "[LOTE] %d ejecuciones en %d hilos, %.3f s\n", l.num, hilos, segundos);
+    for (int i = 0; i < l.num; i++) {
+        free(l.trabajos[i].rom);
+        free(l.trabajos[i].entrada);
+    }
+    free(l.trabajos);
+    free(trabajadores);
+    return 0;
+}
+
+//Estado final de una ejecución sin terminal, en JSON
+static void escribir_estado(FILE * f, const struct computador * comp) {
+    fprintf(f, "{\"motivo\": \"%s\", \"codigo\": %d, \"mensaje\": ", nombres_parada[comp->motivo], codigos_salida[comp->motivo]);
+    json_cadena(f, comp->mensaje);
+    fprintf(f, ", \"instrucciones\": %llu, \"ciclos\": %llu, \"bytes_salida\": %llu, \"interrupciones\": %llu, \"paginas_altas\": %u",
+        comp->instrucciones, comp->ciclos, comp->bytes_salida, comp->interrupciones, atomic_load(&comp->alta->paginas));
+    const struct cache * c = comp->cache;
+    if (c != NULL) {
+        fprintf(f, ", \"cache\": {\"instr_aciertos\": %llu, \"instr_fallos\": %llu, \"datos_aciertos\": %llu, \"datos_fallos\": %llu, \"escrituras_memoria\": %llu, \"ciclos\": %llu}",
+            c->aciertos[0], c->fallos[0], c->aciertos[1], c->fallos[1], c->escrituras_memoria, c->ciclos);
+    }
+    const struct segmentado * s = comp->segmentado;
+    if (s != NULL) {
+        fprintf(f, ", \"segmentado\": {\"adelanto\": %d, \"ciclos\": %llu, \"ipc\": %.4f, \"vaciados\": %llu, \"paradas\": {",
+            s->adelanto, s->ciclos, s->ciclos ? (double)s->instrucciones / s->ciclos : 0.0, s->vaciados);
+        for (int i = 0; i < SEG_NUM_CAUSAS; i++) {
+            fprintf(f, "%s\"%s\": %llu", i ? ", " : "", nombres_seg_causa[i], s->paradas[i]);
+        }
+        fprintf(f, "}}");
+    }
+    const struct precarga * p = comp->precarga;
+    if (p != NULL) {
+        fprintf(f, ", \"precarga\": {\"predictor\": \"%s\", \"aciertos\": %llu, \"fallos\": %llu, \"palabras\": %llu, \"saltos\": %llu, \"saltos_acertados\": %llu, \"flancos_ahorrados\": %llu}",
+            nombres_predictor[p->config.predictor], p->aciertos, p->fallos, p->palabras, p->saltos, p->saltos_acertados, p->flancos_ahorrados);
+    }
+    const struct mmu * m = comp->mmu;
+    if (m != NULL) {
+        fprintf(f, ", \"mmu\": {\"reemplazo\": \"%s\", \"instr_aciertos\": %llu, \"instr_fallos\": %llu, \"datos_aciertos\": %llu, \"datos_fallos\": %llu, \"fallos_pagina\": %llu, \"vaciados\": %llu, \"ciclos\": %llu}",
+            nombres_reemplazo[m->config.reemplazo], m->aciertos[0], m->fallos_tlb[0], m->aciertos[1], m->fallos_tlb[1], m->fallos_pagina, m->vaciados, m->ciclos);
+    }
+    const struct nucleos * n = comp->nucleos;
+    if (n != NULL) {
+        fprintf(f, ", \"nucleos\": {\"arbitrajes\": %llu, \"esperas\": %llu, \"por_nucleo\": [",
+            (unsigned long long)atomic_load(&n->arbitrajes), (unsigned long long)atomic_load(&n->esperas));
+        for (int i = 0; i < n->num; i++) {
+            const struct computador * c = n->maquina[i];
+            fprintf(f, "%s{\"motivo\": \"%s\", \"instrucciones\": %llu, \"ciclos\": %llu, \"pc\": %d}",
+                i ? ", " : "", nombres_parada[c->motivo], c->instrucciones, c->ciclos, c->cpu.pc);
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, ", \"pc\": %d, \"x\": %d, \"acc\": %d, \"z\": %d, \"n\": %d, \"c\": %d, \"v\": %d, \"ie\": %d}\n",
+        comp->cpu.pc, comp->cpu.registros[0], comp->cpu.registros[1],
+        comp->cpu.flags.z & 1, comp->cpu.flags.n & 1, comp->cpu.flags.c & 1, comp->cpu.flags.v & 1, comp->cpu.flags.ie & 1);
+    fflush(f);
+}
+
+#ifdef JIT_DISPONIBLE
+//Con --jit: si lo pedido no se puede hacer con código traducido, lo avisa y
+//devuelve 0. --lote no tiene trazas ni varios núcleos.
+static int jit_compatible(int num_nucleos, int nivel_traza, FILE * avisos) {
+    const char * motivo = NULL;
+    if (num_nucleos > 1) {
+        motivo = "el código traducido no admite varios núcleos";
+    } else if (nivel_traza > TRAZA_NIVEL_NADA) {
+        motivo = "el código traducido no emite trazas";
+    } else if (cache_config.activa) {
+        motivo = "el código traducido no pasa por el modelo de caché";
+    } else if (usar_segmentado) {
+        motivo = "el código traducido no pasa por el modelo segmentado";
+    } else if (precarga_config.activa) {
+        motivo = "el código traducido no pasa por la cola de precarga";
+    } else if (mmu_config.activa) {
+        motivo = "el código traducido no pasa por la MMU";
+    }
+    if (motivo == NULL) return 1;
+    fprintf(avisos, "Advertencia: %s, se desactiva el JIT\n", motivo);
+    return 0;
+}
 #endif
-    // En algunas arquitecturas aquí van los pasos de memoria y write-back, nosotros ya los hicimos en la ejecución directamente
+
+void uso(const char * programa) {
+    printf("Uso: %s [opciones] [rom.bin]\n", programa);
+    printf("  -t, --turbo               Ejecutar sin reloj real, tan rápido como permita el host\n");
+    printf("  -g, --giros N             Iteraciones de espera activa antes de dormir hasta el siguiente flanco (defecto: 0)\n");
+    printf("  -j, --jit                 Modo turbo con traducción de bloques básicos a x86-64\n");
+    printf("      --jit-verificar       Como --jit, pero comprueba cada bloque contra el intérprete\n");
+    printf("  -v, --traza N             Nivel de traza: 0 nada, 1 instrucciones, 2 detalle, 3 todo (defecto: 0, máximo compilado: %d)\n", TRAZA_NIVEL_MAX);
+    printf("      --traza-cat LISTA     Categorías a trazar: cpu,alu,mem,gpu,kbd,dma o todas (defecto: todas)\n");
+    printf("      --traza-bin FICHERO   Guardar las trazas en binario en lugar de imprimirlas\n");
+    printf("      --decodificar-traza FICHERO  Imprimir un fichero de trazas binario y salir\n");
+    printf("      --lote LISTA          Ejecutar en modo turbo las ROMs de LISTA (una por línea: rom [entrada])\n");
+    printf("      --hilos N             Hilos para --lote (defecto: núcleos del host)\n");
+    printf("      --formato csv|json    Formato de los resultados de --lote (defecto: csv)\n");
+    printf("      --dir-salida DIR      Guardar la salida de la GPU de cada ejecución de --lote en DIR/NNNN.out\n");
+    printf("      --sin-terminal        Ejecutar en modo turbo sin terminal ni memoria compartida\n");
+    printf("      --entrada FICHERO     Datos del teclado sin terminal (- para la entrada estándar; implica --sin-terminal)\n");
+    printf("      --salida FICHERO      Salida de la GPU sin terminal (defecto: - , la salida estándar; implica --sin-terminal)\n");
+    printf("      --estado FICHERO      Escribir el estado final sin terminal en JSON (defecto: salida de error)\n");
+    printf("      --cache CONFIG        Modelo de caché de memoria, p. ej. tam=256,vias=2,linea=4,escritura=wb|wt,acierto=2,fallo=10\n");
+    printf("      --segmentado          Calcular además el tiempo en un cauce IF/ID/OF/EX/WB con adelantamiento\n");
+    printf("      --segmentado-sin-adelanto  Como --segmentado, pero sin adelantamiento de resultados\n");
+    printf("      --precarga CONFIG     Modelo de cola de precarga de instrucciones, p. ej. cola=4,predictor=estatico|bimodal|btb,entradas=64\n");
+    printf("      --mmu CONFIG          MMU con paginación y TLB, p. ej. tlb=16,vias=4,reemplazo=lru|fifo|aleatorio\n");
+    printf("      --nucleos N           Núcleos que comparten la memoria, cada uno en su hilo (implica modo turbo, máximo %d)\n", NUCLEOS_MAX);
+    printf("      --max-instr N         Detener la máquina tras N instrucciones\n");
+    printf("      --max-ciclos N        Detener la máquina al empezar una instrucción con N ciclos o más\n");
+    printf("      --snapshot FICHERO    Dónde guardar las instantáneas pedidas con SIGUSR1 o desde el programa (defecto: asoc.snap)\n");
+    printf("      --restaurar FICHERO   Arrancar desde una instantánea en lugar de la ROM\n");
+    printf("      --perfil FICHERO      Contar ejecuciones y ciclos por PC y escribir al salir las etiquetas y líneas más calientes (- para la salida de error)\n");
+    printf("      --simbolos FICHERO    Listado de assembler.py -l para el perfil (defecto: la ROM con extensión .lst)\n");
 }
 
-int main() {
-    // Crear hilos para reloj, GPU, teclado, memoria
-    pthread_t clock_thread, gpu_thread, teclado_thread, memoria_thread;
+int main(int argc, char * argv[]) {
+    const char * ruta_rom = ROM_FILE;
+    int nivel_traza = TRAZA_NIVEL_NADA;
+    uint32_t categorias_traza = TRAZA_TODAS;
+    const char * lista_lote = NULL;
+    const char * dir_salida = NULL;
+    int hilos_lote = 0;
+    int formato_json = 0;
+    int sin_terminal = 0;
+    const char * ruta_entrada = NULL;
+    const char * ruta_salida = "-";
+    const char * ruta_estado = NULL;
+    const char * ruta_snapshot = "asoc.snap";
+    const char * ruta_restaurar = NULL;
+    int num_nucleos = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--turbo") == 0) {
+            modo_turbo = 1;
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jit") == 0 || strcmp(argv[i], "--jit-verificar") == 0) {
+#ifdef JIT_DISPONIBLE
+            modo_turbo = 1;
+            usar_jit = 1;
+            jit_verificar = strcmp(argv[i], "--jit-verificar") == 0;
+#else
+            printf("Advertencia: JIT no disponible en esta arquitectura, se usa el intérprete\n");
+            modo_turbo = 1;
+#endif
+        } else if ((strcmp(argv[i], "-g") == 0 || strcmp(argv[i], "--giros") == 0) && i + 1 < argc) {
+            reloj_giros = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--traza") == 0) && i + 1 < argc) {
+            nivel_traza = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--traza-cat") == 0 && i + 1 < argc) {
+            if (traza_parsear_categorias(argv[++i], &categorias_traza) != 0) {
+                fprintf(stderr, "--traza-cat %s: categoría desconocida (cpu, alu, mem, gpu, kbd, dma o todas)\n", argv[i]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--traza-bin") == 0 && i + 1 < argc) {
+            if (traza_abrir_binaria(argv[++i]) != 0) return 1;
+        } else if (strcmp(argv[i], "--decodificar-traza") == 0 && i + 1 < argc) {
+            return traza_decodificar(argv[++i]);
+        } else if (strcmp(argv[i], "--lote") == 0 && i + 1 < argc) {
+            lista_lote = argv[++i];
+        } else if (strcmp(argv[i], "--hilos") == 0 && i + 1 < argc) {
+            hilos_lote = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--formato") == 0 && i + 1 < argc) {
+            formato_json = strcmp(argv[++i], "json") == 0;
+        } else if (strcmp(argv[i], "--dir-salida") == 0 && i + 1 < argc) {
+            dir_salida = argv[++i];
+        } else if (strcmp(argv[i], "--sin-terminal") == 0) {
+            sin_terminal = 1;
+        } else if (strcmp(argv[i], "--entrada") == 0 && i + 1 < argc) {
+            ruta_entrada = argv[++i];
+            sin_terminal = 1;
+        } else if (strcmp(argv[i], "--salida") == 0 && i + 1 < argc) {
+            ruta_salida = argv[++i];
+            sin_terminal = 1;
+        } else if (strcmp(argv[i], "--estado") == 0 && i + 1 < argc) {
+            ruta_estado = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            ruta_snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--restaurar") == 0 && i + 1 < argc) {
+            ruta_restaurar = argv[++i];
+        } else if (strcmp(argv[i], "--perfil") == 0 && i + 1 < argc) {
+            ruta_perfil = argv[++i];
+        } else if (strcmp(argv[i], "--simbolos") == 0 && i + 1 < argc) {
+            snprintf(ruta_listado, sizeof(ruta_listado), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            if (cache_parsear(argv[++i], &cache_config) != 0) {
+                fprintf(stderr, "--cache %s: configuración no válida\n", argv[i]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--segmentado") == 0 || strcmp(argv[i], "--segmentado-sin-adelanto") == 0) {
+            usar_segmentado = 1;
+            segmentado_adelanto = strcmp(argv[i], "--segmentado") == 0;
+        } else if (strcmp(argv[i], "--precarga") == 0 && i + 1 < argc) {
+            if (precarga_parsear(argv[++i], &precarga_config) != 0) {
+                fprintf(stderr, "--precarga %s: configuración no válida\n", argv[i]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--mmu") == 0 && i + 1 < argc) {
+            if (mmu_parsear(argv[++i], &mmu_config) != 0) {
+                fprintf(stderr, "--mmu %s: configuración no válida\n", argv[i]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--nucleos") == 0 && i + 1 < argc) {
+            num_nucleos = atoi(argv[++i]);
+            if (num_nucleos < 1 || num_nucleos > NUCLEOS_MAX) {
+                fprintf(stderr, "--nucleos %s: debe estar entre 1 y %d\n", argv[i], NUCLEOS_MAX);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--max-instr") == 0 && i + 1 < argc) {
+            max_instrucciones = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--max-ciclos") == 0 && i + 1 < argc) {
+            max_ciclos = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            uso(argv[0]);
+            return 0;
+        } else if (argv[i][0] == '-') {
+            uso(argv[0]);
+            return 2;
+        } else {
+            ruta_rom = argv[i];
+        }
+    }
+
+    //La cola de precarga lee las instrucciones por la dirección del PC
+    if (precarga_config.activa && mmu_config.activa) {
+        fprintf(stderr, "Advertencia: la cola de precarga no traduce direcciones, se desactiva con --mmu\n");
+        precarga_config.activa = 0;
+    }
+
+    if (lista_lote != NULL) {
+        //Las trazas de varias máquinas a la vez no se pueden distinguir
+        if (nivel_traza > TRAZA_NIVEL_NADA) {
+            fprintf(stderr, "Advertencia: --lote no admite trazas, se desactivan\n");
+        }
+        if (ruta_perfil != NULL) {
+            fprintf(stderr, "Advertencia: --lote no admite --perfil, se ignora\n");
+        }
+        if (num_nucleos > 1) {
+            fprintf(stderr, "Advertencia: --lote no admite --nucleos, cada ROM usa un núcleo\n");
+        }
+#ifdef JIT_DISPONIBLE
+        usar_jit = usar_jit && jit_compatible(1, TRAZA_NIVEL_NADA, stderr);
+#endif
+        modo_turbo = 1;
+        return ejecutar_lote(lista_lote, hilos_lote, formato_json, dir_salida);
+    }
+
+    //Los núcleos avanzan cada uno a su ritmo: no hay un reloj común
+    if (num_nucleos > 1) {
+        modo_turbo = 1;
+        if (ruta_restaurar != NULL) {
+            fprintf(stderr, "--restaurar no admite --nucleos: las instantáneas son de un solo núcleo\n");
+            return 2;
+        }
+    }
 
-    struct io_channel io_channel;
-    atomic_int direccion_bus = ATOMIC_VAR_INIT(0);
-    atomic_int datos_bus = ATOMIC_VAR_INIT(0);
-    atomic_int control_bus = ATOMIC_VAR_INIT(0);
+    // Crear hilos para reloj, GPU, teclado, memoria
+    pthread_t clock_thread, traza_thread;
 
-    io_channel.direcciones = &direccion_bus;
-    io_channel.datos = &datos_bus;
-    io_channel.control = &control_bus;
+    // Crear computador: CPU, buses y memoria empiezan a cero
+    struct computador * comp = computador_crear();
+    if (comp == NULL) {
+        perror("computador_crear");
+        exit(1);
+    }
 
-    // Configurar memoria compartida para IO con el terminal
-    int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
-    if (shm_fd == -1) {
-        perror("shm_open");
+    comp->limite_instrucciones = max_instrucciones;
+    comp->limite_ciclos = max_ciclos;
+    if (cache_config.activa && (comp->cache = cache_crear(&cache_config)) == NULL) {
+        perror("cache");
         exit(1);
     }
-    if (ftruncate(shm_fd, sizeof(struct shared_io)) == -1) {
-        perror("ftruncate");
+    if (usar_segmentado && (comp->segmentado = segmentado_crear(segmentado_adelanto)) == NULL) {
+        perror("segmentado");
         exit(1);
     }
-    g_shm = (struct shared_io *)mmap(NULL, sizeof(struct shared_io), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (g_shm == MAP_FAILED) {
-        perror("mmap");
+    if (precarga_config.activa && (comp->precarga = precarga_crear(&precarga_config)) == NULL) {
+        perror("precarga");
         exit(1);
     }
-    close(shm_fd);
-    // Inicializar colas
-    memset((void*)g_shm, 0, sizeof(*g_shm));
-
-    pthread_create(&clock_thread, NULL, clk, NULL);
-    pthread_create(&gpu_thread, NULL, gpu, (void *)&io_channel);
-    pthread_create(&teclado_thread, NULL, teclado, (void *)&io_channel);
-    pthread_create(&memoria_thread, NULL, memoria, (void *)&io_channel);
-
-    // Crear computador y unidad de control
-    struct computador comp;
-    struct cpu cpu_inst;
-    comp.procesador = &cpu_inst;
-    comp.io = &io_channel;
-
-    // Inicializar CPU y buses
-    cpu_inst.pc = 0;
-    cpu_inst.registros[0] = 0; // X
-    cpu_inst.registros[1] = 0; // ACC
-    cpu_inst.flags.z = 0;
-    cpu_inst.flags.n = 0;
-    cpu_inst.flags.c = 0;
-    cpu_inst.flags.v = 0;
-
-    ESCRIBIR_BUS(io_channel.datos, 0);
-    ESCRIBIR_BUS(io_channel.control, 0);
+    if (mmu_config.activa) {
+        if ((comp->mmu = mmu_crear(&mmu_config)) == NULL) {
+            perror("mmu");
+            exit(1);
+        }
+        bus_iniciar(comp);
+    }
+    if (ruta_perfil != NULL) {
+        comp->perfil = calloc(1, sizeof(*comp->perfil));
+        if (comp->perfil == NULL) {
+            perror("perfil");
+            exit(1);
+        }
+        //Sin --simbolos se busca el listado junto a la ROM: prog.bin -> prog.lst
+        if (ruta_listado[0] == '\0' && ruta_restaurar == NULL) {
+            snprintf(ruta_listado, sizeof(ruta_listado), "%s", ruta_rom);
+            char * punto = strrchr(ruta_listado, '.');
+            if (punto == NULL || strchr(punto, '/') != NULL) punto = ruta_listado + strlen(ruta_listado);
+            snprintf(punto, sizeof(ruta_listado) - (size_t)(punto - ruta_listado), ".lst");
+            if (access(ruta_listado, R_OK) != 0) ruta_listado[0] = '\0';
+        }
+    }
 
-    // Ciclo principal de la unidad de control
-    while (1) {
-        unidad_de_control(&comp);
-        // Aquí se implementaría la decodificación y ejecución de la instrucción
-        // Por simplicidad, solo incrementamos el PC
+    //Sin terminal la ejecución es determinista: modo turbo, todo el teclado leído
+    //antes de empezar y la salida de la GPU a un fichero
+    FILE * avisos = stdout;
+    if (sin_terminal) {
+        modo_turbo = 1;
+        avisos = stderr;
+        if (ruta_entrada != NULL) {
+            char * entrada = leer_fichero(ruta_entrada, &comp->entrada_tam);
+            if (entrada == NULL) {
+                perror(ruta_entrada);
+                return 2;
+            }
+            comp->entrada = entrada;
+        }
+        comp->salida = strcmp(ruta_salida, "-") == 0 ? stdout : fopen(ruta_salida, "wb");
+        if (comp->salida == NULL) {
+            perror(ruta_salida);
+            return 2;
+        }
+    } else {
+        // Configurar memoria compartida para IO con el terminal
+        int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
+        if (shm_fd == -1) {
+            perror("shm_open");
+            exit(1);
+        }
+        if (ftruncate(shm_fd, SHM_TAM) == -1) {
+            perror("ftruncate");
+            exit(1);
+        }
+        comp->shm = (struct shared_io *)mmap(NULL, SHM_TAM, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        if (comp->shm == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        close(shm_fd);
+        // Inicializar colas
+        memset((void*)comp->shm, 0, sizeof(*comp->shm));
+        // Un terminal que ya estuviera esperando salida tiene una cabeza vieja
+        anillo_despertar(&comp->shm->vth);
+        // Página de estadísticas a continuación de las colas
+        estadisticas_iniciar(comp, (struct estadisticas *)((char *)comp->shm + SHM_OFFSET_ESTADISTICAS));
+    }
+
+    comp->ruta_snapshot = ruta_snapshot;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = snapshot_manejador_senal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (ruta_restaurar != NULL) {
+        if (snapshot_restaurar(comp, ruta_restaurar) != 0) {
+            fprintf(stderr, "%s: no se pudo restaurar la instantánea\n", ruta_restaurar);
+            return 2;
+        }
+    } else {
+        int rom = cargar_rom(comp, ruta_rom);
+        if (rom == -1) {
+            fprintf(avisos, "Advertencia: No se pudo abrir el archivo ROM. La memoria se inicializa en cero.\n");
+        } else if (rom == -2) {
+            fprintf(avisos, "Advertencia: La tabla de segmentos de la ROM no es válida. La memoria se inicializa en cero.\n");
+        } else if (rom > 0) {
+            fprintf(avisos, "Advertencia: No se pudo leer toda la ROM. La memoria se inicializa parcialmente.\n");
+        }
+    }
+
+    if (num_nucleos > 1) {
+        comp->ruta_snapshot = NULL;
+        if (nucleos_crear(comp, num_nucleos) != 0) {
+            perror("nucleos");
+            exit(1);
+        }
+    }
+
+    traza_configurar(nivel_traza, categorias_traza);
+#ifdef JIT_DISPONIBLE
+    usar_jit = usar_jit && jit_compatible(num_nucleos, nivel_traza, avisos);
+    if (usar_jit && jit_iniciar(comp) != 0) {
+        usar_jit = 0;
+    }
+#endif
+    if (nivel_traza > TRAZA_NIVEL_NADA) {
+        pthread_create(&traza_thread, NULL, trazador, NULL);
+    }
+
+    if (!modo_turbo) {
+        pthread_create(&clock_thread, NULL, clk, comp);
+    }
+
+    if (sin_terminal) {
+        //Sin informe de rendimiento: el tiempo real no es reproducible
+        if (comp->nucleos != NULL && nucleos_arrancar(comp->nucleos) != 0) {
+            perror("nucleos");
+            exit(1);
+        }
+        enum motivo_parada motivo = ejecutar_hasta_parada(comp);
+        if (comp->nucleos != NULL) nucleos_detener(comp->nucleos);
+        traza_volcar();
+        fflush(comp->salida);
+        FILE * estado = ruta_estado ? fopen(ruta_estado, "w") : stderr;
+        if (estado == NULL) {
+            perror(ruta_estado);
+            return 2;
+        }
+        escribir_estado(estado, comp);
+        if (estado != stderr) fclose(estado);
+        perfil_guardar(comp);
+        return codigos_salida[motivo];
+    }
+
+    comp_informe = comp;
+    clock_gettime(CLOCK_MONOTONIC, &inicio_ejecucion);
+    atexit(perfil_al_salir);
+    atexit(informe_rendimiento);
+    atexit(traza_volcar); //Se ejecuta antes que el informe
+
+    if (comp->nucleos != NULL && nucleos_arrancar(comp->nucleos) != 0) {
+        perror("nucleos");
+        exit(1);
     }
 
+    // Ciclo principal de la unidad de control
+    ejecutar(comp);
+
     // Unir hilos (nunca se alcanza en este ejemplo)
     pthread_join(clock_thread, NULL);
-    pthread_join(gpu_thread, NULL);
-    pthread_join(teclado_thread, NULL);
-    pthread_join(memoria_thread, NULL);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,7 +1,11 @@
 // terminal.c
 // Shared-memory terminal bridge:
-// - Read from shared VM->Host ring buffer and print to stdout
-// - Read from stdin and write to shared Host->VM ring buffer
+// - Drain the shared VM->Host ring to stdout with writev, straight from the ring
+// - Read stdin in chunks with readv, straight into the shared Host->VM ring
+// - Sleep in poll() on stdin and on an eventfd that a helper thread signals when
+//   the simulator rings the VM->Host doorbell, so an idle bridge uses no CPU
+// - On exit, report bytes moved per system call in each direction
+// - With --estadisticas, show the simulator's performance counters live instead
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,35 +18,220 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 
-// Shared memory layout must match simulator
-#define SHM_NAME "/asoc_shm"
-#define IO_BUF_SIZE 4096
-struct shared_io {
-    volatile unsigned int vth_head, vth_tail; // vm -> host (GPU output)
-    volatile unsigned int htv_head, htv_tail; // host -> vm (keyboard input)
-    char vth_buf[IO_BUF_SIZE];
-    char htv_buf[IO_BUF_SIZE];
+#include "asoc_shm.h"
+
+static const char *opcode_names[NUM_OPERACIONES] = {
+    "ST", "LD", "LDI", "ADD", "SUB", "MUL", "DIV", "MOD", "AND", "OR",
+    "XOR", "NOT", "JMP", "JZ", "JN", "CLR", "NOP", "DEC", "INC", "HALT",
+    "IVEC", "EI", "DI", "RETI", "WAIT", "XCHG"
 };
+static const char *mode_names[4] = { "IMM", "DIR", "IND", "IDX" };
+static const char *device_names[NUM_DISPOSITIVOS] = { "memoria", "GPU", "teclado", "sistema", "DMA" };
 
 static struct shared_io *g_shm = NULL;
 static struct termios oldt;
+static volatile sig_atomic_t g_quit = 0;
+
+// Throughput counters: the syscall counts should follow bursts, not bytes
+static struct {
+    unsigned long long bytes_out, writes;
+    unsigned long long bytes_in, reads;
+    unsigned long long wakeups;
+} g_io;
 
 static void restore_terminal(void) {
     tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
 }
 
+// Only flags the main loop: poll() returns EINTR and main reports and exits
 static void handle_signal(int sig) {
     (void)sig;
-    restore_terminal();
-    _exit(0);
+    g_quit = 1;
+}
+
+// The doorbell is a futex in the shared segment, which poll() cannot wait on, and
+// an eventfd cannot be handed to the unrelated simulator process. This thread
+// bridges the two: it sleeps on the VM->Host doorbell and bumps the eventfd
+// each time the producer head moves.
+static void *doorbell_thread(void *arg) {
+    int efd = *(int *)arg;
+    unsigned int seen = atomic_load(&g_shm->vth.cabeza);
+    while (1) {
+        anillo_esperar(&g_shm->vth, seen, NULL);
+        unsigned int head = atomic_load(&g_shm->vth.cabeza);
+        if (head != seen) {
+            seen = head;
+            uint64_t one = 1;
+            if (write(efd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                perror("eventfd");
+            }
+        }
+    }
+    return NULL;
+}
+
+// Write everything pending in the VM->Host ring, one writev per contiguous
+// burst (two iovecs when it wraps); -1 on error
+static int drain_output(void) {
+    struct iovec v[2];
+    while (anillo_datos(&g_shm->vth, ANILLO_TAM, v) > 0) {
+        ssize_t w = writev(STDOUT_FILENO, v, v[1].iov_len > 0 ? 2 : 1);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        anillo_consumir(&g_shm->vth, (size_t)w);
+        g_io.bytes_out += (unsigned long long)w;
+        g_io.writes++;
+    }
+    return 0;
+}
+
+static double per_call(unsigned long long bytes, unsigned long long calls) {
+    return calls ? (double)bytes / (double)calls : 0.0;
+}
+
+static void report_throughput(double seconds) {
+    if (seconds <= 0) seconds = 1e-9;
+    fprintf(stderr, "[TERMINAL] VM->host: %llu bytes in %llu writev (%.1f bytes/call, %.1f KB/s)\n",
+            g_io.bytes_out, g_io.writes, per_call(g_io.bytes_out, g_io.writes), g_io.bytes_out / seconds / 1024.0);
+    fprintf(stderr, "[TERMINAL] host->VM: %llu bytes in %llu readv (%.1f bytes/call, %.1f KB/s)\n",
+            g_io.bytes_in, g_io.reads, per_call(g_io.bytes_in, g_io.reads), g_io.bytes_in / seconds / 1024.0);
+    fprintf(stderr, "[TERMINAL] %llu wakeups in %.2f s\n", g_io.wakeups, seconds);
+}
+
+// Consistent copy of the stats page; 0 if the simulator has not published yet
+static int read_stats(const struct estadisticas *page, struct estadisticas *out) {
+    if (page->magico != ESTADISTICAS_MAGICO || page->version != ESTADISTICAS_VERSION || page->tam != sizeof(*page)) {
+        return 0;
+    }
+    const size_t data = offsetof(struct estadisticas, tiempo_ns);
+    for (;;) {
+        unsigned int before = atomic_load_explicit(&page->secuencia, memory_order_acquire);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy((char *)out + data, (const char *)page + data, sizeof(*out) - data);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&page->secuencia, memory_order_relaxed) == before) {
+            return before != 0;
+        }
+    }
+}
+
+static double pct(uint64_t part, uint64_t total) {
+    return total ? 100.0 * (double)part / (double)total : 0.0;
+}
+
+// Live view of the counters: redraws every 500 ms until interrupted
+static int show_stats(void) {
+    int fd = shm_open(SHM_NAME, O_RDONLY, 0);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || (size_t)st.st_size < SHM_TAM) {
+        fprintf(stderr, "No stats page in %s: start ./simulador first\n", SHM_NAME);
+        if (fd != -1) close(fd);
+        return 1;
+    }
+    const char *base = mmap(NULL, SHM_TAM, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    const struct estadisticas *page = (const struct estadisticas *)(base + SHM_OFFSET_ESTADISTICAS);
+    struct estadisticas cur, prev;
+    int have_prev = 0;
+    double mips = 0.0, mcycles = 0.0;
+    while (1) {
+        if (!read_stats(page, &cur)) {
+            printf("\033[H\033[JWaiting for the simulator...\n");
+            fflush(stdout);
+            have_prev = 0;
+            usleep(500000);
+            continue;
+        }
+        if (have_prev && cur.tiempo_ns > prev.tiempo_ns && cur.instrucciones >= prev.instrucciones) {
+            double dt = (double)(cur.tiempo_ns - prev.tiempo_ns) / 1e9;
+            mips = (double)(cur.instrucciones - prev.instrucciones) / dt / 1e6;
+            mcycles = (double)(cur.ciclos - prev.ciclos) / dt / 1e6;
+        } else if (have_prev && cur.tiempo_ns == prev.tiempo_ns) {
+            mips = mcycles = 0.0; // no new publication: stopped or blocked
+        }
+        if (!have_prev || cur.tiempo_ns != prev.tiempo_ns) {
+            prev = cur;
+            have_prev = 1;
+        }
+
+        uint64_t edges = cur.ciclos_busqueda + cur.ciclos_operando + cur.ciclos_ejecucion;
+        printf("\033[H\033[J");
+        printf("ASOC-V performance counters\n\n");
+        printf("Instructions %14llu   Cycles %14llu   CPI %.2f\n",
+               (unsigned long long)cur.instrucciones, (unsigned long long)cur.ciclos,
+               cur.instrucciones ? (double)cur.ciclos / (double)cur.instrucciones : 0.0);
+        printf("MIPS %10.2f   Mcycles/s %10.2f\n", mips, mcycles);
+        printf("Bus utilisation %5.1f%%   inhibited (INHIBIR_BUS) %llu edges\n",
+               pct(cur.transacciones, edges), (unsigned long long)cur.ciclos_bus_inhibido);
+        printf("Cycles: fetch %5.1f%%  operand %5.1f%%  execute %5.1f%%\n",
+               pct(cur.ciclos_busqueda, edges), pct(cur.ciclos_operando, edges), pct(cur.ciclos_ejecucion, edges));
+        printf("Decoded-instruction cache: %llu hits, %llu misses\n",
+               (unsigned long long)cur.cache_instr_aciertos, (unsigned long long)cur.cache_instr_fallos);
+        printf("Interrupts %llu   edges idle in WAIT %llu\n",
+               (unsigned long long)cur.interrupciones, (unsigned long long)cur.ciclos_espera);
+        printf("DMA transfers %llu   words %llu\n\n",
+               (unsigned long long)cur.dma_transferencias, (unsigned long long)cur.dma_palabras);
+
+        printf("%-6s %14s %14s\n", "mode", "reads", "writes");
+        for (int m = 0; m < 4; m++) {
+            printf("%-6s %14llu %14llu\n", mode_names[m], (unsigned long long)cur.lecturas[m], (unsigned long long)cur.escrituras[m]);
+        }
+        printf("%-6s %14llu\n\n", "fetch", (unsigned long long)cur.lecturas_busqueda);
+
+        printf("%-8s %14s %14s\n", "device", "reads", "writes");
+        for (int d = 0; d < NUM_DISPOSITIVOS; d++) {
+            printf("%-8s %14llu %14llu\n", device_names[d], (unsigned long long)cur.accesos[d][0], (unsigned long long)cur.accesos[d][1]);
+        }
+
+        // Top opcode/mode pairs by executions
+        printf("\n%-10s %14s %7s\n", "opcode", "executions", "share");
+        int shown[NUM_OPERACIONES * 4] = {0};
+        for (int row = 0; row < 10; row++) {
+            int best = -1;
+            for (int i = 0; i < NUM_OPERACIONES * 4; i++) {
+                if (!shown[i] && cur.ejecuciones[i] && (best < 0 || cur.ejecuciones[i] > cur.ejecuciones[best])) best = i;
+            }
+            if (best < 0) break;
+            shown[best] = 1;
+            char name[16];
+            snprintf(name, sizeof(name), "%s %s", opcode_names[best / 4], mode_names[best % 4]);
+            printf("%-10s %14llu %6.1f%%\n", name, (unsigned long long)cur.ejecuciones[best], pct(cur.ejecuciones[best], cur.instrucciones));
+        }
+        fflush(stdout);
+        usleep(500000);
+    }
+    return 0;
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
     struct termios newt;
+    if (argc > 1 && strcmp(argv[1], "--estadisticas") == 0) {
+        return show_stats();
+    }
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
     signal(SIGQUIT, handle_signal);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     // Open shared memory
     int fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
@@ -50,7 +239,9 @@ int main(void) {
         perror("shm_open");
         return 1;
     }
-    if (ftruncate(fd, sizeof(struct shared_io)) == -1) {
+    // Never shrink it: the simulator sizes it for the stats page too
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size < SHM_TAM && ftruncate(fd, SHM_TAM) == -1) {
         // It's ok if the simulator already sized it; ignore error
     }
     g_shm = (struct shared_io*)mmap(NULL, sizeof(struct shared_io), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
@@ -61,43 +252,86 @@ int main(void) {
     }
     close(fd);
 
-    // Set terminal to raw, non-blocking stdin
+    // Set terminal to raw. stdin stays blocking: poll() says when to read, and
+    // on a tty stdout usually shares its file description, so O_NONBLOCK there
+    // would make writev fail with EAGAIN
     tcgetattr(STDIN_FILENO, &oldt);
     newt = oldt;
     newt.c_lflag &= ~(ICANON | ECHO);
     tcsetattr(STDIN_FILENO, TCSANOW, &newt);
     atexit(restore_terminal);
-    int fl = fcntl(STDIN_FILENO, F_GETFL, 0);
-    if (fl != -1) fcntl(STDIN_FILENO, F_SETFL, fl | O_NONBLOCK);
 
-    char buf;
-    while (1) {
-        // Drain VM->Host buffer
-        if (g_shm) {
-            while (g_shm->vth_head != g_shm->vth_tail) {
-                unsigned int tail = g_shm->vth_tail;
-                char c = g_shm->vth_buf[tail];
-                g_shm->vth_tail = (tail + 1) % IO_BUF_SIZE;
-                if (write(STDOUT_FILENO, &c, 1) == -1) {
-                    perror("write");
-                    break;
-                }
-            }
+    int efd = eventfd(0, EFD_NONBLOCK);
+    if (efd == -1) {
+        perror("eventfd");
+        return 1;
+    }
+    // Signals must reach the main thread so that they interrupt poll()
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    pthread_t doorbell;
+    if (pthread_create(&doorbell, NULL, doorbell_thread, &efd) != 0) {
+        perror("pthread_create");
+        return 1;
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = efd, .events = POLLIN },
+    };
+    int stdin_open = 1;
+    struct iovec v[2];
+    while (!g_quit) {
+        // Drain VM->Host ring; the doorbell thread may have fired for bytes
+        // already taken here, so a wakeup with nothing to read is fine
+        if (drain_output() == -1) {
+            perror("write");
+            break;
         }
 
-        // Read from stdin
-        ssize_t n = read(STDIN_FILENO, &buf, 1);
-        if (n > 0 && g_shm) {
-            unsigned int head = g_shm->htv_head;
-            unsigned int next = (head + 1) % IO_BUF_SIZE;
-            if (next != g_shm->htv_tail) {
-                g_shm->htv_buf[head] = buf;
-                g_shm->htv_head = next;
+        // While the Host->VM ring is full, leave stdin in the kernel and look
+        // again shortly: the VM does not ring when it consumes
+        int timeout = -1;
+        fds[0].fd = stdin_open ? STDIN_FILENO : -1;
+        if (stdin_open && anillo_libre(&g_shm->htv, 1, v) == 0) {
+            fds[0].fd = -1;
+            timeout = 10;
+        }
+        int r = poll(fds, 2, timeout);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        g_io.wakeups++;
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                perror("eventfd");
+            }
+        }
+        if (fds[0].fd != -1 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            // Everything that is ready and fits, straight into the ring
+            anillo_libre(&g_shm->htv, ANILLO_TAM, v);
+            ssize_t n = readv(STDIN_FILENO, v, v[1].iov_len > 0 ? 2 : 1);
+            if (n > 0) {
+                anillo_publicar(&g_shm->htv, (size_t)n);
+                g_io.bytes_in += (unsigned long long)n;
+                g_io.reads++;
+            } else if (n == 0 || errno != EINTR) {
+                // End of input: keep showing VM output, stop polling stdin
+                stdin_open = 0;
             }
         }
-
-        usleep(10000);
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    restore_terminal();
+    report_throughput((double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9);
     return 0;
 }
\ No newline at end of file